@@ -0,0 +1,26 @@
+#!/bin/sh
+# Second half of the PGO training run (see pgo-train in CMakeLists.txt): the HTTP
+# server under the load generator, then a batch-mode replay of the simple shop.
+# Usage: pgo_train.sh <online_shopping_cart_adv> <online_shopping_cart>
+set -e
+adv="$1"
+basic="$2"
+port=18980
+
+# loadgen checks out with method=instant, which serve only accepts with --test-payments.
+"$adv" serve "$port" 1000 --test-payments > /dev/null &
+server=$!
+sleep 1
+report=$("$adv" loadgen "$port" 32 3 --threads=2 --products=1000)
+kill -TERM "$server"
+wait "$server" || true
+# Fail the training run if every checkout was rejected: the profile would miss that path.
+# (Many fail normally, once the hottest products sell out.)
+echo "$report" | awk '$1 == "checkout" && $3 >= $2 { bad = 1 } END { exit bad }' || {
+    echo "pgo_train.sh: loadgen checkouts failed:" >&2
+    echo "$report" >&2
+    exit 1
+}
+
+awk 'BEGIN { for (i = 1; i <= 200000; i++) print (i % 50 ? "add 2 1" : "list\ncheckout card") }' \
+    | "$basic" --batch > /dev/null
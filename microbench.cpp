@@ -0,0 +1,113 @@
+// microbench.cpp
+
+#include "microbench.hpp"
+
+void runMicroBenchmarks(MicroBench &bench) {
+    Inventory &inv = Inventory::instance();
+    const string snapshot = "/tmp/shop-microbench-" + to_string(getpid()) + ".csv";
+    bench.header();
+    int have = 0;
+    for (int n : {100, 10000, 1000000}) {
+        for (; have < n; ++have) inv.addProduct(Product(have + 1, "Product " + to_string(have + 1), 1.0 + have % 100, 1 << 30));
+        bench.run("Inventory::getProduct", n, [&](long it) {
+            for (long i = 0; i < it; ++i) { Product p = inv.getProduct(static_cast<int>(1 + (i * 7919) % n)); keepAlive(p); }
+        });
+        bench.run("Inventory::getProduct miss (throw)", n, [&](long it) {
+            for (long i = 0; i < it; ++i) {
+                try { Product p = inv.getProduct(-1 - static_cast<int>(i % n)); keepAlive(p); } catch (const ShopException &e) { keepAlive(e); }
+            }
+        });
+        bench.run("Inventory::tryGetProduct miss", n, [&](long it) {
+            for (long i = 0; i < it; ++i) { Expected<Product> p = inv.tryGetProduct(-1 - static_cast<int>(i % n)); keepAlive(p); }
+        });
+        bench.run("Inventory::reduceStock", n, [&](long it) {
+            for (long i = 0; i < it; ++i) { bool ok = inv.reduceStock(static_cast<int>(1 + (i * 7919) % n), 1); keepAlive(ok); }
+        });
+        bench.run("Inventory::listAll", n, [&](long it) {
+            for (long i = 0; i < it; ++i) { pmr::vector<Product> all = inv.listAll(); keepAlive(all); }
+        });
+        bench.run("Inventory::listAll (arena)", n, [&](long it) {
+            for (long i = 0; i < it; ++i) { RequestArena arena; pmr::vector<Product> all = inv.listAll(arena.resource()); keepAlive(all); }
+        });
+        bench.run("listing: listAll + operator<<", n, [&](long it) {
+            for (long i = 0; i < it; ++i) {
+                ostringstream os;
+                for (auto &p : inv.listAll()) os << p << '\n';
+                keepAlive(os);
+            }
+        });
+        {
+            ListingCache listing(inv);
+            bench.run("ListingCache::get (unchanged)", n, [&](long it) {
+                for (long i = 0; i < it; ++i) { shared_ptr<const string> s = listing.get(); keepAlive(s); }
+            });
+            bench.run("ListingCache::get (1 product changed)", n, [&](long it) {
+                for (long i = 0; i < it; ++i) {
+                    inv.reduceStock(static_cast<int>(1 + (i * 7919) % n), 1);
+                    shared_ptr<const string> s = listing.get();
+                    keepAlive(s);
+                }
+            });
+        }
+        bench.run("Inventory::saveToFile", n, [&](long it) {
+            for (long i = 0; i < it; ++i) inv.saveToFile(snapshot);
+        });
+    }
+    unlink(snapshot.c_str());
+
+    string block(4096, '\0');
+    for (size_t i = 0; i < block.size(); ++i) block[i] = static_cast<char>(i * 131);
+    bench.run("Crc32c::software (4 KB)", 4096, [&](long it) {
+        for (long i = 0; i < it; ++i) { uint32_t c = Crc32c::software(0, block.data(), block.size()); keepAlive(c); }
+    });
+    if (Crc32c::hasHardware)
+        bench.run("Crc32c::hardware (4 KB)", 4096, [&](long it) {
+            for (long i = 0; i < it; ++i) { uint32_t c = Crc32c::hardware(0, block.data(), block.size()); keepAlive(c); }
+        });
+
+    Product sample(42, "Wireless Mouse", 19.99, 120);
+    for (int lines : {1, 10, 100}) {
+        ShoppingCart cart;
+        for (int i = 0; i < lines; ++i) cart.addToCart(Product(i + 1, "Product " + to_string(i + 1), 1.5 + i, 100), 1 + i % 3);
+        bench.run("ShoppingCart::total", lines, [&](long it) {
+            for (long i = 0; i < it; ++i) { double t = cart.total(); keepAlive(t); }
+        });
+        bench.run("ShoppingCart::addToCart", lines, [&](long it) {
+            ShoppingCart c;
+            for (long i = 0; i < it; ++i) {
+                if (i % lines == 0) c.clear();
+                c.addToCart(sample, 1);
+            }
+            keepAlive(c);
+        });
+        const pmr::vector<CartItem> &items = cart.getItems();
+        bench.run("Order::Order", lines, [&](long it) {
+            for (long i = 0; i < it; ++i) { Order o(items); keepAlive(o); }
+        });
+        bench.run("Order::Order (arena)", lines, [&](long it) {
+            for (long i = 0; i < it; ++i) { RequestArena arena; Order o(items, arena.resource()); keepAlive(o); }
+        });
+    }
+
+    // Steady-state cart lifecycle: fill a cart and check it out, over and over.
+    ShopService shop(inv);
+    InstantPayment instant;
+    for (int lines : {1, 10}) {
+        bench.run("ShopService add+checkout", lines, [&](long it) {
+            for (long i = 0; i < it; ++i) {
+                for (int l = 0; l < lines; ++l) shop.addToCart(7, 1 + l, 1);
+                Order o = shop.checkout(7, instant);
+                keepAlive(o);
+            }
+        });
+    }
+
+    bench.run("operator<<(Product)", 1, [&](long it) {
+        ostringstream os;
+        for (long i = 0; i < it; ++i) {
+            os << sample;
+            if ((i & 1023) == 1023) os.str("");
+        }
+        keepAlive(os);
+    });
+}
@@ -0,0 +1,93 @@
+// microbench.hpp
+// Microbenchmark harness and the core shop operation cases.
+
+#ifndef MICROBENCH_HPP
+#define MICROBENCH_HPP
+
+#include "shop_core.hpp"
+
+// -------------------- Microbenchmarks --------------------
+// Each case runs `body(iterations)` for a warm-up pass (which also calibrates the
+// iteration count to roughly `minMillis` per repetition) and then `reps` timed passes.
+// Results are printed as a table and optionally written as JSON for diffing runs.
+// allocs/op counts global operator new calls during the timed passes; it stays 0 unless
+// the binary counts them into AllocCounters::heapAllocs (shop_bench does).
+template<class T> inline void keepAlive(const T &v) { asm volatile("" : : "g"(&v) : "memory"); }
+
+struct MicroResult {
+    string name;
+    long param;
+    long iterations;
+    vector<double> nsPerOp; // one entry per repetition
+    double allocsPerOp;
+};
+
+class MicroBench {
+private:
+    int reps;
+    double minMillis;
+    string filter;
+    vector<MicroResult> results;
+
+    static double stat(const vector<double> &v, const string &which) {
+        vector<double> s = v;
+        sort(s.begin(), s.end());
+        if (which == "min") return s.front();
+        if (which == "median") return s[s.size() / 2];
+        double mean = accumulate(s.begin(), s.end(), 0.0) / s.size();
+        if (which == "mean") return mean;
+        double var = 0;
+        for (double x : s) var += (x - mean) * (x - mean);
+        return sqrt(var / s.size());
+    }
+
+public:
+    MicroBench(int r, double ms, string f) : reps(max(1, r)), minMillis(ms), filter(move(f)) {}
+
+    void run(const string &name, long param, const function<void(long)> &body) {
+        if (!filter.empty() && name.find(filter) == string::npos) return;
+        long iters = 1;
+        while (true) { // warm-up + calibration
+            auto t0 = chrono::steady_clock::now();
+            body(iters);
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+            if (ms >= minMillis || iters >= (1L << 40)) break;
+            iters = ms < 1e-3 ? iters * 16 : max(iters * 2, static_cast<long>(iters * minMillis / ms));
+        }
+        MicroResult r{name, param, iters, {}, 0};
+        uint64_t allocs = AllocCounters::heapAllocs.load(memory_order_relaxed);
+        for (int i = 0; i < reps; ++i) {
+            auto t0 = chrono::steady_clock::now();
+            body(iters);
+            r.nsPerOp.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / iters);
+        }
+        r.allocsPerOp = static_cast<double>(AllocCounters::heapAllocs.load(memory_order_relaxed) - allocs) / (static_cast<double>(iters) * reps);
+        cout << left << setw(36) << name << right << setw(9) << param << fixed << setprecision(1)
+             << setw(12) << stat(r.nsPerOp, "median") << setw(12) << stat(r.nsPerOp, "min")
+             << setw(10) << stat(r.nsPerOp, "stddev") << setprecision(2) << setw(11) << r.allocsPerOp << "\n" << flush;
+        results.push_back(move(r));
+    }
+
+    void header() const {
+        cout << left << setw(36) << "benchmark" << right << setw(9) << "size" << setw(12) << "median ns"
+             << setw(12) << "min ns" << setw(10) << "stddev" << setw(11) << "allocs/op" << "\n";
+    }
+
+    void writeJson(ostream &os) const {
+        os << "{\n  \"repetitions\": " << reps << ",\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const MicroResult &r = results[i];
+            os << "    {\"name\": \"" << jsonEscape(r.name) << "\", \"size\": " << r.param << ", \"iterations\": " << r.iterations
+               << fixed << setprecision(3) << ", \"median_ns\": " << stat(r.nsPerOp, "median") << ", \"min_ns\": " << stat(r.nsPerOp, "min")
+               << ", \"mean_ns\": " << stat(r.nsPerOp, "mean") << ", \"stddev_ns\": " << stat(r.nsPerOp, "stddev") << ", \"allocs_per_op\": " << r.allocsPerOp << ", \"runs_ns\": [";
+            for (size_t k = 0; k < r.nsPerOp.size(); ++k) os << (k ? ", " : "") << r.nsPerOp[k];
+            os << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        os << "  ]\n}\n";
+    }
+};
+
+// Catalog sizes grow monotonically because the benchmarks share the Inventory singleton.
+void runMicroBenchmarks(MicroBench &bench);
+
+#endif // MICROBENCH_HPP
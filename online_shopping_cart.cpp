@@ -2,150 +2,10 @@
 // Demonstrates OOP features: Encapsulation, Inheritance, Polymorphism, Abstraction
 // Also includes Operator Overloading, Templates, Exception Handling, and File I/O
 
-#include <iostream>
-#include <vector>
-#include <string>
-#include <fstream>
-#include <iomanip>
-using namespace std;
-
-// ----------------- Exception Class -----------------
-class ShopException : public runtime_error {
-public:
-    explicit ShopException(const string &msg) : runtime_error(msg) {}
-};
-
-// ----------------- Product Class -----------------
-class Product {
-private:
-    int id;
-    string name;
-    double price;
-    int stock;
-public:
-    Product(int i=0, string n="", double p=0, int s=0)
-        : id(i), name(n), price(p), stock(s) {}
-
-    // Encapsulation (Getters & Setters)
-    int getId() const { return id; }
-    string getName() const { return name; }
-    double getPrice() const { return price; }
-    int getStock() const { return stock; }
-
-    void setPrice(double p) { if (p<0) throw ShopException("Invalid price"); price=p; }
-    void setStock(int s) { if (s<0) throw ShopException("Invalid stock"); stock=s; }
-
-    bool reduceStock(int qty) {
-        if (qty <= 0) return false;
-        if (qty > stock) return false;
-        stock -= qty;
-        return true;
-    }
-
-    // Operator Overloading
-    friend ostream& operator<<(ostream &os, const Product &p) {
-        os << "[" << p.id << "] " << p.name << " - $" << fixed << setprecision(2) << p.price
-           << " (stock: " << p.stock << ")";
-        return os;
-    }
-};
-
-// ----------------- CartItem -----------------
-class CartItem {
-public:
-    Product product;
-    int quantity;
-
-    CartItem(Product p, int q) : product(p), quantity(q) {}
-    double subtotal() const { return product.getPrice() * quantity; }
-};
-
-// ----------------- User & Admin (Inheritance) -----------------
-class User {
-protected:
-    string name;
-public:
-    User(string n="Guest") : name(n) {}
-    virtual string role() const { return "User"; } // Polymorphism
-    string getName() const { return name; }
-};
-
-class Admin : public User {
-public:
-    Admin(string n) : User(n) {}
-    string role() const override { return "Admin"; }
-};
-
-// ----------------- Payment (Abstraction) -----------------
-class Payment {
-public:
-    virtual bool pay(double amount) = 0;
-    virtual ~Payment() {}
-};
-
-class CardPayment : public Payment {
-public:
-    bool pay(double amount) override {
-        cout << "Paid $" << amount << " using Credit Card." << endl;
-        return true;
-    }
-};
-
-class PayPalPayment : public Payment {
-public:
-    bool pay(double amount) override {
-        cout << "Paid $" << amount << " using PayPal." << endl;
-        return true;
-    }
-};
-
-// ----------------- ShoppingCart -----------------
-class ShoppingCart {
-    vector<CartItem> items;
-public:
-    void addItem(Product p, int q) { items.push_back(CartItem(p,q)); }
-    void viewCart() {
-        double total=0;
-        for (auto &c : items) {
-            cout << c.product.getName() << " x" << c.quantity << " = $" << c.subtotal() << endl;
-            total+=c.subtotal();
-        }
-        cout << "Total: $" << total << endl;
-    }
-    double total() {
-        double t=0; for(auto &c:items) t+=c.subtotal(); return t;
-    }
-    vector<CartItem> getItems(){ return items; }
-    void clear(){ items.clear(); }
-    bool empty(){ return items.empty(); }
-};
-
-// ----------------- Order -----------------
-class Order {
-    static int orderCounter;
-    int id;
-    vector<CartItem> items;
-    double amount;
-public:
-    Order(vector<CartItem> its) : items(its) {
-        id=++orderCounter;
-        amount=0;
-        for(auto &c:its) amount+=c.subtotal();
-    }
-    void showOrder(){
-        cout << "Order #" << id << " Summary:" << endl;
-        for(auto &c:items) cout << c.product.getName() << " x" << c.quantity << endl;
-        cout << "Total: $" << amount << endl;
-    }
-};
-int Order::orderCounter=0;
-
-// ----------------- Template Function -----------------
-template<class T>
-void showVector(vector<T> v){ for(auto &x:v) cout << x << endl; }
+#include "shop_basic.hpp"
 
 // ----------------- Main -----------------
-int main(){
+int main(int argc, char **argv){
     vector<Product> products = {
         Product(1,"Book",10.5,10),
         Product(2,"Pen",2.5,20),
@@ -153,6 +13,17 @@ int main(){
     };
 
     ShoppingCart cart;
+    // Batch mode: online_shopping_cart --batch [commands.txt]  (reads stdin when no file or "-")
+    if(argc>1 && string(argv[1])=="--batch"){
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+        if(argc>2 && string(argv[2])!="-"){
+            ifstream ifs(argv[2]);
+            if(!ifs){ cerr << "Cannot open " << argv[2] << endl; return 1; }
+            return runBatch(ifs, products, cart);
+        }
+        return runBatch(cin, products, cart);
+    }
     User u("Alice");
     cout << "Welcome, " << u.getName() << " (" << u.role() << ")" << endl;
 
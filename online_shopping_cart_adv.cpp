@@ -1,208 +1,211 @@
 // OnlineShoppingCart.cpp
-// A single-file C++ example project demonstrating OOP features
+// Entry point of the advanced shop: a console demo by default, plus server,
+// benchmark and load-generator modes (see Usage below).
 // - Encapsulation, Inheritance, Polymorphism (runtime and compile-time), Abstraction
 // - Operator overloading, Templates, Exceptions, File I/O, STL usage
 // - Smart pointers and RAII
 
-#include <bits/stdc++.h>
-using namespace std;
+#include "shop_core.hpp"
+#include "shop_net.hpp"
+#include "shop_runtime.hpp"
+#include "shop_repl.hpp"
+#include "shop_store.hpp"
 
-// -------------------- Exceptions --------------------
-class ShopException : public runtime_error {
-public:
-    explicit ShopException(const string &msg) : runtime_error(msg) {}
-};
-
-// -------------------- Product --------------------
-class Product {
-private:
-    int id;
-    string name;
-    double price;
-    int stock;
-public:
-    Product(int i=0, string n="", double p=0, int s=0)
-        : id(i), name(n), price(p), stock(s) {}
-
-    // Encapsulation: getters/setters
-    int getId() const { return id; }
-    string getName() const { return name; }
-    double getPrice() const { return price; }
-    int getStock() const { return stock; }
-
-    void setPrice(double p) { if (p<0) throw ShopException("Price can't be negative"); price = p; }
-    void setStock(int s) { if (s<0) throw ShopException("Stock can't be negative"); stock = s; }
-
-    bool reduceStock(int qty) {
-        if (qty <= 0) return false;
-        if (qty > stock) return false;
-        stock -= qty;
-        return true;
-    }
-
-    void increaseStock(int qty) { if (qty>0) stock += qty; }
-
-    // Operator overloading
-    friend ostream& operator<<(ostream &os, const Product &p) {
-        os << "[" << p.id << "] " << p.name << " - $" << fixed << setprecision(2) << p.price
-           << " (stock: " << p.stock << ")";
-        return os;
-    }
-
-    bool operator==(const Product &other) const { return id == other.id; }
-};
-
-// -------------------- CartItem --------------------
-class CartItem {
-public:
-    Product product;
-    int quantity;
-
-    CartItem(const Product &p, int q): product(p), quantity(q) {}
-
-    double subtotal() const { return product.getPrice() * quantity; }
-};
-
-// -------------------- User & Admin (Inheritance) --------------------
-class User {
-protected:
-    string username;
-    string email;
-public:
-    explicit User(string uname="guest", string mail="") : username(move(uname)), email(move(mail)) {}
-    virtual ~User() = default;
-
-    string getName() const { return username; }
-    string getEmail() const { return email; }
-
-    // Abstraction + Polymorphism: virtual function for user type
-    virtual string role() const { return "User"; }
-};
-
-class Admin : public User {
-public:
-    Admin(string uname, string mail): User(move(uname), move(mail)) {}
-    string role() const override { return "Admin"; }
-
-    // Admin-specific operations could be added
-};
-
-// -------------------- Payment (Abstract) --------------------
-class Payment {
-public:
-    virtual ~Payment() = default;
-    virtual bool pay(double amount) = 0; // returns true on success
-};
-
-class CreditCardPayment : public Payment {
-private:
-    string cardNumber;
-    string nameOnCard;
-public:
-    CreditCardPayment(string card, string name) : cardNumber(move(card)), nameOnCard(move(name)) {}
-    bool pay(double amount) override {
-        cout << "Processing credit card payment for $" << fixed << setprecision(2) << amount << "...\n";
-        // Fake processing
-        if (cardNumber.empty()) return false;
-        cout << "Paid by Credit Card (" << nameOnCard << ")\n";
-        return true;
-    }
-};
-
-class PayPalPayment : public Payment {
-private:
-    string accountEmail;
-public:
-    explicit PayPalPayment(string email) : accountEmail(move(email)) {}
-    bool pay(double amount) override {
-        cout << "Processing PayPal payment for $" << fixed << setprecision(2) << amount << "...\n";
-        if (accountEmail.empty()) return false;
-        cout << "Paid by PayPal (" << accountEmail << ")\n";
-        return true;
-    }
-};
-
-// -------------------- Inventory (Singleton) --------------------
-class Inventory {
-private:
-    unordered_map<int, Product> products; // id -> product
-    Inventory() { }
-public:
-    Inventory(const Inventory&) = delete;
-    Inventory& operator=(const Inventory&) = delete;
-
-    static Inventory& instance() {
-        static Inventory inv;
-        return inv;
-    }
-
-    void addProduct(const Product &p) { products[p.getId()] = p; }
-    bool hasProduct(int id) const { return products.find(id) != products.end(); }
-
-    Product getProduct(int id) const {
-        auto it = products.find(id);
-        if (it == products.end()) throw ShopException("Product not found");
-        return it->second;
-    }
-
-    bool reduceStock(int id, int qty) {
-        auto it = products.find(id);
-        if (it == products.end()) return false;
-        return it->second.reduceStock(qty);
-    }
-
-    vector<Product> listAll() const {
-        vector<Product> out;
-        for (auto &kv : products) out.push_back(kv.second);
-        sort(out.begin(), out.end(), [](const Product &a, const Product &b){ return a.getId() < b.getId(); });
-        return out;
+// -------------------- Main --------------------
+// Usage (options are --name=value and may appear anywhere after the mode):
+//   online_shopping_cart_adv                                  console demo
+//   online_shopping_cart_adv serve [port] [products]          HTTP/1.1 server on 127.0.0.1
+//   online_shopping_cart_adv bench-http [port] [conns] [requests] [pipeline] [path]
+//   online_shopping_cart_adv serve-rpc [socket] [products]     binary RPC on a Unix socket
+//   online_shopping_cart_adv bench-rpc [socket] [requests] [inflight] [products]
+//   online_shopping_cart_adv serve-router [port] --partitions=<socket>,<socket>,...   HTTP over partition workers
+//   online_shopping_cart_adv bench-partition [partitions] [products] [lookups]
+//   online_shopping_cart_adv bench-escrow [nodes] [threads] [stock] [seconds]
+//   online_shopping_cart_adv bench-io [requests] [conns] [pipeline] [commits]
+//   online_shopping_cart_adv loadgen [port] [users] [seconds] --threads= --products= --zipf= --think-ms=
+//                                    --mix=list:view:add:checkout (weights, default 10:60:20:10)
+//   online_shopping_cart_adv bench-shards [shards] [clients] [orders/client] [products]
+//   online_shopping_cart_adv bench-pool [threads] [shoppers] [products]
+//   online_shopping_cart_adv bench-store [dir] [keys] [value-bytes]
+//   online_shopping_cart_adv bench-checkpoint [file] [products] [writers]
+//   online_shopping_cart_adv bench-cache [dir] [products] [cache-entries] [lookups]
+//   online_shopping_cart_adv verify <snapshot|journal|store-dir>   checks every block checksum
+//   online_shopping_cart_adv bench-repl [followers] [seconds] [products]
+// Server options: --io=auto|epoll|uring   --journal=<file> (order journal, off by default)
+//                 --store=<dir> keeps the catalog (and, without --journal, the orders) in an LSM store
+//                 --trace[=<file>] records checkout spans; the file is written on shutdown
+//                 --test-payments (serve) accepts checkout?method=instant, which always succeeds; for loadgen only
+//                 --checkpoint=<file> enables POST /checkpoint (forked copy-on-write snapshot)
+//                 --load=<snapshot> starts from a saved catalog (refused if any block is damaged)
+//                 --repl=<socket> ships catalog changes to followers connecting there (primary)
+//                 --follow=<socket> (serve only) mirrors a primary's catalog and serves reads
+//                 --partition=<i>/<n> holds only the products partitionOf assigns to worker i of n
+//                 --escrow (serve-router) sells hot products from a local stock quota
+// Any mode: --no-metrics turns off per-operation latency recording (see GET /stats)
+//           --mem-budget=carts:64M,orders:1M,... soft per-subsystem budgets (see GET /stats/memory)
+int main(int argc, char **argv) {
+    string mode = argc > 1 ? argv[1] : "";
+    vector<string> args;
+    map<string, string> options;
+    for (int i = 2; i < argc; ++i) {
+        string a = argv[i];
+        size_t eq = a.find('=');
+        if (a.rfind("--", 0) == 0) options[a.substr(2, eq == string::npos ? string::npos : eq - 2)] = eq == string::npos ? "" : a.substr(eq + 1);
+        else args.push_back(a);
     }
-
-    void saveToFile(const string &fname) const {
-        ofstream ofs(fname);
-        for (auto &kv : products) {
-            const Product &p = kv.second;
-            ofs << p.getId() << ',' << p.getName() << ',' << p.getPrice() << ',' << p.getStock() << '\n';
+    auto arg = [&](size_t i, const char *def) { return i < args.size() ? args[i] : string(def); };
+    auto option = [&](const string &name, const char *def) { auto it = options.find(name); return it != options.end() ? it->second : string(def); };
+    if (options.count("no-metrics")) ShopMetrics::enabled = false;
+    try {
+        if (options.count("mem-budget")) MemoryAccounting::instance().setBudgets(option("mem-budget", ""));
+        if (mode == "serve" || mode == "serve-rpc") {
+            signal(SIGINT, onStopSignal);
+            signal(SIGTERM, onStopSignal);
+            signal(SIGPIPE, SIG_IGN);
+            string io = option("io", "auto");
+            bool follower = options.count("follow") > 0;
+            if (follower && mode != "serve") throw ShopException("--follow needs the HTTP server");
+            unique_ptr<LsmStore> store;
+            if (options.count("store")) store = make_unique<LsmStore>(option("store", ""));
+            if (options.count("load")) Inventory::instance().loadFromFile(option("load", ""));
+            else if ((!store || Inventory::instance().attachStore(*store) == 0) && !follower) {
+                int part = 0, parts = 1;
+                if (options.count("partition") && (sscanf(option("partition", "").c_str(), "%d/%d", &part, &parts) != 2 || part < 0 || part >= parts))
+                    throw ShopException("--partition must be <i>/<n> with 0 <= i < n");
+                seedCatalog(Inventory::instance(), stoi(arg(1, "2")), [&](int id) { return partitionOf(id, parts) == part; });
+            }
+            unique_ptr<ReplicationPrimary> primary;
+            unique_ptr<ReplicationFollower> replica;
+            if (follower) {
+                replica = make_unique<ReplicationFollower>(Inventory::instance(), option("follow", ""));
+            } else if (options.count("repl")) {
+                primary = make_unique<ReplicationPrimary>(Inventory::instance(), option("repl", ""));
+                Inventory::instance().setChangeSink(primary.get());
+            }
+            ShopService shop(Inventory::instance());
+            Tracer::enabled = options.count("trace") > 0;
+            unique_ptr<OrderJournal> journal;
+            if (options.count("journal")) journal = makeJournal(io, option("journal", ""));
+            else if (store) journal = make_unique<LsmJournal>(*store);
+            if (journal) shop.setJournal(journal.get());
+            if (mode == "serve") {
+                ShopHttpHandler handler(shop, option("checkpoint", ""));
+                if (options.count("test-payments")) handler.setPayments(makeTestPayment);
+                if (primary) handler.setReplication([&] { return primary->statsJson(); }, false);
+                if (replica) handler.setReplication([&] { return replica->statsJson(); }, true);
+                int port = stoi(arg(0, "8080"));
+                unique_ptr<EventServer> server = makeServer(io, listenTcp("127.0.0.1", port), [&] { return make_unique<HttpProtocol>(handler); });
+                cout << "Serving HTTP on 127.0.0.1:" << port << endl;
+                server->run();
+            } else {
+                string path = arg(0, "/tmp/shop.sock");
+                EscrowLedger escrow(Inventory::instance());
+                unique_ptr<EventServer> server = makeServer(io, listenUnix(path), [&] { return make_unique<RpcProtocol>(shop, &escrow); });
+                cout << "Serving RPC on " << path << endl;
+                server->run();
+                unlink(path.c_str());
+            }
+            Inventory::instance().setChangeSink(nullptr);
+            if (!option("trace", "").empty()) {
+                ofstream ofs(option("trace", ""));
+                Tracer::instance().writeJson(ofs);
+            }
+            return 0;
         }
+        if (mode == "serve-router") {
+            signal(SIGINT, onStopSignal);
+            signal(SIGTERM, onStopSignal);
+            signal(SIGPIPE, SIG_IGN);
+            vector<string> sockets;
+            stringstream ss(option("partitions", ""));
+            for (string s; getline(ss, s, ',');) if (!s.empty()) sockets.push_back(s);
+            PartitionRouter router(sockets);
+            RouterHttpHandler handler(router, sockets);
+            unique_ptr<StockEscrow> escrow;
+            if (options.count("escrow")) {
+                escrow = make_unique<StockEscrow>(sockets);
+                handler.setEscrow(escrow.get());
+            }
+            int port = stoi(arg(0, "8080"));
+            unique_ptr<EventServer> server = makeServer(option("io", "auto"), listenTcp("127.0.0.1", port), [&] { return make_unique<HttpProtocol>(handler); });
+            cout << "Routing HTTP on 127.0.0.1:" << port << " over " << sockets.size() << " partitions" << endl;
+            server->run();
+            return 0;
+        }
+        if (mode == "bench-partition") {
+            signal(SIGPIPE, SIG_IGN);
+            runPartitionBench(stoi(arg(0, "4")), stoi(arg(1, "100000")), stol(arg(2, "100000")));
+            return 0;
+        }
+        if (mode == "bench-escrow") {
+            signal(SIGPIPE, SIG_IGN);
+            runEscrowBench(stoi(arg(0, "4")), stoi(arg(1, "2")), stoi(arg(2, "10000")), stod(arg(3, "2")));
+            return 0;
+        }
+        if (mode == "bench-rpc") {
+            signal(SIGPIPE, SIG_IGN);
+            runRpcBench(arg(0, "/tmp/shop.sock"), stol(arg(1, "1000000")), stoi(arg(2, "64")), stoi(arg(3, "2")));
+            return 0;
+        }
+        if (mode == "bench-http") {
+            signal(SIGPIPE, SIG_IGN);
+            runHttpBench("127.0.0.1", stoi(arg(0, "8080")), stoi(arg(1, "4")), stol(arg(2, "200000")),
+                         stoi(arg(3, "16")), arg(4, "/products/1"));
+            return 0;
+        }
+        if (mode == "loadgen") {
+            signal(SIGPIPE, SIG_IGN);
+            LoadGenConfig cfg;
+            cfg.port = stoi(arg(0, "8080"));
+            cfg.users = stoi(arg(1, "64"));
+            cfg.seconds = stod(arg(2, "10"));
+            cfg.threads = stoi(option("threads", "4"));
+            cfg.products = stoi(option("products", "1000"));
+            cfg.zipfExponent = stod(option("zipf", "0.99"));
+            cfg.thinkMs = stod(option("think-ms", "0"));
+            if (options.count("mix")) {
+                stringstream ss(option("mix", ""));
+                string w;
+                for (size_t i = 0; i < cfg.mix.size() && getline(ss, w, ':'); ++i) cfg.mix[i] = stoi(w);
+            }
+            runLoadGen(cfg);
+            return 0;
+        }
+        if (mode == "bench-shards") {
+            runShardBench(stoi(arg(0, "4")), stoi(arg(1, "4")), stol(arg(2, "50000")), stoi(arg(3, "16")));
+            return 0;
+        }
+        if (mode == "bench-pool") {
+            runPoolBench(static_cast<unsigned>(stoi(arg(0, "4"))), stoi(arg(1, "200000")), stoi(arg(2, "1000")));
+            return 0;
+        }
+        if (mode == "bench-store") {
+            runStoreBench(arg(0, "/tmp/shop-lsm-bench"), stol(arg(1, "1000000")), stoi(arg(2, "100")));
+            return 0;
+        }
+        if (mode == "bench-checkpoint") {
+            runCheckpointBench(arg(0, "/tmp/shop-checkpoint.csv"), stoi(arg(1, "1000000")), stoi(arg(2, "2")));
+            return 0;
+        }
+        if (mode == "bench-cache") {
+            runCacheBench(arg(0, "/tmp/shop-cache-bench"), stoi(arg(1, "200000")), stoul(arg(2, "20000")), stol(arg(3, "500000")));
+            return 0;
+        }
+        if (mode == "verify") return runVerify(arg(0, ""));
+        if (mode == "bench-repl") {
+            runReplBench(stoi(arg(0, "2")), stod(arg(1, "3")), stoi(arg(2, "100000")));
+            return 0;
+        }
+        if (mode == "bench-io") {
+            signal(SIGPIPE, SIG_IGN);
+            runIoBench(stol(arg(0, "400000")), stoi(arg(1, "4")), stoi(arg(2, "16")), stol(arg(3, "2000")));
+            return 0;
+        }
+    } catch (const exception &e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
     }
-};
-
-// -------------------- ShoppingCart --------------------
-class ShoppingCart {
-private:
-    vector<CartItem> items;
-public:
-    void addToCart(const Product &p, int qty) { items.emplace_back(p, qty); }
-    void removeFromCart(int productId, int qty) { /* simplified */ }
-    double total() const { double sum=0; for(auto& ci:items) sum+=ci.subtotal(); return sum; }
-    vector<CartItem> getItems() const { return items; }
-    void clear() { items.clear(); }
-    bool empty() const { return items.empty(); }
-};
-
-// -------------------- Order --------------------
-class Order {
-private:
-    static int nextOrderId;
-    int orderId;
-    vector<CartItem> items;
-    double amount;
-public:
-    Order(const vector<CartItem> &its)
-        : orderId(++nextOrderId), items(its) {
-        amount = 0; for (auto &i : items) amount += i.subtotal();
-    }
-
-    void printSummary() const {
-        cout << "Order #" << orderId << "\n";
-        for (auto &ci : items) cout << "  " << ci.product.getName() << " x" << ci.quantity << " = $" << ci.subtotal() << "\n";
-        cout << "Total: $" << amount << "\n";
-    }
-};
-int Order::nextOrderId = 0;
 
-// -------------------- Main --------------------
-int main() {
     Inventory &inv = Inventory::instance();
     inv.addProduct(Product(1, "Mouse", 15.0, 10));
     inv.addProduct(Product(2, "Keyboard", 25.0, 5));
@@ -214,7 +217,7 @@ int main() {
     for (auto &p : inv.listAll()) cout << p << endl;
 
     cart.addToCart(inv.getProduct(1), 2);
-    cout << "Cart total: $" << cart.total() << endl;
+    cout << "Cart total: $" << fixed << setprecision(2) << cart.total() << endl;
 
     unique_ptr<Payment> payment = make_unique<CreditCardPayment>("1234","Alice");
     if(payment->pay(cart.total())){
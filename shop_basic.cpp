@@ -0,0 +1,61 @@
+// shop_basic.cpp
+
+#include "shop_basic.hpp"
+#include <charconv>
+
+int Order::orderCounter=0;
+
+static bool nextToken(const string &line, size_t &pos, const char *&tok, size_t &len){
+    while(pos<line.size() && (line[pos]==' ' || line[pos]=='\t' || line[pos]=='\r')) ++pos;
+    if(pos>=line.size()) return false;
+    size_t start=pos;
+    while(pos<line.size() && line[pos]!=' ' && line[pos]!='\t' && line[pos]!='\r') ++pos;
+    tok=line.data()+start; len=pos-start;
+    return true;
+}
+
+static bool nextInt(const string &line, size_t &pos, int &out){
+    const char *tok; size_t len;
+    if(!nextToken(line,pos,tok,len)) return false;
+    auto r = from_chars(tok, tok+len, out);
+    return r.ec==errc() && r.ptr==tok+len;
+}
+
+int runBatch(istream &in, vector<Product> &products, ShoppingCart &cart){
+    CardPayment card;
+    PayPalPayment paypal;
+    string line;
+    long lineNo=0, errors=0;
+    while(getline(in,line)){
+        ++lineNo;
+        size_t pos=0; const char *tok; size_t len;
+        if(!nextToken(line,pos,tok,len) || tok[0]=='#') continue;
+        string_view cmd(tok,len);
+        if(cmd=="list"){ showVector(products); }
+        else if(cmd=="add"){
+            int id,q;
+            if(!nextInt(line,pos,id) || !nextInt(line,pos,q)){ cerr << "line " << lineNo << ": usage: add <id> <qty>\n"; ++errors; continue; }
+            for(auto &p:products){ if(p.getId()==id && p.reduceStock(q)) cart.addItem(p,q); }
+        }
+        else if(cmd=="view"){ cart.viewCart(); }
+        else if(cmd=="checkout"){
+            if(cart.empty()){ cout << "Cart is empty!\n"; continue; }
+            Payment *pay=nullptr;
+            if(nextToken(line,pos,tok,len)){
+                string_view method(tok,len);
+                if(method=="card") pay=&card;
+                else if(method=="paypal") pay=&paypal;
+            }
+            if(!pay){ cerr << "line " << lineNo << ": usage: checkout card|paypal\n"; ++errors; continue; }
+            if(pay->pay(cart.total())){
+                Order o(cart.getItems());
+                o.showOrder();
+                cart.clear();
+            }
+        }
+        else if(cmd=="exit" || cmd=="quit") break;
+        else { cerr << "line " << lineNo << ": unknown command '" << cmd << "'\n"; ++errors; }
+    }
+    cout.flush();
+    return errors ? 1 : 0;
+}
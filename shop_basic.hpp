@@ -0,0 +1,154 @@
+// shop_basic.hpp
+// Classes of the simple shop (see online_shopping_cart.cpp) and its batch driver.
+
+#ifndef SHOP_BASIC_HPP
+#define SHOP_BASIC_HPP
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iomanip>
+using namespace std;
+
+// ----------------- Exception Class -----------------
+class ShopException : public runtime_error {
+public:
+    explicit ShopException(const string &msg) : runtime_error(msg) {}
+};
+
+// ----------------- Product Class -----------------
+class Product {
+private:
+    int id;
+    string name;
+    double price;
+    int stock;
+public:
+    Product(int i=0, string n="", double p=0, int s=0)
+        : id(i), name(n), price(p), stock(s) {}
+
+    // Encapsulation (Getters & Setters)
+    int getId() const { return id; }
+    string getName() const { return name; }
+    double getPrice() const { return price; }
+    int getStock() const { return stock; }
+
+    void setPrice(double p) { if (p<0) throw ShopException("Invalid price"); price=p; }
+    void setStock(int s) { if (s<0) throw ShopException("Invalid stock"); stock=s; }
+
+    bool reduceStock(int qty) {
+        if (qty <= 0) return false;
+        if (qty > stock) return false;
+        stock -= qty;
+        return true;
+    }
+
+    // Operator Overloading
+    friend ostream& operator<<(ostream &os, const Product &p) {
+        os << "[" << p.id << "] " << p.name << " - $" << fixed << setprecision(2) << p.price
+           << " (stock: " << p.stock << ")";
+        return os;
+    }
+};
+
+// ----------------- CartItem -----------------
+class CartItem {
+public:
+    Product product;
+    int quantity;
+
+    CartItem(Product p, int q) : product(p), quantity(q) {}
+    double subtotal() const { return product.getPrice() * quantity; }
+};
+
+// ----------------- User & Admin (Inheritance) -----------------
+class User {
+protected:
+    string name;
+public:
+    User(string n="Guest") : name(n) {}
+    virtual string role() const { return "User"; } // Polymorphism
+    string getName() const { return name; }
+};
+
+class Admin : public User {
+public:
+    Admin(string n) : User(n) {}
+    string role() const override { return "Admin"; }
+};
+
+// ----------------- Payment (Abstraction) -----------------
+class Payment {
+public:
+    virtual bool pay(double amount) = 0;
+    virtual ~Payment() {}
+};
+
+class CardPayment : public Payment {
+public:
+    bool pay(double amount) override {
+        cout << "Paid $" << amount << " using Credit Card.\n";
+        return true;
+    }
+};
+
+class PayPalPayment : public Payment {
+public:
+    bool pay(double amount) override {
+        cout << "Paid $" << amount << " using PayPal.\n";
+        return true;
+    }
+};
+
+// ----------------- ShoppingCart -----------------
+class ShoppingCart {
+    vector<CartItem> items;
+public:
+    void addItem(Product p, int q) { items.push_back(CartItem(p,q)); }
+    void viewCart() {
+        double total=0;
+        for (auto &c : items) {
+            cout << c.product.getName() << " x" << c.quantity << " = $" << c.subtotal() << '\n';
+            total+=c.subtotal();
+        }
+        cout << "Total: $" << total << '\n';
+    }
+    double total() {
+        double t=0; for(auto &c:items) t+=c.subtotal(); return t;
+    }
+    vector<CartItem> getItems(){ return items; }
+    void clear(){ items.clear(); }
+    bool empty(){ return items.empty(); }
+};
+
+// ----------------- Order -----------------
+class Order {
+    static int orderCounter;
+    int id;
+    vector<CartItem> items;
+    double amount;
+public:
+    Order(vector<CartItem> its) : items(its) {
+        id=++orderCounter;
+        amount=0;
+        for(auto &c:its) amount+=c.subtotal();
+    }
+    void showOrder(){
+        cout << "Order #" << id << " Summary:" << '\n';
+        for(auto &c:items) cout << c.product.getName() << " x" << c.quantity << '\n';
+        cout << "Total: $" << amount << '\n';
+    }
+};
+
+// ----------------- Template Function -----------------
+template<class T>
+void showVector(const vector<T> &v){ for(auto &x:v) cout << x << '\n'; }
+
+// ----------------- Batch Mode -----------------
+// Non-interactive driver for scripted/piped use: one command per line, no prompts.
+//   list | add <id> <qty> | view | checkout card|paypal | exit
+// Output goes through cout's buffer and is only flushed at the end of the run.
+int runBatch(istream &in, vector<Product> &products, ShoppingCart &cart);
+
+#endif // SHOP_BASIC_HPP
@@ -0,0 +1,42 @@
+// shop_bench.cpp
+// Microbenchmarks of the core shop operations.
+// Usage: shop_bench [--reps=5] [--min-ms=20] [--filter=<substr>] [--json=<file>]
+
+#include "microbench.hpp"
+
+// Count every heap allocation so the table can report allocs/op.
+void* operator new(size_t n) {
+    AllocCounters::heapAllocs.fetch_add(1, memory_order_relaxed);
+    if (void *p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void* operator new(size_t n, align_val_t a) {
+    AllocCounters::heapAllocs.fetch_add(1, memory_order_relaxed);
+    size_t align = max(static_cast<size_t>(a), sizeof(void*));
+    if (void *p = aligned_alloc(align, (max<size_t>(n, 1) + align - 1) / align * align)) return p;
+    throw bad_alloc();
+}
+void operator delete(void *p, align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, align_val_t) noexcept { free(p); }
+
+int main(int argc, char **argv) {
+    map<string, string> options;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        size_t eq = a.find('=');
+        if (a.rfind("--", 0) != 0) { cerr << "Unexpected argument " << a << endl; return 1; }
+        options[a.substr(2, eq == string::npos ? string::npos : eq - 2)] = eq == string::npos ? "" : a.substr(eq + 1);
+    }
+    auto option = [&](const string &name, const char *def) { auto it = options.find(name); return it != options.end() ? it->second : string(def); };
+    if (options.count("no-metrics")) ShopMetrics::enabled = false;
+
+    MicroBench bench(stoi(option("reps", "5")), stod(option("min-ms", "20")), option("filter", ""));
+    runMicroBenchmarks(bench);
+    if (options.count("json")) {
+        ofstream ofs(option("json", ""));
+        bench.writeJson(ofs);
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+// shop_core.cpp
+
+#include "shop_core.hpp"
+
+atomic<int> Order::nextOrderId{0};
+
+int openJournalFile(const string &fname) {
+    int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) throw ShopException("Cannot open journal " + fname);
+    struct stat st;
+    static const char header[] = "#shop-journal 2\n";
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && write(fd, header, sizeof header - 1) != static_cast<ssize_t>(sizeof header - 1)) {
+        close(fd);
+        throw ShopException("Cannot write journal header to " + fname);
+    }
+    return fd;
+}
+
+IntegrityReport checkJournal(const string &data) {
+    IntegrityReport r;
+    r.kind = "journal";
+    size_t pos = data.find('\n');
+    if (pos == string::npos || data.compare(0, pos, "#shop-journal 2") != 0) {
+        r.problems.push_back("no '#shop-journal 2' header (unversioned or not a journal)");
+        return r;
+    }
+    size_t lineNo = 1;
+    for (++pos; pos < data.size(); ++lineNo) {
+        size_t eol = data.find('\n', pos);
+        string where = "record at line " + to_string(lineNo + 1) + " (byte " + to_string(pos) + ")";
+        if (eol == string::npos) { r.problems.push_back("torn " + where + ": no newline"); break; }
+        size_t hash = data.rfind('#', eol);
+        unsigned crc;
+        if (hash == string::npos || hash < pos || eol - hash != 9 || sscanf(data.c_str() + hash + 1, "%8x", &crc) != 1
+            || crc != Crc32c::of(data.data() + pos, hash - pos))
+            r.problems.push_back(where + " fails its checksum");
+        else
+            ++r.records;
+        pos = eol + 1;
+    }
+    r.blocks = r.records; // every record is checksummed on its own
+    return r;
+}
+
+IntegrityReport checkSnapshot(const string &data, vector<Product> *out) {
+    IntegrityReport r;
+    r.kind = "snapshot";
+    size_t pos = data.find('\n');
+    if (pos == string::npos || data.compare(0, pos, "#shop-snapshot 2") != 0) {
+        r.problems.push_back(data.rfind("#shop-snapshot ", 0) == 0 ? "unsupported snapshot version"
+                                                                  : "no '#shop-snapshot 2' header (unversioned or not a snapshot)");
+        return r;
+    }
+    vector<Product> staged;
+    string malformed;
+    size_t lineNo = 1, lines = 0, seenBlocks = 0, seenLines = 0, blockStart = pos + 1, firstLine = 2;
+    for (++pos; pos < data.size();) {
+        size_t eol = data.find('\n', pos);
+        ++lineNo;
+        if (eol == string::npos) {
+            r.problems.push_back("truncated at line " + to_string(lineNo) + " (byte " + to_string(pos) + ")");
+            return r;
+        }
+        string line = data.substr(pos, eol - pos);
+        if (line.rfind("#block ", 0) == 0) {
+            size_t n, bytes;
+            unsigned crc;
+            size_t have = pos - blockStart;
+            string where = "block " + to_string(++seenBlocks) + " (lines " + to_string(firstLine) + "-" + to_string(lineNo) +
+                           ", bytes " + to_string(blockStart) + "-" + to_string(eol) + ")";
+            seenLines += lines;
+            if (sscanf(line.c_str(), "#block %zu %zu %x", &n, &bytes, &crc) != 3 || n != lines || bytes != have
+                || crc != Crc32c::of(data.data() + blockStart, have))
+                r.problems.push_back(where + " fails its checksum");
+            else if (!malformed.empty())
+                r.problems.push_back(where + ": " + malformed);
+            else {
+                ++r.blocks;
+                r.records += lines;
+                if (out) out->insert(out->end(), staged.begin(), staged.end());
+            }
+            staged.clear();
+            malformed.clear();
+            lines = 0;
+            blockStart = eol + 1;
+            firstLine = lineNo + 1;
+        } else if (line.rfind("#end ", 0) == 0) {
+            size_t products, blocks;
+            if (lines) r.problems.push_back("lines " + to_string(firstLine) + "-" + to_string(lineNo - 1) + " are outside any block");
+            if (sscanf(line.c_str(), "#end %zu %zu", &products, &blocks) != 2 || products != seenLines || blocks != seenBlocks)
+                r.problems.push_back("end record at line " + to_string(lineNo) + " does not match the blocks before it");
+            if (eol + 1 != data.size()) r.problems.push_back("unexpected data after the end record");
+            return r;
+        } else {
+            ++lines;
+            size_t c1 = line.find(','), c3 = line.rfind(','), c2 = c3 == string::npos || c3 == 0 ? string::npos : line.rfind(',', c3 - 1);
+            int id = 0, stock = 0;
+            double price = 0;
+            bool parsed = c1 != string::npos && c2 != string::npos && c1 < c2
+                && from_chars(line.data(), line.data() + c1, id).ptr == line.data() + c1
+                && from_chars(line.data() + c2 + 1, line.data() + c3, price).ptr == line.data() + c3
+                && from_chars(line.data() + c3 + 1, line.data() + line.size(), stock).ptr == line.data() + line.size();
+            if (!parsed || price < 0 || stock < 0) {
+                if (malformed.empty()) malformed = "line " + to_string(lineNo) + " is not a valid product";
+            } else {
+                staged.emplace_back(id, line.substr(c1 + 1, c2 - c1 - 1), price, stock);
+            }
+        }
+        pos = eol + 1;
+    }
+    r.problems.push_back("truncated after block " + to_string(seenBlocks) + " (no end record)");
+    return r;
+}
+
+unique_ptr<Payment> makePayment(const string &method) {
+    if (method == "card") return make_unique<CreditCardPayment>("4111111111111111", "Online customer");
+    if (method == "paypal") return make_unique<PayPalPayment>("customer@mail.com");
+    throw ShopException("Unknown payment method");
+}
+
+unique_ptr<Payment> makeTestPayment(const string &method) {
+    if (method == "instant") return make_unique<InstantPayment>();
+    return makePayment(method);
+}
+
+void seedCatalog(Inventory &inv, int n, const function<bool(int)> &owns) {
+    auto add = [&](const Product &p) { if (!owns || owns(p.getId())) inv.addProduct(p); };
+    add(Product(1, "Mouse", 15.0, 10));
+    add(Product(2, "Keyboard", 25.0, 5));
+    for (int id = 3; id <= n; ++id) add(Product(id, "Product " + to_string(id), 1.0 + id % 100, 1000000));
+}
+
+string jsonEscape(const string &s) {
+    string out;
+    out.reserve(s.size());
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\') { out += '\\'; out += ch; }
+        else if (static_cast<unsigned char>(ch) < 0x20) { char b[8]; snprintf(b, sizeof b, "\\u%04x", ch); out += b; }
+        else out += ch;
+    }
+    return out;
+}
@@ -0,0 +1,1547 @@
+// shop_core.hpp
+// Domain model of the advanced shop: products, carts, users, payments, inventory,
+// orders, the order journal and the cart-aware ShopService, plus the per-operation
+// metrics and checkout tracing they report into.
+
+#ifndef SHOP_CORE_HPP
+#define SHOP_CORE_HPP
+
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std;
+
+// -------------------- Exceptions --------------------
+class ShopException : public runtime_error {
+public:
+    explicit ShopException(const string &msg) : runtime_error(msg) {}
+};
+
+// -------------------- Error codes --------------------
+// Non-throwing results for hot paths (random ids from bots make unwinding the dominant cost).
+// Expected mirrors the used subset of std::expected; value() on an error throws the
+// ShopException the old throwing API raised, so that API is now a thin wrapper.
+enum class ShopError { NotFound, NegativePrice, NegativeStock, InvalidQuantity, StoreFailed };
+
+inline const char* errorMessage(ShopError e) {
+    switch (e) {
+        case ShopError::NotFound: return "Product not found";
+        case ShopError::NegativePrice: return "Price can't be negative";
+        case ShopError::NegativeStock: return "Stock can't be negative";
+        case ShopError::InvalidQuantity: return "Quantity must be positive";
+        case ShopError::StoreFailed: return "Catalog store write failed";
+    }
+    return "Unknown error";
+}
+
+template <class T>
+class Expected {
+private:
+    variant<T, ShopError> v;
+public:
+    Expected(T value) : v(move(value)) {}
+    Expected(ShopError e) : v(e) {}
+
+    bool has_value() const { return v.index() == 0; }
+    explicit operator bool() const { return has_value(); }
+    ShopError error() const { return get<1>(v); }
+
+    T& value() & { check(); return get<0>(v); }
+    const T& value() const & { check(); return get<0>(v); }
+    T&& value() && { check(); return get<0>(move(v)); }
+    T& operator*() { return get<0>(v); }
+    const T& operator*() const { return get<0>(v); }
+    T* operator->() { return &get<0>(v); }
+    const T* operator->() const { return &get<0>(v); }
+private:
+    void check() const { if (!has_value()) throw ShopException(errorMessage(error())); }
+};
+
+template <>
+class Expected<void> {
+private:
+    optional<ShopError> err;
+public:
+    Expected() {}
+    Expected(ShopError e) : err(e) {}
+
+    bool has_value() const { return !err; }
+    explicit operator bool() const { return has_value(); }
+    ShopError error() const { return *err; }
+    void value() const { if (err) throw ShopException(errorMessage(*err)); }
+};
+
+// -------------------- Product --------------------
+class Product {
+private:
+    int id;
+    string name;
+    double price;
+    int stock;
+public:
+    Product(int i=0, string n="", double p=0, int s=0)
+        : id(i), name(n), price(p), stock(s) {}
+
+    // Encapsulation: getters/setters
+    int getId() const { return id; }
+    string getName() const { return name; }
+    // Heap bytes behind the name (0 while it fits the small-string buffer).
+    size_t nameHeapBytes() const { return name.capacity() > string().capacity() ? name.capacity() + 1 : 0; }
+    double getPrice() const { return price; }
+    int getStock() const { return stock; }
+
+    Expected<void> trySetPrice(double p) { if (p<0) return ShopError::NegativePrice; price = p; return {}; }
+    Expected<void> trySetStock(int s) { if (s<0) return ShopError::NegativeStock; stock = s; return {}; }
+    void setPrice(double p) { trySetPrice(p).value(); }
+    void setStock(int s) { trySetStock(s).value(); }
+
+    bool reduceStock(int qty) {
+        if (qty <= 0) return false;
+        if (qty > stock) return false;
+        stock -= qty;
+        return true;
+    }
+
+    void increaseStock(int qty) { if (qty>0) stock += qty; }
+
+    // Operator overloading
+    friend ostream& operator<<(ostream &os, const Product &p) {
+        os << "[" << p.id << "] " << p.name << " - $" << fixed << setprecision(2) << p.price
+           << " (stock: " << p.stock << ")";
+        return os;
+    }
+
+    bool operator==(const Product &other) const { return id == other.id; }
+};
+
+// -------------------- CartItem --------------------
+class CartItem {
+public:
+    Product product;
+    int quantity;
+
+    CartItem(const Product &p, int q): product(p), quantity(q) {}
+
+    double subtotal() const { return product.getPrice() * quantity; }
+};
+
+// -------------------- User & Admin (Inheritance) --------------------
+class User {
+protected:
+    string username;
+    string email;
+public:
+    explicit User(string uname="guest", string mail="") : username(move(uname)), email(move(mail)) {}
+    virtual ~User() = default;
+
+    string getName() const { return username; }
+    string getEmail() const { return email; }
+
+    // Abstraction + Polymorphism: virtual function for user type
+    virtual string role() const { return "User"; }
+};
+
+class Admin : public User {
+public:
+    Admin(string uname, string mail): User(move(uname), move(mail)) {}
+    string role() const override { return "Admin"; }
+
+    // Admin-specific operations could be added
+};
+
+// -------------------- Payment (Abstract) --------------------
+class Payment {
+public:
+    virtual ~Payment() = default;
+    virtual bool pay(double amount) = 0; // returns true on success
+    virtual bool refund(double amount) = 0; // gives back an earlier successful pay()
+};
+
+class CreditCardPayment : public Payment {
+private:
+    string cardNumber;
+    string nameOnCard;
+public:
+    CreditCardPayment(string card, string name) : cardNumber(move(card)), nameOnCard(move(name)) {}
+    bool pay(double amount) override {
+        cout << "Processing credit card payment for $" << fixed << setprecision(2) << amount << "...\n";
+        // Fake processing
+        if (cardNumber.empty()) return false;
+        cout << "Paid by Credit Card (" << nameOnCard << ")\n";
+        return true;
+    }
+    bool refund(double amount) override {
+        cout << "Refunded $" << fixed << setprecision(2) << amount << " to Credit Card (" << nameOnCard << ")\n";
+        return true;
+    }
+};
+
+class PayPalPayment : public Payment {
+private:
+    string accountEmail;
+public:
+    explicit PayPalPayment(string email) : accountEmail(move(email)) {}
+    bool pay(double amount) override {
+        cout << "Processing PayPal payment for $" << fixed << setprecision(2) << amount << "...\n";
+        if (accountEmail.empty()) return false;
+        cout << "Paid by PayPal (" << accountEmail << ")\n";
+        return true;
+    }
+    bool refund(double amount) override {
+        cout << "Refunded $" << fixed << setprecision(2) << amount << " to PayPal (" << accountEmail << ")\n";
+        return true;
+    }
+};
+
+// Pre-authorised payment for benchmarks and load tests: always succeeds, prints nothing.
+// Never reachable from a public method name (see makeTestPayment).
+class InstantPayment : public Payment {
+public:
+    bool pay(double amount) override { return amount >= 0; }
+    bool refund(double amount) override { return amount >= 0; }
+};
+
+// -------------------- Metrics --------------------
+// HDR-style log-linear latency histogram: values below 2^subBits ns are exact, larger ones
+// land in power-of-two ranges split into 2^(subBits-1) linear sub-buckets, so every
+// bucket is within ~1.6% of the values it holds. Only the owning thread writes; readers
+// merge live with relaxed loads, so taking a snapshot never stops the writers.
+class LatencyHistogram {
+public:
+    static constexpr int subBits = 7;
+    static constexpr uint64_t maxValue = (1ULL << 40) - 1; // ~18 minutes in ns
+    static constexpr size_t bucketCount = (40 - subBits + 2) * (1u << (subBits - 1));
+
+    static size_t indexOf(uint64_t v) {
+        if (v > maxValue) v = maxValue;
+        if (v < (1ULL << subBits)) return static_cast<size_t>(v);
+        int shift = 63 - __builtin_clzll(v) - subBits + 1;
+        return static_cast<size_t>((shift + 1) << (subBits - 1)) + static_cast<size_t>((v >> shift) - (1ULL << (subBits - 1)));
+    }
+
+    // Highest value that maps to bucket i.
+    static uint64_t upperBound(size_t i) {
+        if (i < (1u << subBits)) return i;
+        int shift = static_cast<int>(i >> (subBits - 1)) - 1;
+        uint64_t sub = (i & ((1u << (subBits - 1)) - 1)) + (1ULL << (subBits - 1));
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t nanos) {
+        bump(counts[indexOf(nanos)], 1);
+        bump(total, nanos);
+        if (nanos > maxSeen.load(memory_order_relaxed)) maxSeen.store(nanos, memory_order_relaxed);
+    }
+
+    // Adds this histogram's current contents into plain counters.
+    void mergeInto(vector<uint64_t> &into, uint64_t &sum, uint64_t &max) const {
+        for (size_t i = 0; i < bucketCount; ++i) into[i] += counts[i].load(memory_order_relaxed);
+        sum += total.load(memory_order_relaxed);
+        max = std::max(max, maxSeen.load(memory_order_relaxed));
+    }
+
+private:
+    array<atomic<uint64_t>, bucketCount> counts{};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> maxSeen{0};
+
+    // Single writer: a plain load/store pair is enough and avoids a locked RMW.
+    static void bump(atomic<uint64_t> &a, uint64_t by) { a.store(a.load(memory_order_relaxed) + by, memory_order_relaxed); }
+};
+
+enum class Metric { GetProduct, ReduceStock, CartAdd, Checkout, Pay, Count };
+
+struct MetricSummary {
+    uint64_t count = 0, errors = 0;
+    double meanUs = 0, p50Us = 0, p99Us = 0, p999Us = 0, maxUs = 0;
+};
+
+// Percentiles from merged LatencyHistogram buckets (see LatencyHistogram::mergeInto).
+inline MetricSummary summarize(const vector<uint64_t> &merged, uint64_t sum, uint64_t max) {
+    MetricSummary s;
+    for (uint64_t c : merged) s.count += c;
+    if (s.count == 0) return s;
+    auto percentile = [&](double q) {
+        uint64_t rank = static_cast<uint64_t>(ceil(q * s.count)), seen = 0;
+        for (size_t i = 0; i < merged.size(); ++i)
+            if ((seen += merged[i]) >= rank) return min(LatencyHistogram::upperBound(i), max) / 1000.0;
+        return max / 1000.0;
+    };
+    s.meanUs = sum / 1000.0 / s.count;
+    s.p50Us = percentile(0.50);
+    s.p99Us = percentile(0.99);
+    s.p999Us = percentile(0.999);
+    s.maxUs = max / 1000.0;
+    return s;
+}
+
+// Per-thread histograms and error counters for every public shop operation.
+// Each thread registers its block once; blocks outlive their threads so nothing is lost.
+class ShopMetrics {
+private:
+    struct ThreadStats {
+        array<LatencyHistogram, static_cast<size_t>(Metric::Count)> latency;
+        array<atomic<uint64_t>, static_cast<size_t>(Metric::Count)> errors{};
+    };
+    mutex registryMutex;
+    vector<unique_ptr<ThreadStats>> registry;
+
+    ThreadStats& local() {
+        thread_local ThreadStats *mine = nullptr;
+        if (!mine) {
+            auto block = make_unique<ThreadStats>();
+            mine = block.get();
+            lock_guard<mutex> lk(registryMutex);
+            registry.push_back(move(block));
+        }
+        return *mine;
+    }
+
+public:
+    // Off skips the clock reads entirely (two per operation); --no-metrics on the command line.
+    static inline atomic<bool> enabled{true};
+
+    static ShopMetrics& instance() {
+        static ShopMetrics metrics;
+        return metrics;
+    }
+
+    static const char* name(Metric m) {
+        static const char *names[] = {"getProduct", "reduceStock", "cartAdd", "checkout", "pay"};
+        return names[static_cast<size_t>(m)];
+    }
+
+    void record(Metric m, uint64_t nanos, bool failed) {
+        ThreadStats &ts = local();
+        ts.latency[static_cast<size_t>(m)].record(nanos);
+        if (failed) {
+            atomic<uint64_t> &e = ts.errors[static_cast<size_t>(m)];
+            e.store(e.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+    }
+
+    MetricSummary summary(Metric m) {
+        vector<uint64_t> merged(LatencyHistogram::bucketCount);
+        uint64_t sum = 0, max = 0, errors = 0;
+        {
+            lock_guard<mutex> lk(registryMutex);
+            for (auto &ts : registry) {
+                ts->latency[static_cast<size_t>(m)].mergeInto(merged, sum, max);
+                errors += ts->errors[static_cast<size_t>(m)].load(memory_order_relaxed);
+            }
+        }
+        MetricSummary s = summarize(merged, sum, max);
+        s.errors = errors;
+        return s;
+    }
+
+    string toJson() {
+        string out = "{";
+        for (int i = 0; i < static_cast<int>(Metric::Count); ++i) {
+            Metric m = static_cast<Metric>(i);
+            MetricSummary s = summary(m);
+            char buf[256];
+            snprintf(buf, sizeof buf, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"mean_us\":%.3f,\"p50_us\":%.3f,"
+                     "\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}", i ? "," : "", name(m),
+                     static_cast<unsigned long long>(s.count), static_cast<unsigned long long>(s.errors),
+                     s.meanUs, s.p50Us, s.p99Us, s.p999Us, s.maxUs);
+            out += buf;
+        }
+        return out + "}";
+    }
+};
+
+// Times the enclosing scope into ShopMetrics; call fail() before leaving on an error path.
+class OpTimer {
+private:
+    Metric metric;
+    bool active;
+    chrono::steady_clock::time_point start;
+    bool failed = false;
+public:
+    explicit OpTimer(Metric m) : metric(m), active(ShopMetrics::enabled.load(memory_order_relaxed)) {
+        if (active) start = chrono::steady_clock::now();
+    }
+    OpTimer(const OpTimer&) = delete;
+    OpTimer& operator=(const OpTimer&) = delete;
+    ~OpTimer() {
+        if (!active) return;
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        ShopMetrics::instance().record(metric, static_cast<uint64_t>(ns), failed || uncaught_exceptions() > 0);
+    }
+    void fail() { failed = true; }
+};
+
+// -------------------- Tracing --------------------
+// Checkout spans recorded into per-thread rings and exported in Chrome trace format
+// (load the JSON in chrome://tracing or Perfetto). Each ring has a single writer; a
+// reader copies it without locks and drops any slot that was overwritten meanwhile.
+class Tracer {
+private:
+    static constexpr size_t ringSize = 1 << 14;
+
+    struct Slot { // relaxed atomics so a concurrent dump never races with the writer
+        atomic<const char*> name{nullptr};
+        atomic<uint64_t> startNs{0}, durNs{0};
+        atomic<int64_t> request{0}, order{0};
+    };
+    struct ThreadRing {
+        int tid = 0;
+        atomic<uint64_t> written{0};
+        array<Slot, ringSize> slots;
+    };
+
+    mutex registryMutex;
+    vector<unique_ptr<ThreadRing>> rings;
+    const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+    ThreadRing& local() {
+        thread_local ThreadRing *mine = nullptr;
+        if (!mine) {
+            auto ring = make_unique<ThreadRing>();
+            mine = ring.get();
+            lock_guard<mutex> lk(registryMutex);
+            ring->tid = static_cast<int>(rings.size()) + 1;
+            rings.push_back(move(ring));
+        }
+        return *mine;
+    }
+
+public:
+    static inline atomic<bool> enabled{false};
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    uint64_t now() const {
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count());
+    }
+
+    void record(const char *name, uint64_t startNs, uint64_t durNs, int64_t request, int64_t order) {
+        ThreadRing &r = local();
+        uint64_t n = r.written.load(memory_order_relaxed);
+        Slot &s = r.slots[n % ringSize];
+        s.name.store(name, memory_order_relaxed);
+        s.startNs.store(startNs, memory_order_relaxed);
+        s.durNs.store(durNs, memory_order_relaxed);
+        s.request.store(request, memory_order_relaxed);
+        s.order.store(order, memory_order_relaxed);
+        r.written.store(n + 1, memory_order_release);
+    }
+
+    void writeJson(ostream &os) {
+        os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        lock_guard<mutex> lk(registryMutex);
+        for (auto &r : rings) {
+            uint64_t end = r->written.load(memory_order_acquire);
+            uint64_t begin = end > ringSize ? end - ringSize : 0;
+            struct Copy { const char *name; uint64_t start, dur; int64_t request, order; };
+            vector<Copy> copies;
+            for (uint64_t i = begin; i < end; ++i) {
+                const Slot &s = r->slots[i % ringSize];
+                copies.push_back({s.name.load(memory_order_relaxed), s.startNs.load(memory_order_relaxed),
+                                  s.durNs.load(memory_order_relaxed), s.request.load(memory_order_relaxed),
+                                  s.order.load(memory_order_relaxed)});
+            }
+            // Slots the writer lapped while we were copying are stale; skip them, and the slot
+            // for event `after`, which it may be writing into right now.
+            uint64_t after = r->written.load(memory_order_acquire);
+            size_t skip = after >= begin + ringSize ? static_cast<size_t>(after - begin - ringSize + 1) : 0;
+            for (size_t i = skip; i < copies.size(); ++i) {
+                const Copy &c = copies[i];
+                char buf[256];
+                snprintf(buf, sizeof buf, "%s{\"name\":\"%s\",\"cat\":\"checkout\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"cart\":%lld,\"order\":%lld}}",
+                         first ? "" : ",", c.name, static_cast<int>(getpid()), r->tid, c.start / 1000.0, c.dur / 1000.0,
+                         static_cast<long long>(c.request), static_cast<long long>(c.order));
+                os << buf;
+                first = false;
+            }
+        }
+        os << "]}\n";
+    }
+};
+
+// RAII span; costs one relaxed load when tracing is off. `name` must be a string literal.
+class TraceSpan {
+private:
+    const char *name;
+    bool active;
+    uint64_t start = 0;
+    int64_t request;
+    int64_t order = 0;
+public:
+    TraceSpan(const char *n, int64_t requestId) : name(n), active(Tracer::enabled.load(memory_order_relaxed)), request(requestId) {
+        if (active) start = Tracer::instance().now();
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    ~TraceSpan() { if (active) Tracer::instance().record(name, start, Tracer::instance().now() - start, request, order); }
+    void setOrder(int64_t id) { order = id; }
+};
+
+// -------------------- Request arenas --------------------
+// Request-scoped memory: listings, cart snapshots and orders built while serving one
+// request are bump-allocated from a RequestArena and released in one go when it dies.
+// Anything that outlives the request must be copied out (pmr copies use the default heap).
+struct AllocCounters {
+    static inline atomic<uint64_t> arenas{0};          // RequestArenas created
+    static inline atomic<uint64_t> upstreamAllocs{0};  // chunks arenas had to take from the heap
+    static inline atomic<uint64_t> upstreamBytes{0};
+    static inline atomic<uint64_t> heapAllocs{0};      // global operator new calls, where a binary counts them
+    static inline atomic<uint64_t> poolMallocs{0};     // blocks LinePool had to create
+    static inline atomic<uint64_t> poolRefills{0};     // batches a thread took from the global pool
+};
+
+// Heap resource that counts what arenas take from it.
+class CountingResource : public pmr::memory_resource {
+private:
+    void* do_allocate(size_t bytes, size_t align) override {
+        AllocCounters::upstreamAllocs.fetch_add(1, memory_order_relaxed);
+        AllocCounters::upstreamBytes.fetch_add(bytes, memory_order_relaxed);
+        return pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t align) override { pmr::new_delete_resource()->deallocate(p, bytes, align); }
+    bool do_is_equal(const pmr::memory_resource &o) const noexcept override { return this == &o; }
+public:
+    static CountingResource& instance() { static CountingResource r; return r; }
+};
+
+// Monotonic arena with a 16 KB inline first block; a typical request never touches the heap.
+class RequestArena {
+private:
+    alignas(max_align_t) char initial[16384];
+    pmr::monotonic_buffer_resource mono;
+public:
+    RequestArena() : mono(initial, sizeof initial, &CountingResource::instance()) {
+        AllocCounters::arenas.fetch_add(1, memory_order_relaxed);
+    }
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    pmr::memory_resource* resource() { return &mono; }
+};
+
+// -------------------- Line pool --------------------
+// Recycles the storage behind cart lines, order lines and the cart table's nodes, so a
+// steady stream of add-to-cart/checkout does no malloc/free. Blocks are binned by
+// power-of-two size; each thread keeps its own free lists and trades whole batches with a
+// shared pool (a freeing thread keeps the block, whichever thread allocated it).
+// Blocks are never returned to the OS.
+class LinePool : public pmr::memory_resource {
+private:
+    static constexpr size_t minShift = 5, maxShift = 16; // 32 B .. 64 KB, larger goes to the heap
+    static constexpr size_t classes = maxShift - minShift + 1;
+    static constexpr size_t batch = 32;
+
+    struct Block { Block *next; };
+    struct FreeList {
+        Block *head = nullptr;
+        size_t count = 0;
+        void push(Block *b) { b->next = head; head = b; ++count; }
+        Block* pop() { Block *b = head; head = b->next; --count; return b; }
+    };
+
+    mutex globalMutex;
+    vector<Block*> global[classes]; // batch heads, each a chain of `batch` blocks
+
+    struct Cache {
+        LinePool *pool = nullptr;
+        FreeList lists[classes];
+        ~Cache() {
+            if (!pool) return;
+            for (size_t c = 0; c < classes; ++c) while (lists[c].count) pool->giveBatch(c, lists[c]);
+        }
+    };
+    static Cache& cache() { static thread_local Cache c; return c; }
+
+    static size_t classOf(size_t bytes) {
+        size_t c = 0;
+        while ((size_t(1) << (c + minShift)) < bytes) ++c;
+        return c;
+    }
+
+    // Moves up to one batch from `from` to the shared pool.
+    void giveBatch(size_t c, FreeList &from) {
+        Block *head = nullptr;
+        for (size_t i = 0; i < batch && from.count; ++i) { Block *b = from.pop(); b->next = head; head = b; }
+        lock_guard<mutex> lk(globalMutex);
+        global[c].push_back(head);
+    }
+
+    void* do_allocate(size_t bytes, size_t align) override {
+        if (bytes > (size_t(1) << maxShift) || align > alignof(max_align_t)) return pmr::new_delete_resource()->allocate(bytes, align);
+        size_t c = classOf(bytes);
+        Cache &tc = cache();
+        tc.pool = this;
+        FreeList &fl = tc.lists[c];
+        if (!fl.count) {
+            Block *chain = nullptr;
+            {
+                lock_guard<mutex> lk(globalMutex);
+                if (!global[c].empty()) { chain = global[c].back(); global[c].pop_back(); }
+            }
+            if (chain) {
+                AllocCounters::poolRefills.fetch_add(1, memory_order_relaxed);
+                while (chain) { Block *next = chain->next; fl.push(chain); chain = next; }
+            } else {
+                AllocCounters::poolMallocs.fetch_add(1, memory_order_relaxed);
+                return ::operator new(size_t(1) << (c + minShift));
+            }
+        }
+        return fl.pop();
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t align) override {
+        if (bytes > (size_t(1) << maxShift) || align > alignof(max_align_t)) return pmr::new_delete_resource()->deallocate(p, bytes, align);
+        size_t c = classOf(bytes);
+        Cache &tc = cache();
+        tc.pool = this;
+        FreeList &fl = tc.lists[c];
+        fl.push(static_cast<Block*>(p));
+        if (fl.count >= 2 * batch) giveBatch(c, fl);
+    }
+
+    bool do_is_equal(const pmr::memory_resource &o) const noexcept override { return this == &o; }
+public:
+    // Never destroyed: static carts or orders may still release blocks during exit.
+    static LinePool& instance() { static LinePool *p = new LinePool; return *p; }
+};
+
+// -------------------- Memory accounting --------------------
+// Live bytes per subsystem. Containers that take a memory_resource allocate through the
+// TaggedResource of their subsystem; structures that cannot (the inventory table, product
+// names) charge estimated deltas themselves. Budgets are soft: crossings are counted and
+// reported by GET /stats/memory (the first one per subsystem is also logged), but nothing
+// is refused.
+enum class MemTag { Inventory, Names, Carts, Orders, Indexes, Caches, Count };
+
+class MemoryAccounting {
+private:
+    static constexpr int tags = static_cast<int>(MemTag::Count);
+    struct Slot {
+        atomic<int64_t> bytes{0};
+        atomic<int64_t> peak{0};
+        atomic<int64_t> budget{0}; // 0 = unlimited
+        atomic<uint64_t> breaches{0};
+        atomic<bool> over{false};
+    };
+    Slot slots[tags];
+    MemoryAccounting() {}
+public:
+    static MemoryAccounting& instance() { static MemoryAccounting *m = new MemoryAccounting; return *m; }
+
+    static const char* name(MemTag t) {
+        static const char *names[] = {"inventory", "names", "carts", "orders", "indexes", "caches"};
+        return names[static_cast<int>(t)];
+    }
+
+    void charge(MemTag t, int64_t delta) {
+        Slot &s = slots[static_cast<int>(t)];
+        int64_t now = s.bytes.fetch_add(delta, memory_order_relaxed) + delta;
+        int64_t peak = s.peak.load(memory_order_relaxed);
+        while (now > peak && !s.peak.compare_exchange_weak(peak, now, memory_order_relaxed)) {}
+        int64_t budget = s.budget.load(memory_order_relaxed);
+        bool over = budget > 0 && now > budget;
+        if (over == s.over.load(memory_order_relaxed) || s.over.exchange(over) == over || !over) return;
+        if (s.breaches.fetch_add(1, memory_order_relaxed) == 0)
+            cerr << "Memory budget exceeded for " << name(t) << ": " << now << " > " << budget << " bytes\n";
+    }
+
+    int64_t bytes(MemTag t) const { return slots[static_cast<int>(t)].bytes.load(memory_order_relaxed); }
+    void setBudget(MemTag t, int64_t b) { slots[static_cast<int>(t)].budget.store(b, memory_order_relaxed); charge(t, 0); }
+
+    // "carts:64M,orders:512K" (suffixes K, M, G); throws ShopException on a bad spec.
+    void setBudgets(const string &spec) {
+        stringstream ss(spec);
+        string item;
+        while (getline(ss, item, ',')) {
+            size_t colon = item.find(':');
+            int t = 0;
+            while (t < tags && (colon == string::npos || item.compare(0, colon, name(static_cast<MemTag>(t))) != 0)) ++t;
+            if (t == tags || colon + 1 >= item.size()) throw ShopException("Bad memory budget '" + item + "'");
+            size_t used;
+            int64_t b = stoll(item.substr(colon + 1), &used);
+            string unit = item.substr(colon + 1 + used);
+            int shift = unit.empty() ? 0 : unit == "K" ? 10 : unit == "M" ? 20 : unit == "G" ? 30 : -1;
+            if (shift < 0 || b < 0) throw ShopException("Bad memory budget '" + item + "'");
+            setBudget(static_cast<MemTag>(t), b << shift);
+        }
+    }
+
+    vector<string> overBudget() const {
+        vector<string> out;
+        for (int t = 0; t < tags; ++t) if (slots[t].over.load(memory_order_relaxed)) out.push_back(name(static_cast<MemTag>(t)));
+        return out;
+    }
+
+    string toJson() const {
+        string out = "{";
+        int64_t total = 0;
+        for (int t = 0; t < tags; ++t) {
+            const Slot &s = slots[t];
+            char buf[192];
+            snprintf(buf, sizeof buf, "\"%s\":{\"bytes\":%lld,\"peak\":%lld,\"budget\":%lld,\"over\":%s,\"breaches\":%llu},",
+                     name(static_cast<MemTag>(t)), static_cast<long long>(s.bytes.load(memory_order_relaxed)),
+                     static_cast<long long>(s.peak.load(memory_order_relaxed)), static_cast<long long>(s.budget.load(memory_order_relaxed)),
+                     s.over.load(memory_order_relaxed) ? "true" : "false", static_cast<unsigned long long>(s.breaches.load(memory_order_relaxed)));
+            out += buf;
+            total += s.bytes.load(memory_order_relaxed);
+        }
+        return out + "\"total\":" + to_string(total) + "}";
+    }
+};
+
+// Pooled allocations charged to one subsystem.
+class TaggedResource : public pmr::memory_resource {
+private:
+    MemTag tag;
+    pmr::memory_resource *upstream;
+
+    void* do_allocate(size_t bytes, size_t align) override {
+        void *p = upstream->allocate(bytes, align);
+        MemoryAccounting::instance().charge(tag, static_cast<int64_t>(bytes));
+        return p;
+    }
+    void do_deallocate(void *p, size_t bytes, size_t align) override {
+        upstream->deallocate(p, bytes, align);
+        MemoryAccounting::instance().charge(tag, -static_cast<int64_t>(bytes));
+    }
+    bool do_is_equal(const pmr::memory_resource &o) const noexcept override { return this == &o; }
+public:
+    TaggedResource(MemTag t, pmr::memory_resource *up) : tag(t), upstream(up) {}
+
+    static TaggedResource& of(MemTag t) {
+        static TaggedResource *all = [] {
+            auto *r = static_cast<TaggedResource*>(::operator new(sizeof(TaggedResource) * static_cast<size_t>(MemTag::Count)));
+            for (int i = 0; i < static_cast<int>(MemTag::Count); ++i) new (&r[i]) TaggedResource(static_cast<MemTag>(i), &LinePool::instance());
+            return r;
+        }();
+        return all[static_cast<int>(t)];
+    }
+};
+
+// -------------------- Simulation hooks --------------------
+// Interleaving points for the deterministic simulator (shop_sim). Placed only where no
+// lock is held; a no-op unless a simulation installed SimHooks::yield.
+struct SimHooks {
+    static inline void (*yield)(const char *where) = nullptr;
+};
+
+inline void simYield(const char *where) { if (SimHooks::yield) SimHooks::yield(where); }
+
+// -------------------- Checksums --------------------
+// CRC32C (Castagnoli) guards every block written to disk: snapshots, order journals, and
+// the LSM store's logs and segments. Uses the SSE4.2 crc32 instruction when the CPU has
+// it and slicing-by-8 tables otherwise; both give the same values.
+class Crc32c {
+private:
+    static const array<array<uint32_t, 256>, 8>& tables() {
+        static const auto t = [] {
+            array<array<uint32_t, 256>, 8> t{};
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82f63b78u & (0u - (c & 1)));
+                t[0][i] = c;
+            }
+            for (uint32_t i = 0; i < 256; ++i)
+                for (size_t s = 1; s < 8; ++s) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
+            return t;
+        }();
+        return t;
+    }
+public:
+    static uint32_t software(uint32_t crc, const void *data, size_t n) {
+        const auto &t = tables();
+        const unsigned char *p = static_cast<const unsigned char*>(data);
+        crc = ~crc;
+        for (; n >= 8; p += 8, n -= 8) {
+            uint64_t w;
+            memcpy(&w, p, 8); // little-endian: the low byte is the first one
+            w ^= crc;
+            crc = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^ t[5][(w >> 16) & 0xff] ^ t[4][(w >> 24) & 0xff]
+                ^ t[3][(w >> 32) & 0xff] ^ t[2][(w >> 40) & 0xff] ^ t[1][(w >> 48) & 0xff] ^ t[0][w >> 56];
+        }
+        for (; n; ++p, --n) crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+        return ~crc;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2"))) static uint32_t hardware(uint32_t crc, const void *data, size_t n) {
+        const unsigned char *p = static_cast<const unsigned char*>(data);
+        uint64_t c = ~crc;
+        for (; n >= 8; p += 8, n -= 8) {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            c = _mm_crc32_u64(c, w);
+        }
+        uint32_t c32 = static_cast<uint32_t>(c);
+        for (; n; ++p, --n) c32 = _mm_crc32_u8(c32, *p);
+        return ~c32;
+    }
+    static inline const bool hasHardware = [] { __builtin_cpu_init(); return __builtin_cpu_supports("sse4.2") != 0; }();
+#else
+    static uint32_t hardware(uint32_t crc, const void *data, size_t n) { return software(crc, data, n); }
+    static constexpr bool hasHardware = false;
+#endif
+
+    // crc continues an earlier result over more bytes (start from 0).
+    static uint32_t extend(uint32_t crc, const void *data, size_t n) { return hasHardware ? hardware(crc, data, n) : software(crc, data, n); }
+    static uint32_t of(const void *data, size_t n) { return extend(0, data, n); }
+    static uint32_t of(const string &s) { return of(s.data(), s.size()); }
+};
+
+// What a file check found: counts of intact records and blocks, and one line per damaged
+// block (with its position) or structural problem.
+struct IntegrityReport {
+    string kind;
+    size_t records = 0, blocks = 0;
+    vector<string> problems;
+    bool ok() const { return problems.empty(); }
+};
+
+// Validates a version-2 inventory snapshot (see Inventory::saveToFile). When out is given,
+// receives the products of every intact block.
+IntegrityReport checkSnapshot(const string &data, vector<Product> *out = nullptr);
+
+// -------------------- Key-value store --------------------
+// What Inventory and the order journal need from an embedded store (LsmStore in
+// shop_store.hpp). put/remove with sync=true return only once the write is durable.
+class KvStore {
+public:
+    virtual ~KvStore() = default;
+    virtual void put(const string &key, const string &value, bool sync = false) = 0;
+    virtual void remove(const string &key, bool sync = false) = 0;
+    virtual optional<string> get(const string &key) = 0;
+    // Live entries whose key starts with prefix, in key order.
+    virtual void scan(const string &prefix, const function<void(const string &key, const string &value)> &fn) = 0;
+};
+
+// Sees every product change as the record persist() writes, in commit order: onChange runs
+// while the Inventory's write lock is held (ReplicationPrimary in shop_repl.hpp).
+class ChangeSink {
+public:
+    virtual ~ChangeSink() = default;
+    virtual void onChange(const string &key, const string &record) = 0;
+};
+
+// Told the id of every product that is added or changed, under the Inventory's write lock,
+// so it must be quick and must not call back into the Inventory (ListingCache).
+class ProductWatcher {
+public:
+    virtual ~ProductWatcher() = default;
+    virtual void productChanged(int id) = 0;
+};
+
+// -------------------- Inventory (Singleton) --------------------
+class Inventory {
+private:
+    unordered_map<int, Product> products; // id -> product
+    mutable shared_mutex mtx;             // readers share; writers hold it only to apply a change
+    mutex writeMutex;                     // one writer at a time, across its store write and apply
+    int64_t tableBytes = 0, indexBytes = 0, nameBytes = 0; // what this instance has charged
+    KvStore *store = nullptr;                              // write-through target, if attached
+    ChangeSink *sink = nullptr;                            // replication log, if attached
+    vector<ProductWatcher*> watchers;                      // rendered listings
+    Inventory() { }
+    friend class ShardedShop;  // each core shard owns a private Inventory
+    friend class StoreCatalog; // shares the product record format
+
+    // Re-estimates the table (nodes) and index (bucket array) footprint; caller holds mtx.
+    void accountTable() {
+        int64_t table = static_cast<int64_t>(products.size() * (sizeof(pair<const int, Product>) + sizeof(void*)));
+        int64_t index = static_cast<int64_t>(products.bucket_count() * sizeof(void*));
+        MemoryAccounting::instance().charge(MemTag::Inventory, table - tableBytes);
+        MemoryAccounting::instance().charge(MemTag::Indexes, index - indexBytes);
+        tableBytes = table;
+        indexBytes = index;
+    }
+
+    // Record layout: price (double), stock (int32), name bytes; keyed by productKey(id).
+    static string productKey(int id) { char k[16]; snprintf(k, sizeof k, "p/%010d", id); return k; }
+    static string encodeProduct(const Product &p) {
+        string v(sizeof(double) + sizeof(int32_t), '\0');
+        double price = p.getPrice();
+        int32_t stock = p.getStock();
+        memcpy(&v[0], &price, sizeof price);
+        memcpy(&v[sizeof price], &stock, sizeof stock);
+        return v + p.getName();
+    }
+    static optional<Product> decodeProduct(const string &key, const string &v) {
+        if (key.size() != 12 || v.size() < sizeof(double) + sizeof(int32_t)) return nullopt;
+        double price;
+        int32_t stock;
+        memcpy(&price, v.data(), sizeof price);
+        memcpy(&stock, v.data() + sizeof price, sizeof stock);
+        return Product(stoi(key.substr(2)), v.substr(sizeof price + sizeof stock), price, stock);
+    }
+
+    // Makes next the product's new value. The store is written first, outside mtx, so
+    // readers never wait on disk, and a failed write leaves memory untouched. Memory, the
+    // replication sink and the watchers are then updated together under mtx. Caller holds
+    // writeMutex, which keeps store and memory changes in the same order.
+    bool persist(const Product &next) {
+        string key, record;
+        if (store || sink) { key = productKey(next.getId()); record = encodeProduct(next); }
+        if (store) {
+            try {
+                store->put(key, record);
+            } catch (const ShopException &e) {
+                cerr << "Inventory: product " << next.getId() << " unchanged, store write failed: " << e.what() << endl;
+                return false;
+            }
+        }
+        unique_lock<shared_mutex> lk(mtx);
+        auto it = products.find(next.getId());
+        bool added = it == products.end();
+        if (added) it = products.emplace(next.getId(), Product()).first;
+        int64_t names = static_cast<int64_t>(next.nameHeapBytes()) - static_cast<int64_t>(it->second.nameHeapBytes());
+        it->second = next;
+        nameBytes += names;
+        MemoryAccounting::instance().charge(MemTag::Names, names);
+        if (added) accountTable();
+        if (sink) sink->onChange(key, record);
+        for (ProductWatcher *w : watchers) w->productChanged(next.getId());
+        return true;
+    }
+
+    // Applies change to a copy of the product and persists it. Only writers modify the
+    // table and they hold writeMutex, so the lookup here needs no read lock.
+    template <class F>
+    Expected<void> update(int id, F &&change) {
+        lock_guard<mutex> w(writeMutex);
+        auto it = products.find(id);
+        if (it == products.end()) return ShopError::NotFound;
+        Product next = it->second;
+        Expected<void> r = change(next);
+        if (!r) return r;
+        if (!persist(next)) return ShopError::StoreFailed;
+        return {};
+    }
+public:
+    Inventory(const Inventory&) = delete;
+    Inventory& operator=(const Inventory&) = delete;
+    ~Inventory() {
+        MemoryAccounting::instance().charge(MemTag::Inventory, -tableBytes);
+        MemoryAccounting::instance().charge(MemTag::Indexes, -indexBytes);
+        MemoryAccounting::instance().charge(MemTag::Names, -nameBytes);
+    }
+
+    static Inventory& instance() {
+        static Inventory inv;
+        return inv;
+    }
+
+    void addProduct(const Product &p) {
+        lock_guard<mutex> w(writeMutex);
+        if (!persist(p)) throw ShopException("Cannot add product " + to_string(p.getId()) + ": " + errorMessage(ShopError::StoreFailed));
+    }
+    bool hasProduct(int id) const { shared_lock<shared_mutex> lk(mtx); return products.find(id) != products.end(); }
+
+    Expected<Product> tryGetProduct(int id) const {
+        OpTimer timer(Metric::GetProduct);
+        shared_lock<shared_mutex> lk(mtx);
+        auto it = products.find(id);
+        if (it == products.end()) { timer.fail(); return ShopError::NotFound; }
+        return it->second;
+    }
+
+    Product getProduct(int id) const { return tryGetProduct(id).value(); }
+
+    Expected<void> trySetPrice(int id, double price) { return update(id, [&](Product &p) { return p.trySetPrice(price); }); }
+    Expected<void> trySetStock(int id, int stock) { return update(id, [&](Product &p) { return p.trySetStock(stock); }); }
+
+    void setPrice(int id, double price) { trySetPrice(id, price).value(); }
+    void setStock(int id, int stock) { trySetStock(id, stock).value(); }
+
+    // False if the product is unknown, short of stock or its change could not be stored;
+    // never throws, so checkout can always roll back.
+    bool reduceStock(int id, int qty) {
+        OpTimer timer(Metric::ReduceStock);
+        bool ok = static_cast<bool>(update(id, [&](Product &p) -> Expected<void> {
+            if (!p.reduceStock(qty)) return ShopError::InvalidQuantity;
+            return {};
+        }));
+        if (!ok) timer.fail();
+        return ok;
+    }
+
+    // Takes min(upTo, stock) units in one step and returns how many (escrow grants).
+    int takeStock(int id, int upTo) {
+        int n = 0;
+        Expected<void> r = update(id, [&](Product &p) -> Expected<void> {
+            n = min(upTo, p.getStock());
+            if (n <= 0 || !p.reduceStock(n)) return ShopError::InvalidQuantity;
+            return {};
+        });
+        return r ? n : 0;
+    }
+
+    // False if the product is unknown or the change could not be stored.
+    bool restock(int id, int qty) {
+        return static_cast<bool>(update(id, [&](Product &p) -> Expected<void> { p.increaseStock(qty); return {}; }));
+    }
+
+    // Loads every product record from s, then writes all later changes through to it.
+    // Returns the number of products loaded.
+    size_t attachStore(KvStore &s) {
+        size_t loaded = 0;
+        s.scan("p/", [&](const string &key, const string &value) {
+            optional<Product> p = decodeProduct(key, value);
+            if (!p) throw ShopException("Corrupt product record " + key);
+            addProduct(*p);
+            ++loaded;
+        });
+        lock_guard<mutex> w(writeMutex);
+        store = &s;
+        return loaded;
+    }
+
+    void setChangeSink(ChangeSink *s) {
+        lock_guard<mutex> w(writeMutex);
+        unique_lock<shared_mutex> lk(mtx);
+        sink = s;
+    }
+
+    void addWatcher(ProductWatcher *w) {
+        lock_guard<mutex> wl(writeMutex);
+        unique_lock<shared_mutex> lk(mtx);
+        watchers.push_back(w);
+    }
+    void removeWatcher(ProductWatcher *w) {
+        lock_guard<mutex> wl(writeMutex);
+        unique_lock<shared_mutex> lk(mtx);
+        watchers.erase(remove(watchers.begin(), watchers.end(), w), watchers.end());
+    }
+
+    // Calls fn(id, product or nullptr if there is none) for each id, all under one read lock.
+    void visit(const vector<int> &ids, const function<void(int, const Product*)> &fn) const {
+        shared_lock<shared_mutex> lk(mtx);
+        for (int id : ids) {
+            auto it = products.find(id);
+            fn(id, it == products.end() ? nullptr : &it->second);
+        }
+    }
+
+    // Every product as the (key, record) pairs persist() produces. underLock runs inside the
+    // same read lock, so whatever it captures (a log position) matches the export exactly.
+    vector<pair<string, string>> exportRecords(const function<void()> &underLock = {}) const {
+        vector<pair<string, string>> out;
+        shared_lock<shared_mutex> lk(mtx);
+        if (underLock) underLock();
+        out.reserve(products.size());
+        for (auto &kv : products) out.emplace_back(productKey(kv.first), encodeProduct(kv.second));
+        return out;
+    }
+
+    // Applies one record from exportRecords or a ChangeSink; false if it is malformed.
+    bool applyRecord(const string &key, const string &record) {
+        optional<Product> p = decodeProduct(key, record);
+        if (p) addProduct(*p);
+        return p.has_value();
+    }
+
+    pmr::vector<Product> listAll(pmr::memory_resource *mr = pmr::get_default_resource()) const {
+        pmr::vector<Product> out(mr);
+        {
+            shared_lock<shared_mutex> lk(mtx);
+            out.reserve(products.size());
+            for (auto &kv : products) out.push_back(kv.second);
+        }
+        sort(out.begin(), out.end(), [](const Product &a, const Product &b){ return a.getId() < b.getId(); });
+        return out;
+    }
+
+    // Snapshot format, version 2: a "#shop-snapshot 2" line, then blocks of up to ~64 KB of
+    // id,name,price,stock lines, each closed by "#block <lines> <bytes> <crc32c>" over those
+    // lines, and finally "#end <products> <blocks>". saveToFile blocks writers for the
+    // whole scan; checkpoint() pauses them only for the fork.
+    void saveToFile(const string &fname) const {
+        int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw ShopException("Cannot write " + fname);
+        bool ok;
+        {
+            shared_lock<shared_mutex> lk(mtx);
+            ok = writeSnapshot(fd);
+        }
+        close(fd);
+        if (!ok) throw ShopException("Cannot write " + fname);
+    }
+
+    // Copy-on-write checkpoint: forks while holding the write lock, so the child sees a
+    // table no writer is halfway through, then writes fname from its private copy of the
+    // pages (via fname.tmp and a rename) and exits. The parent is paused only for the
+    // fork itself; pauseUs receives that time. Returns the child's pid for waitCheckpoint.
+    pid_t checkpoint(const string &fname, double *pauseUs = nullptr) const {
+        auto start = chrono::steady_clock::now();
+        pid_t pid;
+        {
+            unique_lock<shared_mutex> lk(mtx);
+            pid = fork();
+            if (pid == 0) {
+                // Only this thread exists in the child: no locks, no destructors, no atexit.
+                string tmp = fname + ".tmp";
+                int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                bool ok = fd >= 0 && writeSnapshot(fd) && fdatasync(fd) == 0;
+                if (fd >= 0) close(fd);
+                _exit(ok && rename(tmp.c_str(), fname.c_str()) == 0 ? 0 : 1);
+            }
+        }
+        if (pauseUs) *pauseUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        if (pid < 0) throw ShopException("Cannot fork checkpoint: " + string(strerror(errno)));
+        return pid;
+    }
+
+    // Adds every product of a snapshot, or none: the whole file is validated first, and a
+    // damaged or truncated one throws naming the bad blocks. Returns the product count.
+    size_t loadFromFile(const string &fname) {
+        ifstream in(fname, ios::binary);
+        if (!in) throw ShopException("Cannot read " + fname);
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        vector<Product> loaded;
+        IntegrityReport r = checkSnapshot(data, &loaded);
+        if (!r.ok()) throw ShopException(fname + ": " + r.problems.front() + (r.problems.size() > 1 ? " (and " + to_string(r.problems.size() - 1) + " more)" : ""));
+        for (auto &p : loaded) addProduct(p);
+        return loaded.size();
+    }
+
+    // Reaps a checkpoint child; true if it wrote its file.
+    static bool waitCheckpoint(pid_t pid) {
+        int status;
+        while (waitpid(pid, &status, 0) < 0)
+            if (errno != EINTR) return false;
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+private:
+    // Writes the version-2 snapshot; the caller holds mtx (or is a checkpoint child).
+    bool writeSnapshot(int fd) const {
+        string buf = "#shop-snapshot 2\n";
+        buf.reserve(1 << 17);
+        size_t blockStart = buf.size(), lines = 0, blocks = 0;
+        char num[64];
+        auto drain = [&] {
+            for (size_t off = 0; off < buf.size();) {
+                ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                off += static_cast<size_t>(n);
+            }
+            buf.clear();
+            blockStart = 0;
+            return true;
+        };
+        auto closeBlock = [&] {
+            size_t bytes = buf.size() - blockStart;
+            snprintf(num, sizeof num, "#block %zu %zu %08x\n", lines, bytes, Crc32c::of(buf.data() + blockStart, bytes));
+            buf += num;
+            lines = 0;
+            ++blocks;
+            return drain();
+        };
+        for (auto &kv : products) {
+            const Product &p = kv.second;
+            buf += to_string(p.getId());
+            buf += ',';
+            buf += p.getName();
+            snprintf(num, sizeof num, ",%g,%d\n", p.getPrice(), p.getStock());
+            buf += num;
+            ++lines;
+            if (buf.size() - blockStart >= (1 << 16) && !closeBlock()) return false;
+        }
+        if (lines && !closeBlock()) return false;
+        snprintf(num, sizeof num, "#end %zu %zu\n", products.size(), blocks);
+        buf += num;
+        return drain();
+    }
+};
+
+// -------------------- Listing cache --------------------
+// The full catalog listing kept as rendered bytes: one rendered line per product, lines
+// joined into pages of pageIds consecutive ids, pages joined into the listing. A product
+// change only records its id (it runs under the Inventory's write lock). The next get()
+// re-renders just those products and their pages and concatenates the pages, so an
+// unchanged listing is handed out as is and a changed one costs a few renders and a memcpy.
+// A change that commits while get() is building is picked up by the following get().
+class ListingCache : public ProductWatcher {
+public:
+    using Render = function<string(const Product&)>;
+
+    // Same text as operator<< on a Product, plus the newline.
+    static string textLine(const Product &p) {
+        char tail[64];
+        snprintf(tail, sizeof tail, " - $%.2f (stock: %d)\n", p.getPrice(), p.getStock());
+        return "[" + to_string(p.getId()) + "] " + p.getName() + tail;
+    }
+
+private:
+    Inventory &inv;
+    Render render;
+    string open, separator, close;
+    int pageIds;
+    size_t maxPending;
+    mutex pendingMutex;
+    vector<int> pending;      // changed ids since the last get() (pendingMutex)
+    bool stale = true;        // re-render everything (pendingMutex)
+    mutex buildMutex;         // everything below
+    map<int, string> lines;   // id -> rendered product
+    map<int, string> pages;   // pageOf(id) -> its lines joined by separator
+    shared_ptr<const string> listing;
+    int64_t bytes = 0;        // charged to MemTag::Caches
+    uint64_t renders = 0, builds = 0, reused = 0;
+
+    void account(int64_t delta) { bytes += delta; MemoryAccounting::instance().charge(MemTag::Caches, delta); }
+    // Rounds down, so negative ids get pages of their own and pages stay in id order.
+    int pageOf(int id) const { return id >= 0 ? id / pageIds : -(-(id + 1) / pageIds) - 1; }
+    void setLine(int id, string text) {
+        string &slot = lines[id];
+        account(static_cast<int64_t>(text.size()) - static_cast<int64_t>(slot.size()));
+        slot = move(text);
+        ++renders;
+    }
+
+public:
+    ListingCache(Inventory &i, Render r = textLine, string open = "", string separator = "", string close = "", int pageIds = 256)
+        : inv(i), render(move(r)), open(move(open)), separator(move(separator)), close(move(close)), pageIds(max(1, pageIds)),
+          maxPending(1 << 16) {
+        inv.addWatcher(this);
+    }
+    ListingCache(const ListingCache&) = delete;
+    ListingCache& operator=(const ListingCache&) = delete;
+    ~ListingCache() {
+        inv.removeWatcher(this);
+        MemoryAccounting::instance().charge(MemTag::Caches, -bytes);
+    }
+
+    void productChanged(int id) override {
+        lock_guard<mutex> lk(pendingMutex);
+        if (stale) return;
+        if (pending.size() < maxPending) pending.push_back(id);
+        else { stale = true; pending.clear(); } // cheaper to render everything again
+    }
+
+    // The listing as of this call, shared with other callers until the catalog changes.
+    shared_ptr<const string> get() {
+        lock_guard<mutex> build(buildMutex);
+        vector<int> ids;
+        bool all;
+        {
+            lock_guard<mutex> lk(pendingMutex);
+            ids.swap(pending);
+            all = stale;
+            stale = false;
+        }
+        if (!all && ids.empty() && listing) { ++reused; return listing; }
+        ++builds;
+        set<int> dirtyPages;
+        if (all) {
+            account(-bytes);
+            listing.reset();
+            lines.clear();
+            pages.clear();
+            for (auto &p : inv.listAll()) setLine(p.getId(), render(p));
+            for (auto &l : lines) dirtyPages.insert(pageOf(l.first));
+        } else {
+            sort(ids.begin(), ids.end());
+            ids.erase(unique(ids.begin(), ids.end()), ids.end());
+            inv.visit(ids, [&](int id, const Product *p) {
+                if (p) setLine(id, render(*p));
+                else if (lines.count(id)) { account(-static_cast<int64_t>(lines[id].size())); lines.erase(id); }
+                dirtyPages.insert(pageOf(id));
+            });
+        }
+        for (int k : dirtyPages) {
+            string page;
+            for (auto it = lines.lower_bound(k * pageIds); it != lines.end() && pageOf(it->first) == k; ++it) {
+                if (!page.empty()) page += separator;
+                page += it->second;
+            }
+            string &slot = pages[k];
+            account(static_cast<int64_t>(page.size()) - static_cast<int64_t>(slot.size()));
+            slot = move(page);
+        }
+        size_t total = open.size() + close.size();
+        for (auto &pg : pages) total += pg.second.size() + separator.size();
+        string out;
+        out.reserve(total);
+        out += open;
+        for (auto &pg : pages) {
+            if (pg.second.empty()) continue;
+            if (out.size() > open.size()) out += separator;
+            out += pg.second;
+        }
+        out += close;
+        account(static_cast<int64_t>(out.size()) - static_cast<int64_t>(listing ? listing->size() : 0));
+        listing = make_shared<const string>(move(out));
+        return listing;
+    }
+
+    string statsJson() {
+        lock_guard<mutex> build(buildMutex);
+        return "{\"products\":" + to_string(lines.size()) + ",\"pages\":" + to_string(pages.size()) + ",\"bytes\":" + to_string(bytes) +
+               ",\"renders\":" + to_string(renders) + ",\"builds\":" + to_string(builds) + ",\"reused\":" + to_string(reused) + "}";
+    }
+};
+
+// -------------------- ShoppingCart --------------------
+// Allocator-aware, so a pmr container of carts hands its resource to every cart it holds.
+class ShoppingCart {
+private:
+    pmr::vector<CartItem> items;
+public:
+    using allocator_type = pmr::polymorphic_allocator<CartItem>;
+
+    explicit ShoppingCart(pmr::memory_resource *mr = &LinePool::instance()) : items(mr) {}
+    explicit ShoppingCart(const allocator_type &a) : items(a) {}
+    // A plain copy would move the lines to the default resource, off their memory tag; copy
+    // with an explicit allocator instead.
+    ShoppingCart(const ShoppingCart &other) = delete;
+    ShoppingCart(ShoppingCart &&other) = default;
+    ShoppingCart(const ShoppingCart &other, const allocator_type &a) : items(other.items, a) {}
+    ShoppingCart(ShoppingCart &&other, const allocator_type &a) : items(move(other.items), a) {}
+    ShoppingCart& operator=(const ShoppingCart&) = default;
+    ShoppingCart& operator=(ShoppingCart&&) = default;
+
+    void addToCart(const Product &p, int qty) { items.emplace_back(p, qty); }
+    void removeFromCart(int /*productId*/, int /*qty*/) { /* simplified */ }
+    double total() const { double sum=0; for(auto& ci:items) sum+=ci.subtotal(); return sum; }
+    const pmr::vector<CartItem>& getItems() const { return items; }
+    void clear() { items.clear(); }
+    bool empty() const { return items.empty(); }
+};
+
+// -------------------- Order --------------------
+class Order {
+private:
+    static atomic<int> nextOrderId;
+    int orderId;
+    pmr::vector<CartItem> items;
+    double amount;
+public:
+    Order(const pmr::vector<CartItem> &its, pmr::memory_resource *mr = &TaggedResource::of(MemTag::Orders))
+        : orderId(++nextOrderId), items(its, mr) {
+        amount = 0; for (auto &i : items) amount += i.subtotal();
+    }
+
+    // For callers that allocate ids themselves (e.g. per-shard sequences).
+    Order(int id, const pmr::vector<CartItem> &its, pmr::memory_resource *mr = &TaggedResource::of(MemTag::Orders))
+        : orderId(id), items(its, mr) {
+        amount = 0; for (auto &i : items) amount += i.subtotal();
+    }
+
+    int getId() const { return orderId; }
+    double getAmount() const { return amount; }
+
+    // After recovering orders from storage: new ids continue past `id`.
+    static void continueAfter(int id) {
+        int cur = nextOrderId.load();
+        while (cur < id && !nextOrderId.compare_exchange_weak(cur, id)) {}
+    }
+    const pmr::vector<CartItem>& getItems() const { return items; }
+
+    void printSummary() const {
+        cout << "Order #" << orderId << "\n";
+        for (auto &ci : items) cout << "  " << ci.product.getName() << " x" << ci.quantity << " = $" << ci.subtotal() << "\n";
+        cout << "Total: $" << amount << "\n";
+    }
+};
+
+// -------------------- Order journal --------------------
+// Append-only log of completed orders. Files start with "#shop-journal 2"; then one line
+// per order, each carrying the CRC32C of everything before its '#':
+//   orderId,amount,productId:qty;productId:qty...#<crc32c>
+// commit() returns only once the record is on stable storage.
+class OrderJournal {
+public:
+    virtual ~OrderJournal() = default;
+    virtual void commit(const Order &o) = 0;
+
+    static string record(const Order &o) {
+        char amount[32];
+        snprintf(amount, sizeof amount, "%.2f", o.getAmount());
+        string line = to_string(o.getId()) + ',' + amount + ',';
+        for (size_t i = 0; i < o.getItems().size(); ++i) {
+            const CartItem &ci = o.getItems()[i];
+            if (i) line += ';';
+            line += to_string(ci.product.getId()) + ':' + to_string(ci.quantity);
+        }
+        char crc[16];
+        snprintf(crc, sizeof crc, "#%08x\n", Crc32c::of(line));
+        return line + crc;
+    }
+};
+
+// Opens for appending, writing the "#shop-journal 2" header into a new file.
+int openJournalFile(const string &fname);
+
+// Checks every record of a journal file; a final line without its newline is a torn write.
+IntegrityReport checkJournal(const string &data);
+
+// Plain write() + fdatasync() per order.
+class PosixJournal : public OrderJournal {
+private:
+    int fd;
+public:
+    explicit PosixJournal(const string &fname) : fd(openJournalFile(fname)) {}
+    PosixJournal(const PosixJournal&) = delete;
+    PosixJournal& operator=(const PosixJournal&) = delete;
+    ~PosixJournal() override { close(fd); }
+
+    void commit(const Order &o) override {
+        string line = record(o);
+        if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()) || fdatasync(fd) != 0)
+            throw ShopException("Journal write failed");
+    }
+};
+
+// -------------------- ShopService --------------------
+// Cart-aware facade over the Inventory used by the network front ends.
+// Carts are keyed by a client-chosen id; stock is only taken at checkout.
+class ShopService {
+private:
+    Inventory &inv;
+    pmr::unordered_map<int, ShoppingCart> carts{&TaggedResource::of(MemTag::Carts)};
+    mutex cartsMutex;
+    OrderJournal *journal = nullptr;
+    mutex journalMutex;
+public:
+    explicit ShopService(Inventory &i) : inv(i) {}
+
+    void setJournal(OrderJournal *j) { journal = j; }
+
+    static bool pay(Payment &payment, double amount) {
+        OpTimer timer(Metric::Pay);
+        bool ok = payment.pay(amount);
+        if (!ok) timer.fail();
+        return ok;
+    }
+
+    Inventory& inventory() { return inv; }
+
+private:
+    // Undoes a failed checkout: puts back the stock of the first `reserved` lines and the
+    // lines themselves into the customer's cart.
+    void release(int cartId, const pmr::vector<CartItem> &items, size_t reserved) {
+        TraceSpan span("rollback", cartId);
+        for (size_t i = 0; i < reserved; ++i) {
+            inv.restock(items[i].product.getId(), items[i].quantity);
+            simYield("line released");
+        }
+        lock_guard<mutex> lk(cartsMutex);
+        ShoppingCart &back = carts[cartId];
+        for (auto &ci : items) back.addToCart(ci.product, ci.quantity);
+    }
+
+public:
+    // Snapshot of a cart, allocated from mr (a request arena in the front ends).
+    ShoppingCart cart(int cartId, pmr::memory_resource *mr = &LinePool::instance()) {
+        lock_guard<mutex> lk(cartsMutex);
+        auto it = carts.find(cartId);
+        return it == carts.end() ? ShoppingCart(mr) : ShoppingCart(it->second, mr);
+    }
+
+    Expected<void> tryAddToCart(int cartId, int productId, int qty) {
+        OpTimer timer(Metric::CartAdd);
+        if (qty <= 0) { timer.fail(); return ShopError::InvalidQuantity; }
+        Expected<Product> p = inv.tryGetProduct(productId);
+        if (!p) { timer.fail(); return p.error(); }
+        simYield("add to cart");
+        lock_guard<mutex> lk(cartsMutex);
+        carts[cartId].addToCart(*p, qty);
+        return {};
+    }
+
+    void addToCart(int cartId, int productId, int qty) { tryAddToCart(cartId, productId, qty).value(); }
+
+    void clearCart(int cartId) { lock_guard<mutex> lk(cartsMutex); carts.erase(cartId); }
+
+    // Reserves stock for every line, charges the payment and turns the cart into an order.
+    // Stock already taken is put back (and the cart restored) if a line runs out or the
+    // payment is declined; if the order then cannot be journaled, the payment is refunded
+    // as well, so a failed checkout never keeps money or stock. The cart is detached first
+    // so payment runs without any lock held. The order's lines are allocated from mr.
+    Order checkout(int cartId, Payment &payment, pmr::memory_resource *mr = &TaggedResource::of(MemTag::Orders)) {
+        OpTimer timer(Metric::Checkout);
+        TraceSpan whole("checkout", cartId);
+        ShoppingCart c(carts.get_allocator().resource()); // same resource, so detaching moves the lines
+        {
+            TraceSpan span("validate cart", cartId);
+            lock_guard<mutex> lk(cartsMutex);
+            auto it = carts.find(cartId);
+            if (it == carts.end() || it->second.empty()) throw ShopException("Cart is empty");
+            c = move(it->second);
+            carts.erase(it);
+        }
+        simYield("cart detached");
+        const pmr::vector<CartItem> &items = c.getItems();
+        size_t reserved = 0;
+        {
+            TraceSpan span("reserve stock", cartId);
+            for (; reserved < items.size(); ++reserved) {
+                if (!inv.reduceStock(items[reserved].product.getId(), items[reserved].quantity)) break;
+                simYield("line reserved");
+            }
+        }
+        bool paid = false;
+        if (reserved == items.size()) {
+            TraceSpan span("payment", cartId);
+            paid = pay(payment, c.total());
+        }
+        if (!paid) {
+            release(cartId, items, reserved);
+            throw ShopException(reserved < items.size() ? "Insufficient stock" : "Payment declined");
+        }
+        optional<Order> o;
+        {
+            TraceSpan span("create order", cartId);
+            o.emplace(items, mr);
+            span.setOrder(o->getId());
+        }
+        whole.setOrder(o->getId());
+        simYield("order created");
+        if (journal) {
+            string failure;
+            {
+                TraceSpan span("persist", cartId);
+                span.setOrder(o->getId());
+                lock_guard<mutex> lk(journalMutex);
+                try {
+                    journal->commit(*o);
+                } catch (const ShopException &e) {
+                    failure = e.what();
+                }
+            }
+            if (!failure.empty()) {
+                if (!payment.refund(c.total()))
+                    cerr << "Refund of unrecorded order " << o->getId() << " failed; reconcile by hand" << endl;
+                release(cartId, items, reserved);
+                throw ShopException("Order not recorded (" + failure + "), payment refunded");
+            }
+        }
+        return move(*o);
+    }
+};
+
+// Payment for a client-supplied method name: "card" or "paypal"; throws otherwise.
+using PaymentFactory = function<unique_ptr<Payment>(const string &method)>;
+unique_ptr<Payment> makePayment(const string &method);
+// makePayment plus "instant" (InstantPayment). Only benchmarks, and servers started with
+// --test-payments for the load generator, may install it.
+unique_ptr<Payment> makeTestPayment(const string &method);
+
+// Fills the singleton with the two demo products plus generated ones up to n; with owns,
+// only the ids it accepts (one partition of the catalog).
+void seedCatalog(Inventory &inv, int n, const function<bool(int)> &owns = {});
+
+// Escapes quotes, backslashes and control characters for embedding in a JSON string.
+string jsonEscape(const string &s);
+
+#endif // SHOP_CORE_HPP
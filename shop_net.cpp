@@ -0,0 +1,626 @@
+// shop_net.cpp
+
+#include "shop_net.hpp"
+#include <sys/wait.h>
+
+volatile sig_atomic_t stopRequested = 0;
+extern "C" void onStopSignal(int) { stopRequested = 1; }
+
+int listenTcp(const string &host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw ShopException("socket() failed");
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) { close(fd); throw ShopException("Bad listen address"); }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        throw ShopException("Cannot listen on " + host + ":" + to_string(port));
+    }
+    return fd;
+}
+
+string toJson(const Product &p) {
+    char price[32];
+    snprintf(price, sizeof price, "%.2f", p.getPrice());
+    return "{\"id\":" + to_string(p.getId()) + ",\"name\":\"" + jsonEscape(p.getName()) + "\",\"price\":" + price
+         + ",\"stock\":" + to_string(p.getStock()) + "}";
+}
+
+string toJson(const pmr::vector<CartItem> &items, double total) {
+    string out = "{\"items\":[";
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (i) out += ',';
+        out += "{\"product\":" + to_string(items[i].product.getId()) + ",\"quantity\":" + to_string(items[i].quantity) + "}";
+    }
+    char t[32];
+    snprintf(t, sizeof t, "%.2f", total);
+    return out + "],\"total\":" + t + "}";
+}
+
+int connectTcp(const string &host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0) {
+        if (fd >= 0) close(fd);
+        throw ShopException("Cannot connect to " + host + ":" + to_string(port));
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+size_t httpResponseEnd(const string &buf, int *status, size_t pos) {
+    size_t headEnd = buf.find("\r\n\r\n", pos);
+    if (headEnd == string::npos) return 0;
+    if (status && buf.compare(pos, 5, "HTTP/") == 0) *status = atoi(buf.c_str() + pos + 9);
+    size_t cl = buf.find("Content-Length: ", pos);
+    size_t len = (cl != string::npos && cl < headEnd) ? strtoul(buf.c_str() + cl + 16, nullptr, 10) : 0;
+    return buf.size() >= headEnd + 4 + len ? headEnd + 4 + len : 0;
+}
+
+bool readHttpResponses(int fd, string &buf, int count, int *lastStatus) {
+    size_t pos = 0;
+    while (count > 0) {
+        if (size_t end = httpResponseEnd(buf, lastStatus, pos)) { pos = end; --count; continue; }
+        char chunk[65536];
+        ssize_t n = read(fd, chunk, sizeof chunk);
+        if (n <= 0) return false;
+        buf.append(chunk, static_cast<size_t>(n));
+    }
+    buf.erase(0, pos);
+    return true;
+}
+
+void runHttpBench(const string &host, int port, int connections, long total, int pipeline, const string &path) {
+    vector<int> fds;
+    for (int i = 0; i < connections; ++i) fds.push_back(connectTcp(host, port));
+    string request = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n", batch;
+    for (int i = 0; i < pipeline; ++i) batch += request;
+    vector<string> bufs(fds.size());
+    long done = 0;
+    auto start = chrono::steady_clock::now();
+    while (done < total) {
+        for (int fd : fds)
+            if (write(fd, batch.data(), batch.size()) != static_cast<ssize_t>(batch.size())) throw ShopException("write failed");
+        for (size_t i = 0; i < fds.size(); ++i)
+            if (!readHttpResponses(fds[i], bufs[i], pipeline)) throw ShopException("Server closed the connection");
+        done += static_cast<long>(fds.size()) * pipeline;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (int fd : fds) close(fd);
+    cout << done << " requests in " << fixed << setprecision(3) << secs << "s over " << connections
+         << " connections (pipeline " << pipeline << "): " << setprecision(0) << done / secs << " req/s\n";
+}
+
+void writeProduct(WireWriter &w, const Product &p) {
+    w.put(static_cast<int32_t>(p.getId()));
+    w.put(p.getPrice());
+    w.put(static_cast<int32_t>(p.getStock()));
+    w.putString(p.getName());
+}
+
+bool readProduct(WireReader &r, Product &p) {
+    int32_t id, stock;
+    double price;
+    string_view name;
+    if (!r.get(id) || !r.get(price) || !r.get(stock) || !r.getString(name)) return false;
+    p = Product(id, string(name), price, stock);
+    return true;
+}
+
+int listenUnix(const string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw ShopException("socket() failed");
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) { close(fd); throw ShopException("Socket path too long"); }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        throw ShopException("Cannot listen on " + path);
+    }
+    return fd;
+}
+
+int connectUnix(const string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0) {
+        if (fd >= 0) close(fd);
+        throw ShopException("Cannot connect to " + path);
+    }
+    return fd;
+}
+
+void runRpcBench(const string &path, long total, int inflight, int catalogSize) {
+    RpcClient client(path);
+    RpcClient::Reply first = client.call(RpcOp::GetProduct, 1);
+    WireReader r(first.payload.data(), first.payload.size());
+    Product p;
+    if (first.status != RpcStatus::Ok || !readProduct(r, p)) throw ShopException("GetProduct(1) failed");
+    cout << "GetProduct(1) -> " << p << "\n";
+    unordered_set<uint32_t> pending;
+    long sent = 0, done = 0;
+    auto start = chrono::steady_clock::now();
+    while (done < total) {
+        while (sent < total && static_cast<int>(pending.size()) < inflight) {
+            pending.insert(client.send(RpcOp::GetProduct, static_cast<int32_t>(1 + sent % catalogSize)));
+            ++sent;
+        }
+        RpcClient::Reply r = client.receive();
+        if (!pending.erase(r.requestId)) throw ShopException("Reply for unknown request " + to_string(r.requestId));
+        ++done;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << done << " calls in " << fixed << setprecision(3) << secs << "s (" << inflight << " in flight): "
+         << setprecision(0) << done / secs << " calls/s\n";
+}
+
+void runPartitionBench(int partitions, int products, long lookups) {
+    vector<string> sockets;
+    vector<pid_t> workers;
+    cout.flush();
+    for (int part = 0; part < partitions; ++part) { // fork before this process starts any threads
+        sockets.push_back("/tmp/shop-part-" + to_string(getpid()) + "-" + to_string(part) + ".sock");
+        pid_t pid = fork();
+        if (pid < 0) throw ShopException("fork() failed");
+        if (pid == 0) {
+            signal(SIGTERM, onStopSignal);
+            seedCatalog(Inventory::instance(), products, [&](int id) { return partitionOf(id, partitions) == part; });
+            ShopService shop(Inventory::instance());
+            unique_ptr<EventServer> server = makeServer("epoll", listenUnix(sockets.back()), [&] { return make_unique<RpcProtocol>(shop); });
+            server->run();
+            unlink(sockets.back().c_str());
+            _exit(0);
+        }
+        workers.push_back(pid);
+    }
+    auto stopWorkers = [&] {
+        for (pid_t pid : workers) kill(pid, SIGTERM);
+        for (pid_t pid : workers) waitpid(pid, nullptr, 0);
+    };
+    try {
+        unique_ptr<PartitionRouter> router;
+        for (int attempt = 0; !router; ++attempt) {
+            try {
+                router = make_unique<PartitionRouter>(sockets);
+            } catch (const ShopException&) {
+                if (attempt == 500) throw;
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+        }
+        auto timed = [](const function<void()> &body) {
+            auto start = chrono::steady_clock::now();
+            body();
+            return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        };
+
+        vector<Product> all;
+        double listSecs = timed([&] { all = router->listAll(); });
+        bool complete = static_cast<int>(all.size()) == products;
+        for (size_t i = 0; complete && i < all.size(); ++i) complete = all[i].getId() == static_cast<int>(i) + 1;
+        vector<size_t> owned(static_cast<size_t>(partitions));
+        for (auto &p : all) ++owned[static_cast<size_t>(partitionOf(p.getId(), partitions))];
+        cout << fixed << setprecision(1) << partitions << " partitions, " << products << " products: listAll " << (complete ? "complete and in order" : "WRONG")
+             << " in " << listSecs * 1e3 << " ms; per partition";
+        for (size_t n : owned) cout << ' ' << n;
+        cout << endl;
+
+        mt19937 rng(11);
+        long found = 0;
+        double pointSecs = timed([&] {
+            for (long i = 0; i < lookups; ++i) found += router->getProduct(static_cast<int>(rng() % static_cast<unsigned>(products)) + 1).has_value();
+        });
+        vector<int> batch(static_cast<size_t>(lookups));
+        for (auto &id : batch) id = static_cast<int>(rng() % static_cast<unsigned>(products)) + 1;
+        vector<Expected<Product>> got;
+        double batchSecs = timed([&] { got = router->getProducts(batch); });
+        long batchFound = 0;
+        for (size_t i = 0; i < got.size(); ++i) batchFound += got[i] && got[i]->getId() == batch[i];
+        cout << setprecision(0) << lookups << " routed getProduct: " << lookups / pointSecs << "/s (" << found << " found); batched: "
+             << lookups / batchSecs << "/s (" << batchFound << " found)" << endl;
+
+        bool routed = !router->getProduct(products + 1).has_value() && !router->reduceStock(products + 1, 1);
+        for (int id = 1; id <= min(products, 64); ++id) {
+            int before = router->getProduct(id)->getStock();
+            routed = routed && router->reduceStock(id, 1) && router->getProduct(id)->getStock() == before - 1;
+        }
+        cout << (routed ? "stock updates reached their owners; unknown ids are rejected" : "ROUTING ERROR") << endl;
+    } catch (...) {
+        stopWorkers();
+        throw;
+    }
+    stopWorkers();
+}
+
+void runEscrowBench(int nodes, int threads, int stock, double seconds) {
+    const int hotId = 1, scarceId = 2, hotStock = 1 << 30;
+    string sock = "/tmp/shop-escrow-" + to_string(getpid()) + ".sock";
+    cout.flush();
+    pid_t ownerPid = fork(); // fork before this process starts any threads
+    if (ownerPid < 0) throw ShopException("fork() failed");
+    if (ownerPid == 0) {
+        signal(SIGTERM, onStopSignal);
+        Inventory::instance().addProduct(Product(hotId, "Hot item", 10.0, hotStock));
+        Inventory::instance().addProduct(Product(scarceId, "Limited item", 99.0, stock));
+        ShopService shop(Inventory::instance());
+        EscrowLedger escrow(Inventory::instance());
+        makeServer("epoll", listenUnix(sock), [&] { return make_unique<RpcProtocol>(shop, &escrow); })->run();
+        unlink(sock.c_str());
+        _exit(0);
+    }
+    auto connect = [&] {
+        for (int attempt = 0;; ++attempt) {
+            try {
+                return make_unique<PartitionRouter>(vector<string>{sock});
+            } catch (const ShopException&) {
+                if (attempt == 500) throw;
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+        }
+    };
+
+    // Three phases on a shared clock: hot product through the owner, hot product through
+    // escrow, then the scarce product through escrow until it is gone.
+    struct NodeResult { long direct, escrowed, scarce; uint64_t local, viaOwner; };
+    auto phase = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+    auto start = chrono::steady_clock::now() + chrono::milliseconds(500);
+    vector<pid_t> pids;
+    vector<int> pipes;
+    for (int n = 0; n < nodes; ++n) {
+        int fds[2];
+        if (pipe(fds) < 0) throw ShopException("pipe() failed");
+        pid_t pid = fork();
+        if (pid < 0) throw ShopException("fork() failed");
+        if (pid == 0) {
+            close(fds[0]);
+            NodeResult res{};
+            try {
+                auto sell = [&](const function<bool(int)> &reduce, chrono::steady_clock::time_point from) {
+                    atomic<long> sold{0};
+                    vector<thread> pool;
+                    for (int t = 0; t < threads; ++t)
+                        pool.emplace_back([&, t] {
+                            this_thread::sleep_until(from);
+                            long mine = 0;
+                            while (chrono::steady_clock::now() < from + phase) mine += reduce(t) ? 1 : 0;
+                            sold += mine;
+                        });
+                    for (auto &th : pool) th.join();
+                    return sold.load();
+                };
+                vector<unique_ptr<PartitionRouter>> direct;
+                for (int t = 0; t < threads; ++t) direct.push_back(connect());
+                res.direct = sell([&](int t) { return direct[static_cast<size_t>(t)]->reduceStock(hotId, 1); }, start);
+                {
+                    StockEscrow escrow({sock});
+                    res.escrowed = sell([&](int) { return escrow.reduceStock(hotId, 1); }, start + phase);
+                    res.scarce = sell([&](int) { return escrow.reduceStock(scarceId, 1); }, start + 2 * phase);
+                    string stats = escrow.statsJson();
+                    auto field = [&](const string &name) { return stoull(stats.substr(stats.find("\"" + name + "\":") + name.size() + 3)); };
+                    res.local = field("local_sales");
+                    res.viaOwner = field("owner_sales");
+                } // returns whatever this node still holds
+            } catch (const ShopException &e) {
+                cerr << "Node " << n << ": " << e.what() << endl;
+            }
+            ssize_t w = write(fds[1], &res, sizeof res);
+            _exit(w == static_cast<ssize_t>(sizeof res) ? 0 : 1);
+        }
+        close(fds[1]);
+        pids.push_back(pid);
+        pipes.push_back(fds[0]);
+    }
+
+    NodeResult total{};
+    for (size_t n = 0; n < pids.size(); ++n) {
+        NodeResult res{};
+        if (read(pipes[n], &res, sizeof res) != static_cast<ssize_t>(sizeof res)) cerr << "Node " << n << " reported nothing" << endl;
+        close(pipes[n]);
+        waitpid(pids[n], nullptr, 0);
+        total.direct += res.direct;
+        total.escrowed += res.escrowed;
+        total.scarce += res.scarce;
+        total.local += res.local;
+        total.viaOwner += res.viaOwner;
+    }
+    int hotLeft = -1, scarceLeft = -1;
+    try {
+        unique_ptr<PartitionRouter> router = connect();
+        if (auto p = router->getProduct(hotId)) hotLeft = p->getStock();
+        if (auto p = router->getProduct(scarceId)) scarceLeft = p->getStock();
+    } catch (...) {
+        kill(ownerPid, SIGTERM);
+        waitpid(ownerPid, nullptr, 0);
+        throw;
+    }
+    kill(ownerPid, SIGTERM);
+    waitpid(ownerPid, nullptr, 0);
+
+    double uses = static_cast<double>(total.local + total.viaOwner);
+    cout << fixed << setprecision(0) << nodes << " nodes x " << threads << " threads, " << seconds << " s per phase" << endl
+         << "  through the owner: " << total.direct / seconds << " sales/s" << endl
+         << "  through escrow:    " << total.escrowed / seconds << " sales/s (" << setprecision(1)
+         << (total.direct ? static_cast<double>(total.escrowed) / static_cast<double>(total.direct) : 0.0) << "x), "
+         << (uses > 0 ? 100.0 * static_cast<double>(total.local) / uses : 0.0) << "% sold from a local quota" << endl;
+    bool hotOk = hotLeft == hotStock - static_cast<int>(total.direct + total.escrowed);
+    bool scarceOk = scarceLeft >= 0 && total.scarce + scarceLeft == stock;
+    cout << "  limited item: " << total.scarce << " of " << stock << " sold, " << scarceLeft << " left at the owner" << endl
+         << (hotOk && scarceOk ? "  every unit accounted for, none oversold" : "  STOCK MISMATCH") << endl;
+}
+
+void prepRw(io_uring_sqe *sqe, uint8_t op, int fd, const void *buf, size_t len, uint64_t userData, int bufIndex) {
+    if (bufIndex >= 0) op = op == IORING_OP_READ ? uint8_t(IORING_OP_READ_FIXED) : uint8_t(IORING_OP_WRITE_FIXED);
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = static_cast<uint32_t>(len);
+    sqe->off = static_cast<uint64_t>(-1); // current position / append
+    sqe->buf_index = static_cast<uint16_t>(bufIndex >= 0 ? bufIndex : 0);
+    sqe->user_data = userData;
+}
+
+unique_ptr<EventServer> makeServer(const string &io, int listenFd, ProtocolFactory f) {
+    if (io != "epoll") {
+        try {
+            return make_unique<UringServer>(listenFd, f);
+        } catch (const ShopException &e) {
+            if (io == "uring") { close(listenFd); throw; }
+            cerr << e.what() << ", falling back to epoll\n";
+        }
+    }
+    return make_unique<EpollServer>(listenFd, move(f));
+}
+
+unique_ptr<OrderJournal> makeJournal(const string &io, const string &fname) {
+    if (io != "epoll") {
+        try {
+            return make_unique<UringJournal>(fname);
+        } catch (const ShopException &e) {
+            if (io == "uring") throw;
+        }
+    }
+    return make_unique<PosixJournal>(fname);
+}
+
+void runIoBench(long requests, int connections, int pipeline, long commits) {
+    for (string io : {"epoll", "uring"}) {
+        int port = 18700 + (io == "uring");
+        pid_t pid = fork();
+        if (pid == 0) {
+            seedCatalog(Inventory::instance(), 1000);
+            ShopService shop(Inventory::instance());
+            ShopHttpHandler handler(shop);
+            signal(SIGTERM, onStopSignal);
+            makeServer(io, listenTcp("127.0.0.1", port), [&] { return make_unique<HttpProtocol>(handler); })->run();
+            _exit(0);
+        }
+        for (int attempt = 0; attempt < 100; ++attempt) {
+            try { close(connectTcp("127.0.0.1", port)); break; }
+            catch (const ShopException&) { this_thread::sleep_for(chrono::milliseconds(10)); }
+        }
+        cout << setw(6) << io << " server: ";
+        runHttpBench("127.0.0.1", port, connections, requests, pipeline, "/products/1");
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+    Order sample({CartItem(Product(1, "Mouse", 15.0, 10), 2)});
+    for (string io : {"epoll", "uring"}) {
+        string fname = "/tmp/shop-journal-bench-" + to_string(getpid()) + ".log";
+        unique_ptr<OrderJournal> journal = makeJournal(io, fname);
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < commits; ++i) journal->commit(sample);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        journal.reset();
+        unlink(fname.c_str());
+        cout << setw(6) << io << " journal: " << commits << " commits in " << fixed << setprecision(3) << secs
+             << "s: " << setprecision(0) << commits / secs << " commits/s\n";
+    }
+}
+
+// One shopper of the load generator: a non-blocking keep-alive connection and at most
+// one request in flight on it.
+struct LoadGenShopper {
+    int id;
+    int fd = -1;
+    string in, out;
+    int cartLines = 0;
+    int op = 0;
+    bool waiting = false; // a request is in flight
+    bool cleanup = false; // ...and it is the DELETE after a failed checkout
+    bool wantWrite = false;
+    chrono::steady_clock::time_point wake; // when the next request is due (its intended start)
+
+    explicit LoadGenShopper(int user) : id(user) {}
+};
+
+void runLoadGen(const LoadGenConfig &cfg) {
+    using Clock = chrono::steady_clock;
+    static const char *opNames[4] = {"list", "view", "add", "checkout"};
+    ZipfSampler zipf(cfg.products, cfg.zipfExponent);
+    vector<array<vector<double>, 4>> latencies(static_cast<size_t>(cfg.threads)); // microseconds, per thread
+    vector<array<long, 4>> failures(static_cast<size_t>(cfg.threads), array<long, 4>{});
+    vector<long> dropped(static_cast<size_t>(cfg.threads)); // requests that got no response at all
+    vector<string> firstError(static_cast<size_t>(cfg.threads));
+    auto begin = Clock::now();
+    auto deadline = begin + chrono::duration_cast<Clock::duration>(chrono::duration<double>(cfg.seconds));
+    vector<thread> threads;
+    for (int t = 0; t < cfg.threads; ++t) {
+        threads.emplace_back([&, t] {
+            size_t me = static_cast<size_t>(t);
+            mt19937_64 rng(static_cast<uint64_t>(t) * 0x9e3779b97f4a7c15ULL + 1);
+            exponential_distribution<double> think(cfg.thinkMs > 0 ? 1.0 / cfg.thinkMs : 1.0);
+            discrete_distribution<int> pick(cfg.mix.begin(), cfg.mix.end());
+            vector<LoadGenShopper> shoppers;
+            for (int u = t; u < cfg.users; u += cfg.threads) shoppers.emplace_back(u); // connected on first use
+            auto later = [](const LoadGenShopper *a, const LoadGenShopper *b) { return a->wake > b->wake; };
+            priority_queue<LoadGenShopper*, vector<LoadGenShopper*>, decltype(later)> due(later);
+            for (auto &s : shoppers) { s.wake = begin; due.push(&s); }
+            int ep = epoll_create1(EPOLL_CLOEXEC);
+            if (ep < 0) { dropped[me] = 1; firstError[me] = "epoll_create1() failed"; return; }
+            int busy = 0; // shoppers with a request in flight
+
+            auto rest = [&](LoadGenShopper &s, double minMs) {
+                double pause = max(cfg.thinkMs > 0 ? think(rng) : 0.0, minMs);
+                s.wake = Clock::now() + chrono::duration_cast<Clock::duration>(chrono::duration<double, milli>(pause));
+                s.waiting = false;
+                --busy;
+                due.push(&s);
+            };
+            // Counted as a failure; the shopper reconnects on its next request after a short back-off.
+            auto fail = [&](LoadGenShopper &s, const string &why) {
+                if (!s.cleanup) ++failures[me][static_cast<size_t>(s.op)];
+                if (dropped[me]++ == 0) firstError[me] = why;
+                if (s.fd >= 0) close(s.fd);
+                s.fd = -1;
+                s.in.clear();
+                s.out.clear();
+                s.cleanup = s.wantWrite = false;
+                rest(s, 10.0);
+            };
+            auto watch = [&](LoadGenShopper &s, bool writing) {
+                if (writing == s.wantWrite) return;
+                epoll_event ev{};
+                ev.events = EPOLLIN | (writing ? EPOLLOUT : 0u);
+                ev.data.ptr = &s;
+                epoll_ctl(ep, EPOLL_CTL_MOD, s.fd, &ev);
+                s.wantWrite = writing;
+            };
+            auto flush = [&](LoadGenShopper &s) {
+                while (!s.out.empty()) {
+                    ssize_t n = write(s.fd, s.out.data(), s.out.size());
+                    if (n > 0) { s.out.erase(0, static_cast<size_t>(n)); continue; }
+                    if (n < 0 && (errno == EAGAIN || errno == EINTR)) { watch(s, true); return; }
+                    return fail(s, "Server closed the connection");
+                }
+                watch(s, false);
+            };
+            auto issue = [&](LoadGenShopper &s) {
+                s.op = pick(rng);
+                if (s.op == 3 && s.cartLines == 0) s.op = 2;
+                string target;
+                switch (s.op) {
+                    case 0: target = "GET /products"; break;
+                    case 1: target = "GET /products/" + to_string(zipf(rng)); break;
+                    case 2: target = "POST /carts/" + to_string(s.id) + "/items?product=" + to_string(zipf(rng)) + "&qty=1"; break;
+                    default: target = "POST /carts/" + to_string(s.id) + "/checkout?method=instant"; break;
+                }
+                ++busy;
+                s.waiting = true;
+                if (s.fd < 0) {
+                    try {
+                        s.fd = connectTcp("127.0.0.1", cfg.port);
+                    } catch (const ShopException &e) {
+                        return fail(s, e.what());
+                    }
+                    fcntl(s.fd, F_SETFL, fcntl(s.fd, F_GETFL) | O_NONBLOCK);
+                    epoll_event ev{};
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = &s;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, s.fd, &ev);
+                }
+                s.out = target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                flush(s);
+            };
+            auto receive = [&](LoadGenShopper &s) {
+                char chunk[65536];
+                for (;;) {
+                    ssize_t n = read(s.fd, chunk, sizeof chunk);
+                    if (n > 0) { s.in.append(chunk, static_cast<size_t>(n)); continue; }
+                    if (n < 0 && (errno == EAGAIN || errno == EINTR)) break;
+                    if (s.waiting) return fail(s, "Server closed the connection");
+                    close(s.fd); // an idle keep-alive connection the server closed; reconnect on the next request
+                    s.fd = -1;
+                    s.in.clear();
+                    s.wantWrite = false;
+                    return;
+                }
+                int status = 0;
+                size_t end = httpResponseEnd(s.in, &status);
+                if (end == 0) return;
+                s.in.erase(0, end);
+                if (s.cleanup) { s.cleanup = false; return rest(s, 0); }
+                // From the intended start, so time spent queued behind a slow server counts.
+                latencies[me][static_cast<size_t>(s.op)].push_back(chrono::duration<double, micro>(Clock::now() - s.wake).count());
+                if (status != 200) ++failures[me][static_cast<size_t>(s.op)];
+                if (s.op == 2 && status == 200) ++s.cartLines;
+                if (s.op == 3) {
+                    s.cartLines = 0;
+                    if (status != 200) {
+                        s.cleanup = true;
+                        s.out = "DELETE /carts/" + to_string(s.id) + " HTTP/1.1\r\n\r\n";
+                        return flush(s);
+                    }
+                }
+                rest(s, 0);
+            };
+
+            vector<epoll_event> events(256);
+            for (;;) {
+                auto now = Clock::now();
+                while (!due.empty() && due.top()->wake <= now) {
+                    LoadGenShopper *s = due.top();
+                    due.pop();
+                    if (s->wake < deadline) issue(*s);
+                }
+                if (due.empty() && busy == 0) break;
+                if (now > deadline + chrono::seconds(5)) { // the server stopped answering
+                    for (auto &s : shoppers)
+                        if (s.waiting) {
+                            if (!s.cleanup) ++failures[me][static_cast<size_t>(s.op)];
+                            if (dropped[me]++ == 0) firstError[me] = "No response before the run ended";
+                        }
+                    break;
+                }
+                auto wait = due.empty() ? chrono::milliseconds(100) : min<Clock::duration>(due.top()->wake - now, chrono::milliseconds(100));
+                timespec ts{0, static_cast<long>(chrono::duration_cast<chrono::nanoseconds>(wait).count())};
+                int n = epoll_pwait2(ep, events.data(), static_cast<int>(events.size()), &ts, nullptr);
+                for (int i = 0; i < n; ++i) {
+                    LoadGenShopper &s = *static_cast<LoadGenShopper*>(events[static_cast<size_t>(i)].data.ptr);
+                    if (s.fd < 0) continue; // failed earlier in this batch
+                    if (events[static_cast<size_t>(i)].events & EPOLLOUT) flush(s);
+                    if (s.fd >= 0 && events[static_cast<size_t>(i)].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) receive(s);
+                }
+            }
+            for (auto &s : shoppers) if (s.fd >= 0) close(s.fd);
+            close(ep);
+        });
+    }
+    for (auto &th : threads) th.join();
+    double secs = chrono::duration<double>(Clock::now() - begin).count();
+
+    long total = 0;
+    cout << cfg.users << " users, " << cfg.threads << " threads, " << cfg.products << " products (zipf "
+         << cfg.zipfExponent << "), think " << cfg.thinkMs << "ms\n";
+    cout << left << setw(10) << "op" << right << setw(10) << "count" << setw(8) << "errors" << setw(10) << "p50(us)"
+         << setw(10) << "p90" << setw(10) << "p99" << setw(10) << "p999" << setw(10) << "max" << "\n";
+    for (size_t op = 0; op < 4; ++op) {
+        vector<double> all;
+        long errors = 0;
+        for (size_t t = 0; t < latencies.size(); ++t) {
+            all.insert(all.end(), latencies[t][op].begin(), latencies[t][op].end());
+            errors += failures[t][op];
+        }
+        total += static_cast<long>(all.size());
+        sort(all.begin(), all.end());
+        auto pct = [&](double q) { return all.empty() ? 0.0 : all[min(all.size() - 1, static_cast<size_t>(q * all.size()))]; };
+        cout << left << setw(10) << opNames[op] << right << setw(10) << all.size() << setw(8) << errors << fixed << setprecision(1)
+             << setw(10) << pct(0.50) << setw(10) << pct(0.90) << setw(10) << pct(0.99) << setw(10) << pct(0.999)
+             << setw(10) << (all.empty() ? 0.0 : all.back()) << "\n";
+    }
+    cout << total << " requests in " << setprecision(3) << secs << "s: " << setprecision(0) << total / secs << " req/s\n";
+    long lost = accumulate(dropped.begin(), dropped.end(), 0L);
+    if (lost) {
+        auto first = find_if(firstError.begin(), firstError.end(), [](const string &e) { return !e.empty(); });
+        cout << lost << " requests got no response (counted as errors, not timed), first: " << *first << "\n";
+    }
+}
@@ -0,0 +1,1554 @@
+// shop_net.hpp
+// Network front ends for ShopService: the epoll and io_uring event loops, HTTP/1.1
+// and binary RPC protocols, and the loopback benchmark and load-generator clients.
+
+#ifndef SHOP_NET_HPP
+#define SHOP_NET_HPP
+
+#include "shop_core.hpp"
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+
+// -------------------- Event loop (epoll) --------------------
+// A StreamProtocol turns bytes read from one connection into reply bytes.
+// consume() must eat every complete message at the front of `in` (leaving a partial one
+// in place) and append replies to `out`; returning false closes the connection once
+// `out` has been flushed. Pipelined requests simply arrive as several messages in `in`.
+class StreamProtocol {
+public:
+    virtual ~StreamProtocol() = default;
+    virtual bool consume(string &in, string &out) = 0;
+};
+using ProtocolFactory = function<unique_ptr<StreamProtocol>()>;
+
+// Common face of the network back ends (epoll, io_uring); run() serves until stopped.
+class EventServer {
+public:
+    virtual ~EventServer() = default;
+    virtual void run() = 0;
+};
+
+// Set by onStopSignal (install it for SIGINT/SIGTERM); every server loop polls it.
+extern volatile sig_atomic_t stopRequested;
+extern "C" void onStopSignal(int);
+
+int listenTcp(const string &host, int port);
+
+class EpollServer : public EventServer {
+private:
+    struct Connection {
+        int fd;
+        string in, out;
+        size_t outOff = 0;
+        bool closing = false;
+        bool writeArmed = false;
+        unique_ptr<StreamProtocol> protocol;
+    };
+    int listenFd;
+    int epfd;
+    ProtocolFactory factory;
+    unordered_map<int, unique_ptr<Connection>> conns;
+
+    void closeConnection(Connection &c) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        conns.erase(c.fd);
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return; // EAGAIN or transient error: wait for the next readiness event
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            auto c = make_unique<Connection>();
+            c->fd = fd;
+            c->protocol = factory();
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = fd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            conns[fd] = move(c);
+        }
+    }
+
+    // Writes as much pending output as the socket takes; arms EPOLLOUT for the rest.
+    bool flush(Connection &c) {
+        while (c.outOff < c.out.size()) {
+            ssize_t n = write(c.fd, c.out.data() + c.outOff, c.out.size() - c.outOff);
+            if (n > 0) { c.outOff += static_cast<size_t>(n); continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false;
+        }
+        bool pending = c.outOff < c.out.size();
+        if (!pending) { c.out.clear(); c.outOff = 0; }
+        if (pending != c.writeArmed) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP | (pending ? EPOLLOUT : 0u);
+            ev.data.fd = c.fd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+            c.writeArmed = pending;
+        }
+        return true;
+    }
+
+    void onReadable(Connection &c) {
+        char buf[65536];
+        bool eof = false;
+        while (true) {
+            ssize_t n = read(c.fd, buf, sizeof buf);
+            if (n > 0) { c.in.append(buf, static_cast<size_t>(n)); continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || !(errno == EAGAIN || errno == EWOULDBLOCK)) eof = true;
+            break;
+        }
+        if (!c.closing && !c.in.empty() && !c.protocol->consume(c.in, c.out)) c.closing = true;
+        if (!flush(c) || eof || (c.closing && c.out.empty())) closeConnection(c);
+    }
+
+public:
+    EpollServer(int lfd, ProtocolFactory f) : listenFd(lfd), epfd(epoll_create1(EPOLL_CLOEXEC)), factory(move(f)) {
+        if (epfd < 0) throw ShopException("epoll_create1() failed");
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = listenFd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listenFd, &ev);
+    }
+    EpollServer(const EpollServer&) = delete;
+    EpollServer& operator=(const EpollServer&) = delete;
+    ~EpollServer() override {
+        for (auto &kv : conns) close(kv.first);
+        close(epfd);
+        close(listenFd);
+    }
+
+    // Runs until SIGINT/SIGTERM sets stopRequested.
+    void run() override {
+        vector<epoll_event> events(256);
+        while (!stopRequested) {
+            int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), 200);
+            if (n < 0 && errno != EINTR) throw ShopException("epoll_wait() failed");
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) { acceptAll(); continue; }
+                auto it = conns.find(fd);
+                if (it == conns.end()) continue;
+                Connection &c = *it->second;
+                if (events[i].events & EPOLLOUT) {
+                    if (!flush(c) || (c.closing && c.out.empty())) { closeConnection(c); continue; }
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) onReadable(c);
+            }
+        }
+    }
+};
+
+// -------------------- HTTP/1.1 front end --------------------
+string toJson(const Product &p);
+
+string toJson(const pmr::vector<CartItem> &items, double total);
+
+struct HttpRequest {
+    string method;
+    string path;
+    string query;
+    bool keepAlive = true;
+};
+
+struct HttpResponse {
+    int status = 200;
+    string body;
+};
+
+class HttpHandler {
+public:
+    virtual ~HttpHandler() = default;
+    virtual HttpResponse handle(const HttpRequest &req) = 0;
+
+protected:
+    static string queryParam(const string &query, const string &key) {
+        size_t pos = 0;
+        while (pos <= query.size()) {
+            size_t amp = query.find('&', pos);
+            if (amp == string::npos) amp = query.size();
+            size_t eq = query.find('=', pos);
+            if (eq != string::npos && eq < amp && query.compare(pos, eq - pos, key) == 0)
+                return query.substr(eq + 1, amp - eq - 1);
+            pos = amp + 1;
+        }
+        return "";
+    }
+
+    static bool parseInt(const string &s, int &out) {
+        auto r = from_chars(s.data(), s.data() + s.size(), out);
+        return !s.empty() && r.ec == errc() && r.ptr == s.data() + s.size();
+    }
+
+    static HttpResponse error(int status, const string &msg) {
+        return {status, "{\"error\":\"" + jsonEscape(msg) + "\"}"};
+    }
+
+    static vector<string> pathParts(const string &path) {
+        vector<string> parts;
+        for (size_t pos = 1; pos <= path.size();) {
+            size_t slash = path.find('/', pos);
+            if (slash == string::npos) slash = path.size();
+            if (slash > pos) parts.push_back(path.substr(pos, slash - pos));
+            pos = slash + 1;
+        }
+        return parts;
+    }
+};
+
+// Maps the REST routes onto ShopService:
+//   GET /products            GET /products/<id>
+//   GET /carts/<c>           POST /carts/<c>/items?product=<id>&qty=<n>
+//   DELETE /carts/<c>        POST /carts/<c>/checkout?method=card|paypal
+//   GET /stats               latency percentiles and error counts per operation
+//   GET /stats/memory        live bytes, peaks and budgets per subsystem
+//   GET /stats/listing       size and reuse of the pre-rendered GET /products body
+//   GET /trace               recent checkout spans as Chrome trace JSON (needs --trace)
+//   POST /checkpoint         forks a copy-on-write snapshot of the catalog (needs --checkpoint)
+//   GET /stats/replication   log position, followers and lag (primary or follower)
+// A replication follower is read-only: cart and checkpoint routes answer 409.
+class ShopHttpHandler : public HttpHandler {
+private:
+    ShopService &shop;
+    string checkpointFile;
+    atomic<bool> checkpointRunning{false};
+    thread checkpointReaper; // waits for the forked child; joined before the next one and on destruction
+    function<string()> replicationStats;
+    bool readOnly = false;
+    ListingCache listing; // GET /products, as rendered JSON
+    PaymentFactory payments = makePayment;
+
+public:
+    explicit ShopHttpHandler(ShopService &s, string checkpointFile = "")
+        : shop(s), checkpointFile(move(checkpointFile)),
+          listing(s.inventory(), [](const Product &p) { return toJson(p); }, "[", ",", "]") {}
+
+    ShopHttpHandler(const ShopHttpHandler&) = delete;
+    ShopHttpHandler& operator=(const ShopHttpHandler&) = delete;
+    ~ShopHttpHandler() override {
+        if (checkpointReaper.joinable()) checkpointReaper.join();
+    }
+
+    void setPayments(PaymentFactory f) { payments = move(f); }
+
+    void setReplication(function<string()> stats, bool follower) {
+        replicationStats = move(stats);
+        readOnly = follower;
+    }
+
+    HttpResponse handle(const HttpRequest &req) override {
+        RequestArena arena;
+        vector<string> parts = pathParts(req.path);
+        try {
+            if (parts.size() == 1 && parts[0] == "stats" && req.method == "GET") return {200, ShopMetrics::instance().toJson()};
+            if (parts.size() == 2 && parts[0] == "stats" && parts[1] == "memory" && req.method == "GET")
+                return {200, MemoryAccounting::instance().toJson()};
+            if (parts.size() == 2 && parts[0] == "stats" && parts[1] == "listing" && req.method == "GET") return {200, listing.statsJson()};
+            if (parts.size() == 2 && parts[0] == "stats" && parts[1] == "replication" && req.method == "GET")
+                return replicationStats ? HttpResponse{200, replicationStats()} : error(404, "Replication is off");
+            if (readOnly && !parts.empty() && (parts[0] == "carts" || parts[0] == "checkpoint"))
+                return error(409, "Read-only follower: send carts and checkouts to the primary");
+            if (parts.size() == 1 && parts[0] == "trace" && req.method == "GET") {
+                ostringstream os;
+                Tracer::instance().writeJson(os);
+                return {200, os.str()};
+            }
+            if (parts.size() == 1 && parts[0] == "checkpoint" && req.method == "POST") {
+                if (checkpointFile.empty()) return error(404, "Checkpoints are off (start with --checkpoint=<file>)");
+                if (checkpointRunning.exchange(true)) return error(409, "A checkpoint is already running");
+                // The previous reaper cleared checkpointRunning as its last step, so this is quick.
+                if (checkpointReaper.joinable()) checkpointReaper.join();
+                double pauseUs;
+                pid_t pid;
+                try {
+                    pid = shop.inventory().checkpoint(checkpointFile, &pauseUs);
+                } catch (...) {
+                    checkpointRunning = false;
+                    throw;
+                }
+                // The reaper owns the child; the event loop goes straight back to serving.
+                checkpointReaper = thread([this, pid] {
+                    if (!Inventory::waitCheckpoint(pid)) cerr << "Checkpoint to " << checkpointFile << " failed" << endl;
+                    checkpointRunning = false;
+                });
+                char pause[32];
+                snprintf(pause, sizeof pause, "%.1f", pauseUs);
+                return {200, "{\"pid\":" + to_string(pid) + ",\"pause_us\":" + pause + "}"};
+            }
+            if (!parts.empty() && parts[0] == "products" && req.method == "GET") {
+                if (parts.size() == 1) return {200, *listing.get()};
+                int id;
+                if (parts.size() == 2 && parseInt(parts[1], id)) {
+                    Expected<Product> p = shop.inventory().tryGetProduct(id);
+                    if (!p) return error(404, errorMessage(p.error()));
+                    return {200, toJson(*p)};
+                }
+            }
+            int cartId;
+            if (parts.size() >= 2 && parts[0] == "carts" && parseInt(parts[1], cartId)) {
+                if (parts.size() == 2 && req.method == "GET") {
+                    ShoppingCart c = shop.cart(cartId, arena.resource());
+                    return {200, toJson(c.getItems(), c.total())};
+                }
+                if (parts.size() == 2 && req.method == "DELETE") { shop.clearCart(cartId); return {200, "{}"}; }
+                if (parts.size() == 3 && parts[2] == "items" && req.method == "POST") {
+                    int productId, qty;
+                    if (!parseInt(queryParam(req.query, "product"), productId) || !parseInt(queryParam(req.query, "qty"), qty))
+                        return error(400, "product and qty are required");
+                    Expected<void> added = shop.tryAddToCart(cartId, productId, qty);
+                    if (!added) return error(409, errorMessage(added.error()));
+                    ShoppingCart c = shop.cart(cartId, arena.resource());
+                    return {200, toJson(c.getItems(), c.total())};
+                }
+                if (parts.size() == 3 && parts[2] == "checkout" && req.method == "POST") {
+                    unique_ptr<Payment> payment;
+                    try {
+                        payment = payments(queryParam(req.query, "method"));
+                    } catch (const ShopException &e) {
+                        return error(400, e.what());
+                    }
+                    Order o = shop.checkout(cartId, *payment, arena.resource());
+                    char amount[32];
+                    snprintf(amount, sizeof amount, "%.2f", o.getAmount());
+                    return {200, "{\"order\":" + to_string(o.getId()) + ",\"amount\":" + amount + "}"};
+                }
+            }
+        } catch (const ShopException &e) {
+            return error(409, e.what());
+        }
+        return error(404, "No such route");
+    }
+};
+
+// One instance per connection: parses pipelined requests and serializes the replies in order.
+class HttpProtocol : public StreamProtocol {
+private:
+    HttpHandler &handler;
+    static constexpr size_t maxHeaderBytes = 64 * 1024;
+    static constexpr size_t maxBodyBytes = 1 << 20; // no route reads a body; this only bounds what is buffered
+
+    // Digits only; false on anything else, including a sign or an overflow.
+    static bool parseLength(const string &v, size_t &n) {
+        size_t end = v.find_last_not_of(" \t") + 1;
+        if (end == 0 || end > 18) return false;
+        n = 0;
+        for (size_t i = 0; i < end; ++i) {
+            if (v[i] < '0' || v[i] > '9') return false;
+            n = n * 10 + static_cast<size_t>(v[i] - '0');
+        }
+        return true;
+    }
+
+    static const char* reason(int status) {
+        switch (status) {
+            case 200: return "OK";
+            case 400: return "Bad Request";
+            case 404: return "Not Found";
+            case 409: return "Conflict";
+            case 413: return "Content Too Large";
+            case 431: return "Request Header Fields Too Large";
+            case 502: return "Bad Gateway";
+            default: return "Error";
+        }
+    }
+
+    static bool headerIs(const string &line, size_t colon, const char *name) {
+        size_t len = strlen(name);
+        return colon == len && strncasecmp(line.data(), name, len) == 0;
+    }
+
+    static void writeResponse(string &out, const HttpResponse &r, bool keepAlive) {
+        out += "HTTP/1.1 " + to_string(r.status) + " " + reason(r.status);
+        out += "\r\nContent-Type: application/json\r\nContent-Length: " + to_string(r.body.size());
+        out += keepAlive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+        out += r.body;
+    }
+
+public:
+    explicit HttpProtocol(HttpHandler &h) : handler(h) {}
+
+    bool consume(string &in, string &out) override {
+        size_t pos = 0;
+        bool keepOpen = true;
+        while (keepOpen) {
+            size_t headEnd = in.find("\r\n\r\n", pos);
+            if (headEnd == string::npos) {
+                if (in.size() - pos > maxHeaderBytes) { writeResponse(out, {431, ""}, false); keepOpen = false; }
+                break;
+            }
+            HttpRequest req;
+            size_t lineEnd = in.find("\r\n", pos);
+            string requestLine = in.substr(pos, lineEnd - pos);
+            size_t sp1 = requestLine.find(' '), sp2 = requestLine.rfind(' ');
+            if (sp1 == string::npos || sp2 == sp1) { writeResponse(out, {400, ""}, false); keepOpen = false; break; }
+            req.method = requestLine.substr(0, sp1);
+            string target = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+            size_t q = target.find('?');
+            req.path = target.substr(0, q);
+            if (q != string::npos) req.query = target.substr(q + 1);
+            req.keepAlive = requestLine.compare(sp2 + 1, string::npos, "HTTP/1.0") != 0;
+
+            size_t contentLength = 0;
+            int bad = 0; // status to refuse the request with
+            bool sawLength = false;
+            for (size_t h = lineEnd + 2; h < headEnd;) {
+                size_t e = in.find("\r\n", h);
+                string line = in.substr(h, e - h);
+                size_t colon = line.find(':');
+                if (colon != string::npos) {
+                    string value = line.substr(colon + 1);
+                    value.erase(0, value.find_first_not_of(' '));
+                    if (headerIs(line, colon, "Content-Length")) {
+                        size_t n = 0;
+                        if (!parseLength(value, n) || (sawLength && n != contentLength)) bad = 400;
+                        else if (n > maxBodyBytes) bad = 413;
+                        contentLength = n;
+                        sawLength = true;
+                    } else if (headerIs(line, colon, "Connection"))
+                        req.keepAlive = strcasecmp(value.c_str(), "close") != 0
+                                     && (req.keepAlive || strcasecmp(value.c_str(), "keep-alive") == 0);
+                }
+                h = e + 2;
+            }
+            // The body's length cannot be trusted, so the rest of the stream cannot be framed.
+            if (bad) { writeResponse(out, {bad, ""}, false); keepOpen = false; break; }
+            if (in.size() < headEnd + 4 + contentLength) break; // body not fully received yet
+            pos = headEnd + 4 + contentLength;
+            writeResponse(out, handler.handle(req), req.keepAlive);
+            keepOpen = req.keepAlive;
+        }
+        in.erase(0, pos);
+        return keepOpen;
+    }
+};
+
+// -------------------- HTTP load generator --------------------
+int connectTcp(const string &host, int port);
+
+// End offset of the HTTP response starting at pos in buf, or 0 if it has not fully
+// arrived. `status`, when given, receives its status code.
+size_t httpResponseEnd(const string &buf, int *status = nullptr, size_t pos = 0);
+
+// Reads from fd until `count` complete HTTP responses have been received.
+// `lastStatus`, when given, receives the status code of the last one.
+bool readHttpResponses(int fd, string &buf, int count, int *lastStatus = nullptr);
+
+// Drives a running server over loopback: every connection sends `pipeline` requests
+// back to back, then reads the same number of responses, until `total` are done.
+void runHttpBench(const string &host, int port, int connections, long total, int pipeline, const string &path);
+
+// -------------------- Binary RPC over Unix sockets --------------------
+// Frame layout (native little-endian, both directions):
+//   u32 length (bytes after this field) | u32 requestId | u8 opcode/status | payload
+// Requests carry fixed-width integers only and are decoded straight out of the receive
+// buffer. Replies echo the requestId, so a client may keep many requests in flight on
+// one connection and match the answers as they come back.
+// ListProducts replies with u32 count and that many products, in id order; unlike requests,
+// replies are not capped at maxFrameBytes. The escrow ops (see EscrowLedger) carry a u64
+// node id after their integers: TakeStock {id, upTo} replies with the i32 units granted,
+// ReleaseStock {id, qty} makes held units sellable, ReturnStock {id, qty, u8 held} gives
+// units back, RenewEscrow {} answers NotFound once the lease has run out and EndEscrow {}
+// reclaims whatever the node still holds.
+enum class RpcOp : uint8_t { GetProduct = 1, ReduceStock, AddToCart, GetCart, ClearCart, Checkout, Stats, MemoryStats, ListProducts,
+                             TakeStock, ReturnStock, ReleaseStock, RenewEscrow, EndEscrow };
+enum class RpcStatus : uint8_t { Ok = 0, NotFound, Rejected, BadRequest };
+enum class RpcPayment : uint8_t { Card = 1, PayPal };
+
+class WireWriter {
+private:
+    string &out;
+public:
+    explicit WireWriter(string &o) : out(o) {}
+    template<class T> void put(T v) {
+        static_assert(is_trivially_copyable<T>::value, "wire fields must be plain values");
+        out.append(reinterpret_cast<const char*>(&v), sizeof v);
+    }
+    // Strings longer than the u16 length field are cut to 65535 bytes.
+    void putString(const string &s) {
+        uint16_t n = static_cast<uint16_t>(min<size_t>(s.size(), 0xffff));
+        put(n);
+        out.append(s, 0, n);
+    }
+};
+
+class WireReader {
+private:
+    const char *p;
+    const char *end;
+public:
+    WireReader(const char *b, size_t n) : p(b), end(b + n) {}
+    template<class T> bool get(T &v) {
+        if (static_cast<size_t>(end - p) < sizeof v) return false;
+        memcpy(&v, p, sizeof v);
+        p += sizeof v;
+        return true;
+    }
+    bool getString(string_view &s) {
+        uint16_t n;
+        if (!get(n) || end - p < n) return false;
+        s = string_view(p, n);
+        p += n;
+        return true;
+    }
+};
+
+void writeProduct(WireWriter &w, const Product &p);
+
+bool readProduct(WireReader &r, Product &p);
+
+// Owner side of escrowed stock (see StockEscrow): what each node holds, so units cannot be
+// stranded by a node that dies and ReturnStock cannot mint stock it never took. A grant
+// is first held for the node, where the owner can still reclaim it; the node asks for
+// held units to be released before it sells them. Any request from a node renews its
+// lease. When a lease runs out the held units go back into stock and the node is
+// forgotten. Released units stay with the node until it returns them.
+class EscrowLedger {
+private:
+    struct Grant {
+        int held = 0;
+        int released = 0; // less what the node has handed back
+    };
+    struct Lease {
+        chrono::steady_clock::time_point expires;
+        unordered_map<int, Grant> grants;
+    };
+
+    Inventory &inv;
+    chrono::milliseconds lease;
+    mutex m;
+    condition_variable wake;
+    bool stopping = false;
+    unordered_map<uint64_t, Lease> nodes;
+    thread reaper;
+
+    Lease& renew(uint64_t node) {
+        Lease &l = nodes[node];
+        l.expires = chrono::steady_clock::now() + lease;
+        return l;
+    }
+
+    // Puts a node's held units back into stock and forgets the node. Caller holds m.
+    void reclaim(unordered_map<uint64_t, Lease>::iterator it) {
+        for (auto &g : it->second.grants)
+            if (g.second.held > 0 && !inv.restock(g.first, g.second.held))
+                cerr << "Escrow: lost " << g.second.held << " units of product " << g.first << " while reclaiming them" << endl;
+        nodes.erase(it);
+    }
+public:
+    explicit EscrowLedger(Inventory &i, chrono::milliseconds l = chrono::seconds(2)) : inv(i), lease(l) {
+        reaper = thread([this] {
+            unique_lock<mutex> lk(m);
+            while (!stopping) {
+                wake.wait_for(lk, lease / 4);
+                auto now = chrono::steady_clock::now();
+                for (auto it = nodes.begin(); it != nodes.end();) {
+                    auto after = next(it);
+                    if (it->second.expires <= now) {
+                        cerr << "Escrow: lease of node " << hex << it->first << dec << " expired, reclaiming its held stock" << endl;
+                        reclaim(it);
+                    }
+                    it = after;
+                }
+            }
+        });
+    }
+    EscrowLedger(const EscrowLedger&) = delete;
+    EscrowLedger& operator=(const EscrowLedger&) = delete;
+    ~EscrowLedger() {
+        {
+            lock_guard<mutex> lk(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        reaper.join();
+    }
+
+    // Units granted, held for the node.
+    int take(uint64_t node, int id, int upTo) {
+        lock_guard<mutex> lk(m);
+        Lease &l = renew(node);
+        int n = inv.takeStock(id, upTo);
+        if (n > 0) l.grants[id].held += n;
+        return n;
+    }
+
+    // Moves qty held units to the node for sale; false if it holds fewer (the lease lapsed).
+    bool release(uint64_t node, int id, int qty) {
+        lock_guard<mutex> lk(m);
+        Grant &g = renew(node).grants[id];
+        if (qty <= 0 || qty > g.held) return false;
+        g.held -= qty;
+        g.released += qty;
+        return true;
+    }
+
+    // Back into stock, from the node's held or released units.
+    bool giveBack(uint64_t node, int id, int qty, bool held) {
+        lock_guard<mutex> lk(m);
+        Grant &g = renew(node).grants[id];
+        int &from = held ? g.held : g.released;
+        if (qty <= 0 || qty > from || !inv.restock(id, qty)) return false;
+        from -= qty;
+        return true;
+    }
+
+    // False if the node's lease has already run out.
+    bool renewLease(uint64_t node) {
+        lock_guard<mutex> lk(m);
+        if (!nodes.count(node)) return false;
+        renew(node);
+        return true;
+    }
+
+    // A node shutting down: its held units go back into stock at once.
+    void end(uint64_t node) {
+        lock_guard<mutex> lk(m);
+        auto it = nodes.find(node);
+        if (it != nodes.end()) reclaim(it);
+    }
+};
+
+class RpcProtocol : public StreamProtocol {
+private:
+    ShopService &shop;
+    EscrowLedger *escrow;
+    static constexpr uint32_t maxFrameBytes = 1 << 20;
+
+    // Reserves the reply header and patches the length in once the payload is written.
+    static void reply(string &out, uint32_t requestId, RpcStatus status, const function<void(WireWriter&)> &body) {
+        size_t start = out.size();
+        WireWriter w(out);
+        w.put(uint32_t(0));
+        w.put(requestId);
+        w.put(static_cast<uint8_t>(status));
+        if (body) body(w);
+        uint32_t len = static_cast<uint32_t>(out.size() - start - sizeof(uint32_t));
+        memcpy(&out[start], &len, sizeof len);
+    }
+
+    void dispatch(uint32_t id, RpcOp op, WireReader &r, string &out) {
+        int32_t a, b, c;
+        uint8_t method;
+        uint64_t node;
+        try {
+            switch (op) {
+                case RpcOp::GetProduct:
+                    if (!r.get(a)) break;
+                    {
+                        Expected<Product> p = shop.inventory().tryGetProduct(a);
+                        if (!p) return reply(out, id, RpcStatus::NotFound, nullptr);
+                        return reply(out, id, RpcStatus::Ok, [&](WireWriter &w) { writeProduct(w, *p); });
+                    }
+                case RpcOp::ReduceStock:
+                    if (!r.get(a) || !r.get(b)) break;
+                    return reply(out, id, shop.inventory().reduceStock(a, b) ? RpcStatus::Ok : RpcStatus::Rejected, nullptr);
+                case RpcOp::AddToCart:
+                    if (!r.get(a) || !r.get(b) || !r.get(c)) break;
+                    {
+                        Expected<void> added = shop.tryAddToCart(a, b, c);
+                        if (!added) return reply(out, id, RpcStatus::Rejected, [&](WireWriter &w) { w.putString(errorMessage(added.error())); });
+                        return reply(out, id, RpcStatus::Ok, nullptr);
+                    }
+                case RpcOp::GetCart:
+                    if (!r.get(a)) break;
+                    return reply(out, id, RpcStatus::Ok, [&](WireWriter &w) {
+                        RequestArena arena;
+                        ShoppingCart cart = shop.cart(a, arena.resource());
+                        const pmr::vector<CartItem> &items = cart.getItems();
+                        w.put(static_cast<uint32_t>(items.size()));
+                        for (auto &ci : items) { w.put(static_cast<int32_t>(ci.product.getId())); w.put(static_cast<int32_t>(ci.quantity)); }
+                        w.put(cart.total());
+                    });
+                case RpcOp::ClearCart:
+                    if (!r.get(a)) break;
+                    shop.clearCart(a);
+                    return reply(out, id, RpcStatus::Ok, nullptr);
+                case RpcOp::Checkout: {
+                    if (!r.get(a) || !r.get(method)) break;
+                    unique_ptr<Payment> payment = makePayment(method == static_cast<uint8_t>(RpcPayment::PayPal) ? "paypal" : "card");
+                    RequestArena arena;
+                    Order o = shop.checkout(a, *payment, arena.resource());
+                    return reply(out, id, RpcStatus::Ok, [&](WireWriter &w) { w.put(static_cast<int32_t>(o.getId())); w.put(o.getAmount()); });
+                }
+                case RpcOp::Stats:
+                    return reply(out, id, RpcStatus::Ok, [&](WireWriter &w) { w.putString(ShopMetrics::instance().toJson()); });
+                case RpcOp::MemoryStats:
+                    return reply(out, id, RpcStatus::Ok, [&](WireWriter &w) { w.putString(MemoryAccounting::instance().toJson()); });
+                case RpcOp::ListProducts:
+                    return reply(out, id, RpcStatus::Ok, [&](WireWriter &w) {
+                        RequestArena arena;
+                        pmr::vector<Product> all = shop.inventory().listAll(arena.resource());
+                        w.put(static_cast<uint32_t>(all.size()));
+                        for (auto &p : all) writeProduct(w, p);
+                    });
+                case RpcOp::TakeStock:
+                    if (!escrow || !r.get(a) || !r.get(b) || !r.get(node)) break;
+                    return reply(out, id, RpcStatus::Ok, [&](WireWriter &w) { w.put(static_cast<int32_t>(escrow->take(node, a, b))); });
+                case RpcOp::ReleaseStock:
+                    if (!escrow || !r.get(a) || !r.get(b) || !r.get(node)) break;
+                    return reply(out, id, escrow->release(node, a, b) ? RpcStatus::Ok : RpcStatus::Rejected, nullptr);
+                case RpcOp::ReturnStock:
+                    if (!escrow || !r.get(a) || !r.get(b) || !r.get(node) || !r.get(method)) break;
+                    return reply(out, id, escrow->giveBack(node, a, b, method != 0) ? RpcStatus::Ok : RpcStatus::Rejected, nullptr);
+                case RpcOp::RenewEscrow:
+                    if (!escrow || !r.get(node)) break;
+                    return reply(out, id, escrow->renewLease(node) ? RpcStatus::Ok : RpcStatus::NotFound, nullptr);
+                case RpcOp::EndEscrow:
+                    if (!escrow || !r.get(node)) break;
+                    escrow->end(node);
+                    return reply(out, id, RpcStatus::Ok, nullptr);
+            }
+        } catch (const ShopException &e) {
+            string msg = e.what();
+            return reply(out, id, RpcStatus::Rejected, [&](WireWriter &w) { w.putString(msg); });
+        }
+        reply(out, id, RpcStatus::BadRequest, nullptr);
+    }
+
+public:
+    // Escrow requests are refused unless a ledger is given.
+    explicit RpcProtocol(ShopService &s, EscrowLedger *e = nullptr) : shop(s), escrow(e) {}
+
+    bool consume(string &in, string &out) override {
+        size_t pos = 0;
+        while (in.size() - pos >= sizeof(uint32_t)) {
+            uint32_t len;
+            memcpy(&len, in.data() + pos, sizeof len);
+            if (len < 5 || len > maxFrameBytes) return false;
+            if (in.size() - pos - sizeof len < len) break;
+            WireReader r(in.data() + pos + sizeof len, len);
+            uint32_t id = 0;
+            uint8_t op = 0;
+            r.get(id);
+            r.get(op);
+            dispatch(id, static_cast<RpcOp>(op), r, out);
+            pos += sizeof len + len;
+        }
+        in.erase(0, pos);
+        return true;
+    }
+};
+
+int listenUnix(const string &path);
+
+int connectUnix(const string &path);
+
+// Blocking client. send() queues a request and returns its id; receive() hands back
+// the next reply off the wire, whatever request it belongs to.
+// Not thread-safe. Any I/O error closes the connection and throws; the next request
+// reconnects. Replies to requests abandoned by an earlier error are told apart by their
+// request id and dropped.
+class RpcClient {
+private:
+    string path;
+    int fd;
+    uint32_t nextId = 0; // keeps counting across reconnects, so stale ids never match
+    string in, out;
+
+    [[noreturn]] void fail(const string &why) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        in.clear();
+        out.clear();
+        throw ShopException(why + " (" + path + ")");
+    }
+public:
+    struct Reply {
+        uint32_t requestId;
+        RpcStatus status;
+        string payload;
+    };
+
+    explicit RpcClient(const string &p) : path(p), fd(connectUnix(p)) {}
+    RpcClient(const RpcClient&) = delete;
+    RpcClient& operator=(const RpcClient&) = delete;
+    ~RpcClient() { if (fd >= 0) close(fd); }
+
+    template<class... Args> uint32_t send(RpcOp op, Args... args) {
+        if (fd < 0) fd = connectUnix(path);
+        uint32_t id = ++nextId;
+        WireWriter w(out);
+        w.put(static_cast<uint32_t>(sizeof id + 1 + (0 + ... + sizeof(Args))));
+        w.put(id);
+        w.put(static_cast<uint8_t>(op));
+        (w.put(args), ...);
+        return id;
+    }
+
+    void flush() {
+        for (size_t off = 0; off < out.size();) {
+            ssize_t n = fd < 0 ? -1 : write(fd, out.data() + off, out.size() - off);
+            if (n <= 0) fail("RPC write failed");
+            off += static_cast<size_t>(n);
+        }
+        out.clear();
+    }
+
+    Reply receive() {
+        flush();
+        while (true) {
+            uint32_t len;
+            if (in.size() >= sizeof len) {
+                memcpy(&len, in.data(), sizeof len);
+                if (len <= sizeof(uint32_t)) fail("Malformed RPC reply");
+                if (in.size() >= sizeof len + len) {
+                    Reply r;
+                    memcpy(&r.requestId, in.data() + sizeof len, sizeof r.requestId);
+                    r.status = static_cast<RpcStatus>(in[sizeof len + sizeof r.requestId]);
+                    r.payload = in.substr(sizeof len + sizeof r.requestId + 1, len - sizeof r.requestId - 1);
+                    in.erase(0, sizeof len + len);
+                    return r;
+                }
+            }
+            char chunk[65536];
+            ssize_t n = fd < 0 ? -1 : read(fd, chunk, sizeof chunk);
+            if (n <= 0) fail("RPC server closed the connection");
+            in.append(chunk, static_cast<size_t>(n));
+        }
+    }
+
+    // The reply to request id, dropping any earlier replies still queued.
+    Reply receive(uint32_t id) {
+        for (;;) {
+            Reply r = receive();
+            if (r.requestId == id) return r;
+        }
+    }
+
+    template<class... Args> Reply call(RpcOp op, Args... args) { return receive(send(op, args...)); }
+};
+
+// Keeps `inflight` GetProduct requests outstanding on one connection and checks that
+// every reply id matches a request that is still pending.
+void runRpcBench(const string &path, long total, int inflight, int catalogSize);
+
+// -------------------- Partitioned catalog --------------------
+// The catalog split across worker processes (serve-rpc --partition=i/n), each holding only
+// the products whose id hashes to it. Ids go through a 64-bit mix and then a jump
+// consistent hash, so sequential or strided ids spread evenly and growing from n to n+1
+// partitions moves only ~1/(n+1) of the products.
+inline int partitionOf(int id, int partitions) {
+    uint64_t key = static_cast<uint32_t>(id) * 0x9e3779b97f4a7c15ULL;
+    key ^= key >> 29;
+    int64_t b = -1, j = 0;
+    while (j < partitions) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = static_cast<int64_t>(static_cast<double>(b + 1) * (static_cast<double>(1LL << 31) / static_cast<double>((key >> 33) + 1)));
+    }
+    return static_cast<int>(b);
+}
+
+// One RPC connection per worker. Point reads and stock updates go to the owning worker;
+// listings and batched lookups are scattered to all workers before any reply is awaited,
+// so the workers answer in parallel. Not thread-safe: one router per event loop or thread.
+class PartitionRouter {
+private:
+    vector<unique_ptr<RpcClient>> workers;
+
+    RpcClient& owner(int id) { return *workers[static_cast<size_t>(partitionOf(id, partitions()))]; }
+public:
+    explicit PartitionRouter(const vector<string> &sockets) {
+        for (auto &s : sockets) workers.push_back(make_unique<RpcClient>(s));
+        if (workers.empty()) throw ShopException("A partitioned catalog needs at least one worker");
+    }
+
+    int partitions() const { return static_cast<int>(workers.size()); }
+
+    Expected<Product> getProduct(int id) {
+        RpcClient::Reply r = owner(id).call(RpcOp::GetProduct, static_cast<int32_t>(id));
+        Product p;
+        WireReader rd(r.payload.data(), r.payload.size());
+        if (r.status != RpcStatus::Ok || !readProduct(rd, p)) return ShopError::NotFound;
+        return p;
+    }
+
+    bool reduceStock(int id, int qty) {
+        return owner(id).call(RpcOp::ReduceStock, static_cast<int32_t>(id), static_cast<int32_t>(qty)).status == RpcStatus::Ok;
+    }
+
+    // Escrow transfers with the owning worker on behalf of node; takeStock returns the
+    // units granted.
+    int takeStock(int id, int upTo, uint64_t node) {
+        RpcClient::Reply r = owner(id).call(RpcOp::TakeStock, static_cast<int32_t>(id), static_cast<int32_t>(upTo), node);
+        WireReader rd(r.payload.data(), r.payload.size());
+        int32_t granted = 0;
+        return r.status == RpcStatus::Ok && rd.get(granted) ? granted : 0;
+    }
+    bool releaseStock(int id, int qty, uint64_t node) {
+        return owner(id).call(RpcOp::ReleaseStock, static_cast<int32_t>(id), static_cast<int32_t>(qty), node).status == RpcStatus::Ok;
+    }
+    bool returnStock(int id, int qty, uint64_t node, bool held) {
+        return owner(id).call(RpcOp::ReturnStock, static_cast<int32_t>(id), static_cast<int32_t>(qty), node,
+                              static_cast<uint8_t>(held)).status == RpcStatus::Ok;
+    }
+
+    // Renews node's lease on every worker; false for the workers where it had run out.
+    vector<bool> renewEscrow(uint64_t node) {
+        vector<uint32_t> ids;
+        for (auto &w : workers) { ids.push_back(w->send(RpcOp::RenewEscrow, node)); w->flush(); }
+        vector<bool> alive;
+        for (size_t w = 0; w < workers.size(); ++w) alive.push_back(workers[w]->receive(ids[w]).status == RpcStatus::Ok);
+        return alive;
+    }
+    void endEscrow(uint64_t node) {
+        for (auto &w : workers) w->call(RpcOp::EndEscrow, node);
+    }
+
+    // Results in the order of ids: one pipelined round trip per worker.
+    vector<Expected<Product>> getProducts(const vector<int> &ids) {
+        vector<Expected<Product>> out(ids.size(), Expected<Product>(ShopError::NotFound));
+        vector<unordered_map<uint32_t, size_t>> pending(workers.size()); // request id -> slot
+        for (size_t i = 0; i < ids.size(); ++i) {
+            size_t w = static_cast<size_t>(partitionOf(ids[i], partitions()));
+            pending[w][workers[w]->send(RpcOp::GetProduct, static_cast<int32_t>(ids[i]))] = i;
+        }
+        for (auto &w : workers) w->flush();
+        for (size_t w = 0; w < workers.size(); ++w) {
+            while (!pending[w].empty()) {
+                RpcClient::Reply r = workers[w]->receive();
+                auto it = pending[w].find(r.requestId);
+                if (it == pending[w].end()) continue; // left over from an abandoned request
+                Product p;
+                WireReader rd(r.payload.data(), r.payload.size());
+                if (r.status == RpcStatus::Ok && readProduct(rd, p)) out[it->second] = p;
+                pending[w].erase(it);
+            }
+        }
+        return out;
+    }
+
+    // Every product on every worker, merged into id order.
+    vector<Product> listAll() {
+        vector<uint32_t> ids;
+        for (auto &w : workers) { ids.push_back(w->send(RpcOp::ListProducts)); w->flush(); }
+        vector<vector<Product>> parts(workers.size());
+        for (size_t w = 0; w < workers.size(); ++w) {
+            RpcClient::Reply r = workers[w]->receive(ids[w]);
+            WireReader rd(r.payload.data(), r.payload.size());
+            uint32_t n = 0;
+            if (r.status != RpcStatus::Ok || !rd.get(n)) throw ShopException("Partition " + to_string(w) + " failed to list its products");
+            parts[w].resize(n);
+            for (auto &p : parts[w])
+                if (!readProduct(rd, p)) throw ShopException("Partition " + to_string(w) + " sent a malformed listing");
+        }
+        vector<Product> all;
+        for (auto &part : parts) {
+            size_t mid = all.size();
+            all.insert(all.end(), make_move_iterator(part.begin()), make_move_iterator(part.end()));
+            inplace_merge(all.begin(), all.begin() + static_cast<ptrdiff_t>(mid), all.end(),
+                          [](const Product &a, const Product &b) { return a.getId() < b.getId(); });
+        }
+        return all;
+    }
+};
+
+// -------------------- Escrowed stock --------------------
+// Lets a node (a router process) sell a hot product without a round trip to its owner per
+// unit. The owner grants units to the node (TakeStock) and holds them for it; the node
+// has them released (ReleaseStock) into its quota and sells from there with a
+// compare-and-swap, only going to the owner when the quota is short. A background thread
+// sizes each quota to about two intervals of recent demand, keeps about as much again
+// held in reserve, tops the quota up when it falls below half, and hands surplus back
+// (ReturnStock) as demand cools, so units drift to the nodes selling them. It also renews
+// the node's lease with every owner; if the node dies, the owner reclaims the reserve
+// once the lease runs out (EscrowLedger). Every unit is at the owner, held for one node
+// or in one node's quota, and a node sells only its quota, so nothing is oversold. The
+// price: the owner may report a product sold out while another node still has some,
+// until that surplus drains back, and a node that dies strands what was in its quota.
+struct EscrowOptions {
+    chrono::milliseconds interval{10};
+    int hotThreshold = 32;    // owner round trips in one interval that make a product escrowed
+    int minQuota = 16, maxQuota = 100000;
+    int idleIntervals = 50;   // intervals without demand before a quota is returned in full
+};
+
+class StockEscrow {
+private:
+    struct Quota {
+        atomic<int> units{0};   // released to this node, for sale
+        atomic<int> demand{0};  // units asked for this interval
+        atomic<int> target{0};
+        atomic<int> reserve{0}; // held for this node at the owner; written by the rebalancer only
+        int idle = 0;           // rebalancer only
+    };
+
+    EscrowOptions opts;
+    uint64_t node;            // this node's id at the owners, fresh per process
+    PartitionRouter control;  // the rebalancer's own connections
+    mutex ownerMutex;
+    PartitionRouter owner;    // fallback reductions from request threads
+    unordered_map<int, int> misses; // owner round trips this interval (ownerMutex)
+    mutable shared_mutex quotasMutex;
+    unordered_map<int, unique_ptr<Quota>> quotas; // never erased while running
+    mutex wakeMutex;
+    condition_variable wake;
+    bool stopping = false;
+    atomic<uint64_t> localSales{0}, ownerSales{0}, granted{0}, returned{0};
+    thread rebalancer;
+
+    Quota* find(int id) const {
+        shared_lock<shared_mutex> lk(quotasMutex);
+        auto it = quotas.find(id);
+        return it == quotas.end() ? nullptr : it->second.get();
+    }
+
+    // Takes up to n units back out of the quota and returns them to the owner. Not retried
+    // on failure: if the owner did apply it, a second return could restock units sold since.
+    void giveBack(int id, Quota &q, int n) {
+        int have = q.units.load();
+        int take = 0;
+        do { take = min(n, have); } while (take > 0 && !q.units.compare_exchange_weak(have, have - take));
+        if (take <= 0) return;
+        if (control.returnStock(id, take, node, false)) returned += static_cast<uint64_t>(take);
+        else cerr << "Escrow: could not return " << take << " units of product " << id << endl; // lost to sale, never oversold
+    }
+
+    // The owner checks these against what it holds for this node, so a rejection means
+    // the lease lapsed and the reserve has already been reclaimed.
+    void returnReserve(int id, Quota &q, int n) {
+        if (n <= 0) return;
+        if (control.returnStock(id, n, node, true)) {
+            q.reserve -= n;
+            returned += static_cast<uint64_t>(n);
+        } else {
+            q.reserve = 0;
+        }
+    }
+
+    void refill(int id, Quota &q, int need, int target) {
+        if (q.reserve < need) {
+            int got = control.takeStock(id, need + target - q.reserve, node);
+            q.reserve += got;
+            granted += static_cast<uint64_t>(got);
+        }
+        int move = min(need, q.reserve.load());
+        if (move <= 0) return;
+        if (control.releaseStock(id, move, node)) {
+            q.reserve -= move;
+            q.units += move;
+        } else {
+            q.reserve = 0;
+        }
+    }
+
+    void rebalance() {
+        unordered_map<int, int> hot;
+        {
+            lock_guard<mutex> lk(ownerMutex);
+            hot.swap(misses);
+        }
+        for (auto &h : hot) {
+            if (h.second < opts.hotThreshold || find(h.first)) continue;
+            auto q = make_unique<Quota>();
+            q->target = clamp(2 * h.second, opts.minQuota, opts.maxQuota);
+            unique_lock<shared_mutex> lk(quotasMutex);
+            quotas.emplace(h.first, move(q));
+        }
+        vector<pair<int, Quota*>> all;
+        {
+            shared_lock<shared_mutex> lk(quotasMutex);
+            for (auto &q : quotas) all.emplace_back(q.first, q.second.get());
+        }
+        for (auto &e : all) {
+            Quota &q = *e.second;
+            int demand = q.demand.exchange(0);
+            q.idle = demand ? 0 : q.idle + 1;
+            if (q.idle >= opts.idleIntervals) {
+                q.target = 0;
+                giveBack(e.first, q, q.units.load());
+                returnReserve(e.first, q, q.reserve);
+                continue;
+            }
+            int target = demand ? clamp(max(2 * demand, q.target.load() / 2), opts.minQuota, opts.maxQuota) : q.target.load();
+            q.target = target;
+            int units = q.units.load();
+            if (units < target / 2 + 1) refill(e.first, q, target - units, target);
+            else if (units > 2 * target) giveBack(e.first, q, units - target);
+            if (q.reserve > 2 * target) returnReserve(e.first, q, q.reserve - target);
+        }
+        bool holding = false;
+        for (auto &e : all) holding = holding || e.second->units > 0 || e.second->reserve > 0;
+        if (!holding) return;
+        vector<bool> alive = control.renewEscrow(node);
+        for (auto &e : all)
+            if (!alive[static_cast<size_t>(partitionOf(e.first, control.partitions()))]) e.second->reserve = 0;
+    }
+
+public:
+    StockEscrow(const vector<string> &sockets, EscrowOptions o = {})
+        : opts(o), node((static_cast<uint64_t>(random_device{}()) << 32) ^ random_device{}()), control(sockets), owner(sockets) {
+        rebalancer = thread([this] {
+            unique_lock<mutex> lk(wakeMutex);
+            while (!stopping) {
+                wake.wait_for(lk, opts.interval);
+                if (stopping) break;
+                lk.unlock();
+                try {
+                    rebalance();
+                } catch (const ShopException &e) {
+                    cerr << "Escrow rebalance failed: " << e.what() << endl;
+                }
+                lk.lock();
+            }
+        });
+    }
+    StockEscrow(const StockEscrow&) = delete;
+    StockEscrow& operator=(const StockEscrow&) = delete;
+
+    // Hands every escrowed unit back to its owner and ends the leases.
+    ~StockEscrow() {
+        {
+            lock_guard<mutex> lk(wakeMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        rebalancer.join();
+        try {
+            for (auto &q : quotas) giveBack(q.first, *q.second, q.second->units.load());
+            control.endEscrow(node);
+        } catch (const ShopException &e) {
+            cerr << "Escrow: owner unreachable at shutdown: " << e.what() << endl;
+        }
+    }
+
+    bool reduceStock(int id, int qty) {
+        if (qty <= 0) return false;
+        Quota *q = find(id);
+        if (q) {
+            q->demand += qty;
+            int have = q->units.load();
+            while (have >= qty) {
+                if (!q->units.compare_exchange_weak(have, have - qty)) continue;
+                ++localSales;
+                int low = q->target / 2;
+                if (have >= low && have - qty < low) wake.notify_one(); // refill early, not at the next tick
+                return true;
+            }
+        }
+        lock_guard<mutex> lk(ownerMutex);
+        bool ok = owner.reduceStock(id, qty);
+        if (!q) ++misses[id];
+        if (ok) ++ownerSales;
+        return ok;
+    }
+
+    int localUnits(int id) const { Quota *q = find(id); return q ? q->units.load() : 0; }
+
+    string statsJson() const {
+        string out = "{\"local_sales\":" + to_string(localSales.load()) + ",\"owner_sales\":" + to_string(ownerSales.load()) +
+                     ",\"granted\":" + to_string(granted.load()) + ",\"returned\":" + to_string(returned.load()) + ",\"quotas\":[";
+        shared_lock<shared_mutex> lk(quotasMutex);
+        bool first = true;
+        for (auto &q : quotas) {
+            out += (first ? "{\"id\":" : ",{\"id\":") + to_string(q.first) + ",\"units\":" + to_string(q.second->units.load()) +
+                   ",\"held\":" + to_string(q.second->reserve.load()) + ",\"target\":" + to_string(q.second->target.load()) + "}";
+            first = false;
+        }
+        return out + "]}";
+    }
+};
+
+// HTTP front end of a partitioned catalog (serve-router):
+//   GET /products            GET /products/<id>
+//   POST /products/<id>/reduce?qty=<n>
+//   GET /partitions          which worker owns which share of the catalog
+//   GET /escrow              local quotas and sales (with --escrow)
+// With an escrow, reduce sells from this node's quota when it can; stock shown by
+// GET /products excludes units held in escrow by any node.
+class RouterHttpHandler : public HttpHandler {
+private:
+    PartitionRouter &router;
+    vector<string> sockets;
+    StockEscrow *escrow = nullptr;
+public:
+    RouterHttpHandler(PartitionRouter &r, vector<string> s) : router(r), sockets(move(s)) {}
+
+    void setEscrow(StockEscrow *e) { escrow = e; }
+
+    HttpResponse handle(const HttpRequest &req) override {
+        vector<string> parts = pathParts(req.path);
+        int id;
+        try {
+            if (parts.size() == 1 && parts[0] == "products" && req.method == "GET") {
+                string body = "[";
+                for (auto &p : router.listAll()) { if (body.size() > 1) body += ','; body += toJson(p); }
+                return {200, body + "]"};
+            }
+            if (parts.size() >= 2 && parts[0] == "products" && parseInt(parts[1], id)) {
+                if (parts.size() == 2 && req.method == "GET") {
+                    Expected<Product> p = router.getProduct(id);
+                    if (!p) return error(404, errorMessage(p.error()));
+                    return {200, toJson(*p)};
+                }
+                int qty;
+                if (parts.size() == 3 && parts[2] == "reduce" && req.method == "POST") {
+                    if (!parseInt(queryParam(req.query, "qty"), qty)) return error(400, "qty is required");
+                    if (!(escrow ? escrow->reduceStock(id, qty) : router.reduceStock(id, qty))) return error(409, "Unknown product or not enough stock");
+                    return {200, "{\"partition\":" + to_string(partitionOf(id, router.partitions())) + "}"};
+                }
+            }
+            if (parts.size() == 1 && parts[0] == "escrow" && req.method == "GET")
+                return escrow ? HttpResponse{200, escrow->statsJson()} : error(404, "Escrow is off (start with --escrow)");
+            if (parts.size() == 1 && parts[0] == "partitions" && req.method == "GET") {
+                vector<size_t> owned(static_cast<size_t>(router.partitions()));
+                for (auto &p : router.listAll()) ++owned[static_cast<size_t>(partitionOf(p.getId(), router.partitions()))];
+                string body = "[";
+                for (size_t i = 0; i < owned.size(); ++i)
+                    body += (i ? ",{\"socket\":\"" : "{\"socket\":\"") + jsonEscape(sockets[i]) + "\",\"products\":" + to_string(owned[i]) + "}";
+                return {200, body + "]"};
+            }
+        } catch (const ShopException &e) {
+            return error(502, e.what());
+        }
+        return error(404, "No such route");
+    }
+};
+
+// Forks one serve-rpc worker per partition, then checks through a PartitionRouter that every
+// product lives on its owner, listings come back complete and in order, and stock updates
+// reach the right worker; times point, batched and scatter-gather reads.
+void runPartitionBench(int partitions, int products, long lookups);
+
+// One owner worker and `nodes` forked node processes with `threads` sellers each: times a
+// hot product sold through the owner against sold from escrow, then sells out a product of
+// `stock` units from every node at once and checks that exactly `stock` were sold.
+void runEscrowBench(int nodes, int threads, int stock, double seconds);
+
+// -------------------- io_uring back end --------------------
+// Minimal raw-syscall io_uring wrapper (no liburing dependency). Callers fill SQEs with
+// next(); submitAndWait() hands the whole batch to the kernel in one io_uring_enter()
+// and completions are drained straight from the shared CQ ring.
+class IoUring {
+private:
+    int ringFd = -1;
+    unsigned entries = 0;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    void *sqeMem = MAP_FAILED;
+    size_t sqRingBytes = 0, cqRingBytes = 0, sqeBytes = 0;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned localTail = 0;
+
+    void release() {
+        if (sqeMem != MAP_FAILED) munmap(sqeMem, sqeBytes);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingBytes);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingBytes);
+        if (ringFd >= 0) close(ringFd);
+    }
+
+public:
+    explicit IoUring(unsigned depth) {
+        io_uring_params p{};
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &p));
+        if (ringFd < 0) throw ShopException(string("io_uring unavailable: ") + strerror(errno));
+        entries = p.sq_entries;
+        sqRingBytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingBytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sqeBytes = p.sq_entries * sizeof(io_uring_sqe);
+        bool singleMmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) sqRingBytes = cqRingBytes = max(sqRingBytes, cqRingBytes);
+        sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = singleMmap ? sqRing
+               : mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqeMem = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMem == MAP_FAILED) {
+            release();
+            throw ShopException("io_uring ring mmap failed");
+        }
+        char *sq = static_cast<char*>(sqRing), *cq = static_cast<char*>(cqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        sqes = static_cast<io_uring_sqe*>(sqeMem);
+        localTail = *sqTail;
+    }
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    ~IoUring() { release(); }
+
+    // Registers buffers for the *_FIXED opcodes; false when the kernel refuses (e.g. memlock limit).
+    bool registerBuffers(const vector<iovec> &iov) {
+        return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) == 0;
+    }
+
+    io_uring_sqe* next() {
+        if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries) submitAndWait(0);
+        unsigned idx = localTail & *sqMask;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+        sqArray[idx] = idx;
+        ++localTail;
+        return sqe;
+    }
+
+    void submitAndWait(unsigned waitFor) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        unsigned pending = localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ringFd, pending, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0
+            && errno != EINTR && errno != EBUSY)
+            throw ShopException(string("io_uring_enter: ") + strerror(errno));
+    }
+
+    template<class F> unsigned drain(F onCompletion) {
+        unsigned head = *cqHead, tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE), n = 0;
+        for (; head != tail; ++head, ++n) {
+            io_uring_cqe cqe = cqes[head & *cqMask];
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            onCompletion(cqe);
+        }
+        return n;
+    }
+};
+
+void prepRw(io_uring_sqe *sqe, uint8_t op, int fd, const void *buf, size_t len, uint64_t userData, int bufIndex = -1);
+
+// Same contract as EpollServer, but accepts, reads and writes are all io_uring requests.
+// Every connection owns a slot with a registered read buffer and write buffer.
+class UringServer : public EventServer {
+private:
+    enum : uint64_t { OpAccept = 1, OpRead, OpWrite, OpTick };
+    static constexpr unsigned maxConnections = 256;
+    static constexpr size_t bufferBytes = 8 * 1024;
+
+    struct Slot {
+        int fd = -1;
+        string in, out;
+        size_t outOff = 0;
+        bool closing = false;
+        bool writing = false;
+        int inflight = 0;
+        unique_ptr<StreamProtocol> protocol;
+    };
+
+    int listenFd;
+    ProtocolFactory factory;
+    vector<char> arena; // registered with the ring, so declared first and freed only after the ring closes
+    IoUring ring;
+    bool fixedBuffers;
+    vector<Slot> slots;
+    vector<unsigned> freeSlots;
+    __kernel_timespec tick{0, 200 * 1000 * 1000};
+
+    static uint64_t tag(unsigned slot, uint64_t op) { return (static_cast<uint64_t>(slot) << 8) | op; }
+    char* readBuffer(unsigned s) { return arena.data() + 2 * s * bufferBytes; }
+    char* writeBuffer(unsigned s) { return arena.data() + (2 * s + 1) * bufferBytes; }
+
+    void armAccept() { prepRw(ring.next(), IORING_OP_ACCEPT, listenFd, nullptr, 0, tag(0, OpAccept)); }
+
+    void armTick() {
+        io_uring_sqe *sqe = ring.next();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&tick);
+        sqe->len = 1;
+        sqe->user_data = tag(0, OpTick);
+    }
+
+    void submitRead(unsigned s) {
+        prepRw(ring.next(), IORING_OP_READ, slots[s].fd, readBuffer(s), bufferBytes, tag(s, OpRead),
+               fixedBuffers ? static_cast<int>(2 * s) : -1);
+        ++slots[s].inflight;
+    }
+
+    void submitWrite(unsigned s) {
+        Slot &c = slots[s];
+        size_t n = min(c.out.size() - c.outOff, bufferBytes);
+        memcpy(writeBuffer(s), c.out.data() + c.outOff, n);
+        prepRw(ring.next(), IORING_OP_WRITE, c.fd, writeBuffer(s), n, tag(s, OpWrite),
+               fixedBuffers ? static_cast<int>(2 * s + 1) : -1);
+        c.writing = true;
+        ++c.inflight;
+    }
+
+    // Closes the slot once nothing is in flight; a pending read is kicked out with shutdown().
+    void finish(unsigned s) {
+        Slot &c = slots[s];
+        if (c.writing) return;
+        if (c.inflight > 0) { shutdown(c.fd, SHUT_RDWR); return; }
+        close(c.fd);
+        c = Slot();
+        freeSlots.push_back(s);
+    }
+
+    void onAccept(int res) {
+        if (res >= 0) {
+            if (freeSlots.empty()) close(res);
+            else {
+                unsigned s = freeSlots.back();
+                freeSlots.pop_back();
+                int one = 1;
+                setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                slots[s].fd = res;
+                slots[s].protocol = factory();
+                submitRead(s);
+            }
+        }
+        if (!stopRequested) armAccept();
+    }
+
+    void onRead(unsigned s, int res) {
+        Slot &c = slots[s];
+        --c.inflight;
+        if (res <= 0 || c.closing) { c.closing = true; return finish(s); }
+        c.in.append(readBuffer(s), static_cast<size_t>(res));
+        if (!c.protocol->consume(c.in, c.out)) c.closing = true;
+        if (!c.writing && c.outOff < c.out.size()) submitWrite(s);
+        if (!c.closing) submitRead(s);
+        else finish(s);
+    }
+
+    void onWrite(unsigned s, int res) {
+        Slot &c = slots[s];
+        --c.inflight;
+        c.writing = false;
+        // A zero-byte write makes no progress; resubmitting it would spin forever.
+        if (res <= 0) { c.closing = true; c.out.clear(); c.outOff = 0; }
+        else c.outOff += static_cast<size_t>(res);
+        if (c.outOff < c.out.size()) return submitWrite(s);
+        c.out.clear();
+        c.outOff = 0;
+        if (c.closing) finish(s);
+    }
+
+public:
+    UringServer(int lfd, ProtocolFactory f)
+        : listenFd(lfd), factory(move(f)), arena(2 * maxConnections * bufferBytes), ring(1024), slots(maxConnections) {
+        vector<iovec> iov(2 * maxConnections);
+        for (size_t i = 0; i < iov.size(); ++i) iov[i] = {arena.data() + i * bufferBytes, bufferBytes};
+        fixedBuffers = ring.registerBuffers(iov);
+        for (unsigned s = maxConnections; s-- > 0;) freeSlots.push_back(s);
+        // io_uring parks blocking accepts in the kernel; a non-blocking listener would just bounce EAGAIN.
+        fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) & ~O_NONBLOCK);
+    }
+    ~UringServer() override {
+        for (auto &c : slots) if (c.fd >= 0) close(c.fd);
+        close(listenFd);
+    }
+
+    void run() override {
+        armAccept();
+        armTick();
+        while (!stopRequested) {
+            ring.submitAndWait(1);
+            ring.drain([&](const io_uring_cqe &cqe) {
+                unsigned s = static_cast<unsigned>(cqe.user_data >> 8);
+                switch (cqe.user_data & 0xff) {
+                    case OpAccept: onAccept(cqe.res); break;
+                    case OpRead: onRead(s, cqe.res); break;
+                    case OpWrite: onWrite(s, cqe.res); break;
+                    case OpTick: if (!stopRequested) armTick(); break;
+                }
+            });
+        }
+    }
+};
+
+// Journal whose write and fdatasync go down the ring as one linked pair (one syscall per order).
+class UringJournal : public OrderJournal {
+private:
+    int fd;
+    vector<char> buffer; // outlives the ring it is registered with
+    IoUring ring;
+    bool fixedBuffer;
+public:
+    explicit UringJournal(const string &fname) : fd(-1), buffer(64 * 1024), ring(8) {
+        fixedBuffer = ring.registerBuffers({{buffer.data(), buffer.size()}});
+        fd = openJournalFile(fname);
+    }
+    UringJournal(const UringJournal&) = delete;
+    UringJournal& operator=(const UringJournal&) = delete;
+    ~UringJournal() override { close(fd); }
+
+    void commit(const Order &o) override {
+        string line = record(o);
+        bool useFixed = fixedBuffer && line.size() <= buffer.size();
+        if (useFixed) memcpy(buffer.data(), line.data(), line.size());
+        io_uring_sqe *w = ring.next();
+        prepRw(w, IORING_OP_WRITE, fd, useFixed ? buffer.data() : line.data(), line.size(), 1, useFixed ? 0 : -1);
+        w->flags = IOSQE_IO_LINK;
+        io_uring_sqe *s = ring.next();
+        s->opcode = IORING_OP_FSYNC;
+        s->fd = fd;
+        s->fsync_flags = IORING_FSYNC_DATASYNC;
+        s->user_data = 2;
+        bool ok = true;
+        for (unsigned done = 0; done < 2;) {
+            ring.submitAndWait(2 - done);
+            done += ring.drain([&](const io_uring_cqe &cqe) {
+                if (cqe.res < 0 || (cqe.user_data == 1 && static_cast<size_t>(cqe.res) != line.size())) ok = false;
+            });
+        }
+        if (!ok) throw ShopException("Journal write failed");
+    }
+};
+
+// Back-end selection: "uring", "epoll", or "auto" (io_uring when the kernel allows it).
+unique_ptr<EventServer> makeServer(const string &io, int listenFd, ProtocolFactory f);
+
+unique_ptr<OrderJournal> makeJournal(const string &io, const string &fname);
+
+// Runs the HTTP benchmark against a forked server for each back end, then times
+// journal commits (write + fdatasync) through each journal implementation.
+void runIoBench(long requests, int connections, int pipeline, long commits);
+
+// -------------------- Shopping-session load generator --------------------
+// Simulates `users` shoppers against a running HTTP server. Each shopper keeps its own
+// keep-alive connection and cart and repeatedly picks an action from the mix: list the
+// catalog, view a product, add one to the cart, or check out (only with a non-empty
+// cart). Products are drawn from a Zipf distribution so a few SKUs stay hot. Each worker
+// thread drives its share of the shoppers' connections with non-blocking I/O on its own
+// epoll set, so all `users` really have a request in flight at once and think times cost
+// no threads. Latency is measured from when a request was due, not when it was sent, so
+// a server that falls behind shows its queueing delay in the percentiles.
+struct LoadGenConfig {
+    int port = 8080;
+    int users = 64;
+    double seconds = 10;
+    int threads = 4;
+    int products = 1000;
+    double zipfExponent = 0.99;
+    double thinkMs = 0;
+    array<int, 4> mix{{10, 60, 20, 10}}; // list, view, add, checkout (weights)
+};
+
+class ZipfSampler {
+private:
+    vector<double> cdf;
+public:
+    ZipfSampler(int n, double s) : cdf(static_cast<size_t>(n)) {
+        double sum = 0;
+        for (int k = 1; k <= n; ++k) { sum += 1.0 / pow(k, s); cdf[static_cast<size_t>(k - 1)] = sum; }
+        for (auto &c : cdf) c /= sum;
+    }
+    // Rank 1 is the most popular.
+    template<class Rng> int operator()(Rng &rng) const {
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        return static_cast<int>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) + 1;
+    }
+};
+
+void runLoadGen(const LoadGenConfig &cfg);
+
+#endif // SHOP_NET_HPP
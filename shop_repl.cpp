@@ -0,0 +1,115 @@
+// shop_repl.cpp
+
+#include "shop_repl.hpp"
+
+bool sendAll(int fd, const void *data, size_t len) {
+    const char *p = static_cast<const char*>(data);
+    for (size_t done = 0; done < len;) {
+        ssize_t n = send(fd, p + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool recvAll(int fd, void *data, size_t len) {
+    char *p = static_cast<char*>(data);
+    for (size_t done = 0; done < len;) {
+        ssize_t n = recv(fd, p + done, len - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+uint64_t catalogDigest(const Inventory &inv) {
+    uint64_t digest = 0;
+    for (auto &r : inv.exportRecords()) { // sum of per-record FNV-1a hashes: any order gives the same value
+        uint64_t h = 1469598103934665603ULL;
+        for (const string *s : {&r.first, &r.second})
+            for (char ch : *s) { h ^= static_cast<unsigned char>(ch); h *= 1099511628211ULL; }
+        digest += h;
+    }
+    return digest;
+}
+
+// Child side of runReplBench: follow until the primary goes away, then report.
+static int followForBench(const string &path, int reportFd) {
+    ReplicationFollower follower(Inventory::instance(), path);
+    auto deadline = chrono::steady_clock::now() + chrono::minutes(5);
+    while (!(follower.sessions() > 0 && !follower.connected()) && chrono::steady_clock::now() < deadline)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    MetricSummary lag = follower.lagSummary();
+    cout << fixed << setprecision(1) << "follower " << getpid() << ": applied " << follower.appliedSeq() << " records, lag p50 "
+         << lag.p50Us << " us, p99 " << lag.p99Us << " us, max " << lag.maxUs << " us" << endl;
+    uint64_t digest = catalogDigest(Inventory::instance());
+    return write(reportFd, &digest, sizeof digest) == static_cast<ssize_t>(sizeof digest) ? 0 : 1;
+}
+
+void runReplBench(int followers, double seconds, int products) {
+    string path = "/tmp/shop-repl-bench-" + to_string(getpid()) + ".sock";
+    vector<pair<pid_t, int>> children; // pid, read end of its digest pipe
+    cout.flush();
+    for (int i = 0; i < followers; ++i) { // fork before this process starts any threads
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) throw ShopException("pipe() failed");
+        pid_t pid = fork();
+        if (pid < 0) throw ShopException("fork() failed");
+        if (pid == 0) {
+            close(fds[0]);
+            for (auto &c : children) close(c.second);
+            _exit(followForBench(path, fds[1]));
+        }
+        close(fds[1]);
+        children.emplace_back(pid, fds[0]);
+    }
+
+    Inventory &inv = Inventory::instance();
+    for (int id = 1; id <= products; ++id) inv.addProduct(Product(id, "Product " + to_string(id), 1.0 + id % 100, 1000000));
+    uint64_t expected;
+    {
+        ReplicationPrimary primary(inv, path);
+        inv.setChangeSink(&primary);
+        auto start = chrono::steady_clock::now();
+        if (!primary.waitForFollowers(static_cast<size_t>(followers), chrono::seconds(30))) throw ShopException("Followers did not connect");
+        cout << fixed << setprecision(1) << followers << " followers synced " << products << " products in "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+
+        mt19937 rng(7);
+        long writes = 0;
+        start = chrono::steady_clock::now();
+        auto end = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+        while (chrono::steady_clock::now() < end) {
+            for (int i = 0; i < 256; ++i, ++writes) {
+                int id = static_cast<int>(rng() % static_cast<unsigned>(products)) + 1;
+                switch (rng() % 4) {
+                    case 0: inv.setPrice(id, 1.0 + rng() % 10000 / 100.0); break;
+                    case 1: inv.restock(id, 1); break;
+                    default: inv.reduceStock(id, 1); break;
+                }
+            }
+        }
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        auto drained = chrono::steady_clock::now();
+        bool caughtUp = primary.waitForFollowers(static_cast<size_t>(followers), chrono::seconds(30));
+        cout << fixed << setprecision(0) << writes << " writes in " << secs << " s (" << writes / secs << " writes/s); followers "
+             << (caughtUp ? "caught up " : "still behind after ") << setprecision(1)
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - drained).count() << " ms after the last write" << endl;
+        cout << primary.statsJson() << endl;
+        inv.setChangeSink(nullptr);
+        expected = catalogDigest(inv);
+    }
+
+    int matching = 0;
+    for (auto &c : children) {
+        uint64_t digest = 0;
+        bool got = read(c.second, &digest, sizeof digest) == static_cast<ssize_t>(sizeof digest);
+        close(c.second);
+        int status;
+        waitpid(c.first, &status, 0);
+        matching += got && digest == expected;
+    }
+    cout << matching << " of " << followers << " followers match the primary's catalog" << endl;
+}
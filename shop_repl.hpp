@@ -0,0 +1,369 @@
+// shop_repl.hpp
+// Primary/follower replication of the Inventory by log shipping over Unix sockets. The
+// primary keeps the most recent product records (exactly what persist() writes) in an
+// in-memory log and streams it to every follower; a follower applies the records to its
+// own Inventory and serves reads from it. Each record carries the primary's commit time,
+// so followers measure replication lag per record.
+
+#ifndef SHOP_REPL_HPP
+#define SHOP_REPL_HPP
+
+#include "shop_core.hpp"
+#include "shop_net.hpp"
+#include <poll.h>
+
+// -------------------- Wire format --------------------
+// Primary -> follower frames (native little-endian):
+//   u32 length (bytes after this field) | u8 type | u64 seq | u64 commit ns | payload
+// Record payloads are the key (u16-prefixed) followed by the record bytes. A snapshot is
+// SnapshotBegin (payload: u64 primary epoch), one Record per product, all at the seq the
+// snapshot reflects, then SnapshotEnd. Heartbeats carry the primary's latest seq.
+// Follower -> primary: a hello {u64 epoch, u64 last applied seq}, then u64 acknowledgements.
+// A follower whose epoch or position the log cannot serve gets a fresh snapshot.
+enum class ReplFrame : uint8_t { Record = 1, SnapshotBegin, SnapshotEnd, Heartbeat };
+
+inline uint64_t replClockNs() { // CLOCK_MONOTONIC: comparable across processes on one host
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Blocking send/receive of whole buffers; false once the peer is gone.
+bool sendAll(int fd, const void *data, size_t len);
+bool recvAll(int fd, void *data, size_t len);
+
+// Order-independent fingerprint of a catalog, to compare replicas.
+uint64_t catalogDigest(const Inventory &inv);
+
+// -------------------- Primary --------------------
+class ReplicationPrimary : public ChangeSink {
+private:
+    struct Entry {
+        uint64_t seq, ns;
+        string key, record;
+    };
+    struct Follower {
+        int fd;
+        atomic<uint64_t> acked{0};
+        atomic<bool> done{false};
+        thread worker;
+    };
+
+    Inventory &inv;
+    string path;
+    size_t capacity;
+    const uint64_t epoch;
+    mutable mutex mtx;
+    condition_variable cv;
+    deque<Entry> log; // the last `capacity` changes, consecutive seqs
+    uint64_t lastSeq = 0;
+    int listenFd;
+    atomic<bool> stopping{false};
+    thread acceptor;
+    mutable mutex followersMutex;
+    list<unique_ptr<Follower>> followers;
+    atomic<uint64_t> snapshotsSent{0};
+    static constexpr chrono::milliseconds heartbeat{10}; // idle interval; also how often acks are read
+
+    // body follows the key for records and is the whole payload otherwise.
+    static void frame(string &out, ReplFrame type, uint64_t seq, uint64_t ns, const string &key = "", string_view body = {}) {
+        WireWriter w(out);
+        bool rec = type == ReplFrame::Record;
+        w.put(static_cast<uint32_t>(1 + 16 + (rec ? 2 + key.size() : 0) + body.size()));
+        w.put(static_cast<uint8_t>(type));
+        w.put(seq);
+        w.put(ns);
+        if (rec) w.putString(key);
+        out += body;
+    }
+
+    // Sends the whole catalog and returns the seq it reflects.
+    uint64_t sendSnapshot(int fd) {
+        uint64_t at = 0, now = replClockNs();
+        vector<pair<string, string>> records = inv.exportRecords([&] { lock_guard<mutex> lk(mtx); at = lastSeq; });
+        string out;
+        frame(out, ReplFrame::SnapshotBegin, at, now, "", string_view(reinterpret_cast<const char*>(&epoch), sizeof epoch));
+        for (auto &r : records) {
+            frame(out, ReplFrame::Record, at, now, r.first, r.second);
+            if (out.size() >= (1 << 20)) { if (!sendAll(fd, out.data(), out.size())) return ~0ULL; out.clear(); }
+        }
+        frame(out, ReplFrame::SnapshotEnd, at, now);
+        snapshotsSent.fetch_add(1, memory_order_relaxed);
+        return sendAll(fd, out.data(), out.size()) ? at : ~0ULL;
+    }
+
+    void serve(Follower &f) {
+        uint64_t hello[2];
+        if (!recvAll(f.fd, hello, sizeof hello)) return;
+        bool fresh = hello[0] != epoch; // never synced with this primary
+        uint64_t pos = fresh ? 0 : hello[1];
+        f.acked = pos;
+        string out, acks;
+        while (!stopping) {
+            char buf[256];
+            for (ssize_t n; (n = recv(f.fd, buf, sizeof buf, MSG_DONTWAIT)) > 0;) acks.append(buf, static_cast<size_t>(n));
+            if (size_t whole = acks.size() / sizeof(uint64_t) * sizeof(uint64_t)) { // the newest ack wins
+                uint64_t ack;
+                memcpy(&ack, acks.data() + whole - sizeof ack, sizeof ack);
+                f.acked = ack;
+                acks.erase(0, whole);
+            }
+            bool snapshot;
+            {
+                unique_lock<mutex> lk(mtx);
+                cv.wait_for(lk, heartbeat, [&] { return stopping || lastSeq > pos; });
+                snapshot = fresh || pos > lastSeq || (pos < lastSeq && pos + 1 < log.front().seq);
+                if (!snapshot && lastSeq > pos) {
+                    size_t first = static_cast<size_t>(pos + 1 - log.front().seq);
+                    for (size_t i = first; i < log.size() && i < first + 4096; ++i) frame(out, ReplFrame::Record, log[i].seq, log[i].ns, log[i].key, log[i].record);
+                    pos = min(lastSeq, pos + 4096);
+                } else if (!snapshot) {
+                    frame(out, ReplFrame::Heartbeat, lastSeq, replClockNs());
+                }
+            }
+            if (snapshot) {
+                if ((pos = sendSnapshot(f.fd)) == ~0ULL) return;
+                fresh = false;
+                continue;
+            }
+            if (!sendAll(f.fd, out.data(), out.size())) return;
+            out.clear();
+        }
+    }
+
+    void acceptLoop() {
+        while (!stopping) {
+            pollfd p{listenFd, POLLIN, 0};
+            if (poll(&p, 1, 100) <= 0) continue;
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            auto f = make_unique<Follower>();
+            f->fd = fd;
+            Follower *raw = f.get();
+            lock_guard<mutex> lk(followersMutex);
+            followers.remove_if([](const unique_ptr<Follower> &old) {
+                if (!old->done) return false;
+                old->worker.join();
+                close(old->fd);
+                return true;
+            });
+            raw->worker = thread([this, raw] { serve(*raw); raw->done = true; });
+            followers.push_back(move(f));
+        }
+    }
+
+public:
+    ReplicationPrimary(Inventory &i, string socketPath, size_t logCapacity = 1 << 20)
+        : inv(i), path(move(socketPath)), capacity(logCapacity), epoch(replClockNs() ^ (static_cast<uint64_t>(getpid()) << 40)) {
+        listenFd = listenUnix(path);
+        acceptor = thread([this] { acceptLoop(); });
+    }
+    ReplicationPrimary(const ReplicationPrimary&) = delete;
+    ReplicationPrimary& operator=(const ReplicationPrimary&) = delete;
+
+    // Detach from the Inventory (setChangeSink(nullptr)) before destroying.
+    ~ReplicationPrimary() override {
+        stopping = true;
+        cv.notify_all();
+        acceptor.join();
+        lock_guard<mutex> lk(followersMutex);
+        for (auto &f : followers) {
+            shutdown(f->fd, SHUT_RDWR);
+            f->worker.join();
+            close(f->fd);
+        }
+        close(listenFd);
+        unlink(path.c_str());
+    }
+
+    void onChange(const string &key, const string &record) override {
+        lock_guard<mutex> lk(mtx);
+        log.push_back({++lastSeq, replClockNs(), key, record});
+        if (log.size() > capacity) log.pop_front();
+        cv.notify_all();
+    }
+
+    uint64_t seq() const { lock_guard<mutex> lk(mtx); return lastSeq; }
+
+    // Waits until at least `count` followers are connected and have acknowledged seq().
+    bool waitForFollowers(size_t count, chrono::milliseconds timeout) {
+        auto deadline = chrono::steady_clock::now() + timeout;
+        for (;;) {
+            uint64_t target = seq();
+            size_t caughtUp = 0;
+            {
+                lock_guard<mutex> lk(followersMutex);
+                for (auto &f : followers) caughtUp += !f->done && f->acked >= target;
+            }
+            if (caughtUp >= count) return true;
+            if (chrono::steady_clock::now() > deadline) return false;
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+
+    string statsJson() const {
+        uint64_t at = seq();
+        string out = "{\"role\":\"primary\",\"seq\":" + to_string(at) + ",\"snapshots_sent\":" + to_string(snapshotsSent.load()) + ",\"followers\":[";
+        lock_guard<mutex> lk(followersMutex);
+        bool first = true;
+        for (auto &f : followers) {
+            if (f->done) continue;
+            out += (first ? "" : ",") + string("{\"acked\":") + to_string(f->acked.load()) + ",\"behind\":" + to_string(at - min(at, f->acked.load())) + "}";
+            first = false;
+        }
+        return out + "]}";
+    }
+};
+
+// -------------------- Follower --------------------
+// Keeps the local Inventory in step with a primary, reconnecting if the stream drops.
+// Lag is the time from the primary's commit to the follower's apply, per live record.
+class ReplicationFollower {
+private:
+    Inventory &inv;
+    string path;
+    atomic<bool> stopping{false};
+    mutex fdMutex;
+    int fd = -1;
+    thread worker;
+    uint64_t epoch = 0;        // primary whose state is fully applied (sent in the hello)
+    uint64_t pendingEpoch = 0; // primary of the snapshot being received
+    atomic<uint64_t> applied{0}, primarySeq{0}, sessionCount{0}, snapshots{0}, lastLagNs{0};
+    atomic<bool> live{false};
+    bool inSnapshot = false;
+    LatencyHistogram lag; // written by the worker only
+
+    void handle(ReplFrame type, uint64_t seq, uint64_t ns, const char *payload, size_t len) {
+        switch (type) {
+            case ReplFrame::SnapshotBegin:
+                // Adopted only at SnapshotEnd: a follower cut off mid-snapshot must ask for a new one.
+                pendingEpoch = epoch;
+                if (len >= sizeof pendingEpoch) memcpy(&pendingEpoch, payload, sizeof pendingEpoch);
+                primarySeq = seq; // possibly a new primary, counting from its own start
+                inSnapshot = true;
+                snapshots.fetch_add(1, memory_order_relaxed);
+                break;
+            case ReplFrame::Record: {
+                WireReader r(payload, len);
+                string_view key;
+                if (!r.getString(key)) break;
+                size_t used = 2 + key.size();
+                if (!inv.applyRecord(string(key), string(payload + used, len - used))) break;
+                if (inSnapshot) break;
+                applied = seq;
+                uint64_t now = replClockNs(), d = now > ns ? now - ns : 0;
+                lag.record(d);
+                lastLagNs = d;
+                break;
+            }
+            case ReplFrame::SnapshotEnd:
+                if (!inSnapshot) break;
+                inSnapshot = false;
+                epoch = pendingEpoch;
+                applied = seq;
+                break;
+            case ReplFrame::Heartbeat:
+                break;
+        }
+        if (seq > primarySeq) primarySeq = seq;
+    }
+
+    void session(int s) {
+        inSnapshot = false; // a snapshot cut short by the last session is abandoned
+        uint64_t hello[2] = {epoch, applied.load()};
+        if (!sendAll(s, hello, sizeof hello)) return;
+        string buf;
+        vector<char> chunk(1 << 16);
+        for (;;) {
+            ssize_t n = recv(s, chunk.data(), chunk.size(), 0);
+            if (n <= 0) return;
+            buf.append(chunk.data(), static_cast<size_t>(n));
+            size_t pos = 0;
+            while (buf.size() - pos >= 4) {
+                uint32_t len;
+                memcpy(&len, buf.data() + pos, sizeof len);
+                if (len < 17 || buf.size() - pos - 4 < len) break;
+                const char *f = buf.data() + pos + 4;
+                uint64_t seq, ns;
+                memcpy(&seq, f + 1, sizeof seq);
+                memcpy(&ns, f + 9, sizeof ns);
+                handle(static_cast<ReplFrame>(f[0]), seq, ns, f + 17, len - 17);
+                pos += 4 + len;
+            }
+            buf.erase(0, pos);
+            uint64_t ack = applied;
+            if (!sendAll(s, &ack, sizeof ack)) return;
+        }
+    }
+
+    void run() {
+        while (!stopping) {
+            int s;
+            try {
+                s = connectUnix(path);
+            } catch (const ShopException&) {
+                this_thread::sleep_for(chrono::milliseconds(200));
+                continue;
+            }
+            {
+                lock_guard<mutex> lk(fdMutex);
+                if (stopping) { close(s); break; }
+                fd = s;
+            }
+            sessionCount.fetch_add(1, memory_order_relaxed);
+            live = true;
+            session(s);
+            live = false;
+            inSnapshot = false;
+            {
+                lock_guard<mutex> lk(fdMutex);
+                close(fd);
+                fd = -1;
+            }
+            if (!stopping) this_thread::sleep_for(chrono::milliseconds(200));
+        }
+    }
+
+public:
+    ReplicationFollower(Inventory &i, string socketPath) : inv(i), path(move(socketPath)) {
+        worker = thread([this] { run(); });
+    }
+    ReplicationFollower(const ReplicationFollower&) = delete;
+    ReplicationFollower& operator=(const ReplicationFollower&) = delete;
+    ~ReplicationFollower() {
+        {
+            lock_guard<mutex> lk(fdMutex);
+            stopping = true;
+            if (fd >= 0) shutdown(fd, SHUT_RDWR);
+        }
+        worker.join();
+    }
+
+    bool connected() const { return live; }
+    uint64_t sessions() const { return sessionCount; }
+    uint64_t appliedSeq() const { return applied; }
+
+    MetricSummary lagSummary() const {
+        vector<uint64_t> merged(LatencyHistogram::bucketCount);
+        uint64_t sum = 0, max = 0;
+        lag.mergeInto(merged, sum, max);
+        return summarize(merged, sum, max);
+    }
+
+    string statsJson() const {
+        MetricSummary s = lagSummary();
+        uint64_t at = applied, head = max(primarySeq.load(), at);
+        char buf[384];
+        snprintf(buf, sizeof buf, "{\"role\":\"follower\",\"connected\":%s,\"applied_seq\":%llu,\"primary_seq\":%llu,\"behind\":%llu,"
+                 "\"snapshots\":%llu,\"lag\":{\"count\":%llu,\"last_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}}",
+                 live ? "true" : "false", static_cast<unsigned long long>(at), static_cast<unsigned long long>(head),
+                 static_cast<unsigned long long>(head - at), static_cast<unsigned long long>(snapshots.load()),
+                 static_cast<unsigned long long>(s.count), lastLagNs / 1000.0, s.p50Us, s.p99Us, s.maxUs);
+        return buf;
+    }
+};
+
+// Forks `followers` follower processes, then runs a primary with one writer changing stock
+// and prices for `seconds`; reports write rate, follower lag and catch-up time, and checks
+// every follower ends with the primary's catalog.
+void runReplBench(int followers, double seconds, int products);
+
+#endif // SHOP_REPL_HPP
@@ -0,0 +1,92 @@
+// shop_runtime.cpp
+
+#include "shop_runtime.hpp"
+
+thread_local WorkStealingPool *WorkStealingPool::currentPool = nullptr;
+thread_local size_t WorkStealingPool::currentWorker = 0;
+
+void runShardBench(int shardCount, int clients, long ordersPerClient, int products) {
+    ShardedShop shop(shardCount, clients);
+    shop.setPayments(makeTestPayment);
+    const int initialStock = 1000000;
+    for (int id = 1; id <= products; ++id) shop.addProduct(Product(id, "Product " + to_string(id), 1.0 + id % 10, initialStock));
+    shop.start();
+    atomic<long> sold{0}, completed{0}, rejected{0};
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c] {
+            mt19937 rng(static_cast<unsigned>(c + 1));
+            atomic<int> outstanding{0};
+            auto track = [&](int units) {
+                return [&, units](const ShardReply &r) {
+                    if (units && r.ok) sold += units;
+                    if (!r.ok) ++rejected;
+                    --outstanding;
+                };
+            };
+            for (long i = 0; i < ordersPerClient; ++i) {
+                int cartId = static_cast<int>(c * ordersPerClient + i);
+                int a = 1 + static_cast<int>(rng() % static_cast<unsigned>(products));
+                int b = 1 + static_cast<int>(rng() % static_cast<unsigned>(products));
+                outstanding += 3;
+                shop.addToCart(c, cartId, a, 1, track(0));
+                shop.addToCart(c, cartId, b, 2, track(0));
+                // The cart's lines must land before checkout is queued behind them.
+                while (outstanding.load() > 1) this_thread::yield();
+                shop.checkout(c, cartId, "instant", track(3));
+                while (outstanding.load() > 0) this_thread::yield();
+                ++completed;
+            }
+        });
+    }
+    for (auto &t : threads) t.join();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    shop.stop();
+    long missing = 0;
+    bool negative = false;
+    for (auto &p : shop.listAll()) { missing += initialStock - p.getStock(); negative |= p.getStock() < 0; }
+    cout << completed << " checkouts on " << shardCount << " shards / " << clients << " clients in " << fixed
+         << setprecision(3) << secs << "s: " << setprecision(0) << completed / secs << " checkouts/s, "
+         << rejected << " rejected\n";
+    cout << "Units sold " << sold << ", units missing " << missing
+         << ((sold == missing && !negative) ? " (stock conserved)\n" : " (STOCK MISMATCH)\n");
+}
+
+void runPoolBench(unsigned threads, int shoppers, int products) {
+    seedCatalog(Inventory::instance(), products);
+    ShopService shop(Inventory::instance());
+    atomic<long> orders{0}, rejected{0}, reports{0};
+    auto start = chrono::steady_clock::now();
+    {
+        WorkStealingPool pool(threads);
+        for (int s = 0; s < shoppers; ++s) {
+            pool.post([&, s] {
+                auto lines = make_shared<atomic<int>>(3);
+                for (int l = 0; l < 3; ++l) {
+                    pool.post([&, s, l, lines] {
+                        shop.addToCart(s, 1 + (s * 7 + l * 13) % products, 1 + l);
+                        if (lines->fetch_sub(1) != 1) return;
+                        pool.post([&, s] {
+                            InstantPayment payment;
+                            try { shop.checkout(s, payment); ++orders; }
+                            catch (const ShopException&) { ++rejected; shop.clearCart(s); }
+                        });
+                    });
+                }
+            });
+            if (s % 1000 == 0) {
+                pool.post([&] {
+                    double value = 0;
+                    for (auto &p : shop.inventory().listAll()) value += p.getPrice() * p.getStock();
+                    if (value >= 0) ++reports;
+                });
+            }
+        }
+        pool.waitIdle();
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << shoppers << " shoppers on " << pool.size() << " workers in " << fixed << setprecision(3) << secs << "s: "
+             << setprecision(0) << (orders + rejected) / secs << " checkouts/s (" << orders << " orders, " << rejected
+             << " rejected, " << reports << " reports, " << pool.stealCount() << " steals)\n";
+    }
+}
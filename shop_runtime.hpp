@@ -0,0 +1,625 @@
+// shop_runtime.hpp
+// Multi-core execution: the thread-per-core sharded shop and the work-stealing pool.
+
+#ifndef SHOP_RUNTIME_HPP
+#define SHOP_RUNTIME_HPP
+
+#include "shop_core.hpp"
+#include <pthread.h>
+
+// -------------------- Thread-per-core runtime --------------------
+// Bounded single-producer/single-consumer ring. push() leaves the value untouched when full.
+template<class T>
+class SpscQueue {
+private:
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0}; // next slot to pop (consumer)
+    alignas(64) atomic<size_t> tail{0}; // next slot to fill (producer)
+    alignas(64) size_t cachedHead = 0;  // producer's last view of head
+public:
+    explicit SpscQueue(size_t capacityPow2) : slots(capacityPow2), mask(capacityPow2 - 1) {}
+
+    bool push(T &&v) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - cachedHead == slots.size()) {
+            cachedHead = head.load(memory_order_acquire);
+            if (t - cachedHead == slots.size()) return false;
+        }
+        slots[t & mask] = move(v);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T &out) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        out = move(slots[h & mask]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+};
+
+struct ShardReply {
+    bool ok = false;
+    string error;
+    Product product;
+    int orderId = 0;
+    double amount = 0;
+};
+using ShardCallback = function<void(const ShardReply&)>;
+
+struct ShardMessage {
+    enum class Kind : uint8_t { GetProduct, AddToCart, AttachLine, Checkout, Reserve, Reserved, Commit, Abort };
+    Kind kind = Kind::GetProduct;
+    int cartId = 0;
+    int productId = 0;
+    int qty = 0;
+    uint64_t txn = 0;
+    int replyTo = -1;
+    bool ok = false;
+    Product product;
+    vector<pair<int, int>> lines; // (productId, qty) to reserve
+    string method;
+    ShardCallback done;
+};
+
+// Shared-nothing shop: shard i owns the products and carts whose id hashes to i plus its
+// own order-id sequence, and is the only thread that ever touches them. Work reaches a
+// shard through one SPSC queue per producer (every shard and every client), and each shard
+// keeps its products in a plain table of its own, so the hot path takes no locks and
+// shares no written cache line with another shard. Checkout of a cart holding products from other shards runs a
+// two-phase reservation: the cart's shard asks each owner to Reserve its lines (stock is
+// taken and parked under the transaction id), then sends Commit once payment succeeds
+// or Abort (stock goes back) if any owner refused or the payment was declined.
+class ShardedShop {
+private:
+    struct PendingCheckout {
+        int cartId;
+        pmr::vector<CartItem> items;
+        string method;
+        ShardCallback done;
+        int waiting = 0;
+        bool allReserved = true;
+        vector<int> participants;
+    };
+
+    // Written by one thread only; read by stop() to tell when every queue has drained.
+    struct alignas(64) Counter {
+        atomic<uint64_t> n{0};
+        void bump() { n.store(n.load(memory_order_relaxed) + 1, memory_order_release); }
+        uint64_t get() const { return n.load(memory_order_acquire); }
+    };
+
+    struct Shard {
+        int index = 0;
+        unordered_map<int, Product> products;                   // this shard's share of the catalog
+        pmr::unordered_map<int, ShoppingCart> carts{&TaggedResource::of(MemTag::Carts)};
+        unordered_map<uint64_t, vector<pair<int, int>>> holds;  // txn -> reserved lines
+        unordered_map<uint64_t, PendingCheckout> pending;       // txn -> checkout in progress
+        vector<unique_ptr<SpscQueue<ShardMessage>>> inbox;      // one per producer
+        deque<pair<int, ShardMessage>> overflow;                // sends that found a full queue
+        uint64_t txnSeq = 0;
+        int orderSeq = 0;
+        Counter sent, handled; // messages to other shards / messages popped and handled
+        thread worker;
+    };
+
+    int shardCount;
+    int clientCount;
+    PaymentFactory payments = makePayment; // runs on shard threads
+    vector<unique_ptr<Shard>> shards;
+    unique_ptr<Counter[]> submitted; // per client
+    atomic<bool> drained{false};
+
+    int ownerOf(int id) const { return static_cast<int>(static_cast<unsigned>(id) % static_cast<unsigned>(shardCount)); }
+
+    void send(Shard &from, int to, ShardMessage &&m) {
+        from.sent.bump();
+        if (!from.overflow.empty() || !shards[to]->inbox[from.index]->push(move(m)))
+            from.overflow.emplace_back(to, move(m));
+    }
+
+    void handle(Shard &sh, ShardMessage &m) {
+        using K = ShardMessage::Kind;
+        switch (m.kind) {
+            case K::GetProduct: {
+                ShardReply r;
+                Product *p = find(sh, m.productId);
+                r.ok = p != nullptr;
+                if (r.ok) r.product = *p; else r.error = errorMessage(ShopError::NotFound);
+                m.done(r);
+                break;
+            }
+            case K::AddToCart: { // at the product's shard: validate and snapshot, then hand to the cart's shard
+                Product *p = m.qty <= 0 ? nullptr : find(sh, m.productId);
+                if (!p) {
+                    ShardReply r;
+                    r.error = errorMessage(m.qty <= 0 ? ShopError::InvalidQuantity : ShopError::NotFound);
+                    m.done(r);
+                    break;
+                }
+                m.product = *p;
+                m.kind = K::AttachLine;
+                if (ownerOf(m.cartId) == sh.index) handle(sh, m);
+                else send(sh, ownerOf(m.cartId), move(m));
+                break;
+            }
+            case K::AttachLine: {
+                sh.carts[m.cartId].addToCart(m.product, m.qty);
+                ShardReply r;
+                r.ok = true;
+                m.done(r);
+                break;
+            }
+            case K::Checkout: beginCheckout(sh, m); break;
+            case K::Reserve: {
+                ShardMessage reply;
+                reply.kind = K::Reserved;
+                reply.txn = m.txn;
+                reply.ok = reserve(sh, m.txn, m.lines);
+                reply.replyTo = sh.index;
+                if (m.replyTo == sh.index) handle(sh, reply);
+                else send(sh, m.replyTo, move(reply));
+                break;
+            }
+            case K::Reserved: onReserved(sh, m.txn, m.replyTo, m.ok); break;
+            case K::Commit: sh.holds.erase(m.txn); break;
+            case K::Abort: {
+                auto it = sh.holds.find(m.txn);
+                if (it == sh.holds.end()) break;
+                for (auto &l : it->second) find(sh, l.first)->increaseStock(l.second);
+                sh.holds.erase(it);
+                break;
+            }
+        }
+    }
+
+    static Product* find(Shard &sh, int id) {
+        auto it = sh.products.find(id);
+        return it == sh.products.end() ? nullptr : &it->second;
+    }
+
+    bool reserve(Shard &sh, uint64_t txn, const vector<pair<int, int>> &lines) {
+        for (size_t i = 0; i < lines.size(); ++i) {
+            Product *p = find(sh, lines[i].first);
+            if (p && p->reduceStock(lines[i].second)) continue;
+            for (size_t j = 0; j < i; ++j) find(sh, lines[j].first)->increaseStock(lines[j].second);
+            return false;
+        }
+        sh.holds[txn] = lines;
+        return true;
+    }
+
+    void beginCheckout(Shard &sh, ShardMessage &m) {
+        auto it = sh.carts.find(m.cartId);
+        if (it == sh.carts.end() || it->second.empty()) {
+            ShardReply r;
+            r.error = "Cart is empty";
+            m.done(r);
+            return;
+        }
+        uint64_t txn = (++sh.txnSeq << 16) | static_cast<uint64_t>(sh.index);
+        PendingCheckout &pc = sh.pending[txn];
+        pc.cartId = m.cartId;
+        pc.items = it->second.getItems();
+        pc.method = move(m.method);
+        pc.done = move(m.done);
+        sh.carts.erase(it);
+        map<int, vector<pair<int, int>>> byOwner;
+        for (auto &ci : pc.items) byOwner[ownerOf(ci.product.getId())].emplace_back(ci.product.getId(), ci.quantity);
+        pc.waiting = static_cast<int>(byOwner.size());
+        for (auto &kv : byOwner) {
+            ShardMessage r;
+            r.kind = ShardMessage::Kind::Reserve;
+            r.txn = txn;
+            r.replyTo = sh.index;
+            r.lines = move(kv.second);
+            if (kv.first == sh.index) handle(sh, r);
+            else send(sh, kv.first, move(r));
+        }
+    }
+
+    void onReserved(Shard &sh, uint64_t txn, int participant, bool ok) {
+        auto it = sh.pending.find(txn);
+        if (it == sh.pending.end()) return;
+        PendingCheckout &pc = it->second;
+        if (ok) pc.participants.push_back(participant);
+        else pc.allReserved = false;
+        if (--pc.waiting > 0) return;
+
+        ShardReply r;
+        bool paid = false;
+        if (pc.allReserved) {
+            try { paid = ShopService::pay(*payments(pc.method), Order(0, pc.items).getAmount()); }
+            catch (const ShopException &e) { r.error = e.what(); }
+        }
+        for (int p : pc.participants) {
+            ShardMessage decision;
+            decision.kind = paid ? ShardMessage::Kind::Commit : ShardMessage::Kind::Abort;
+            decision.txn = txn;
+            if (p == sh.index) handle(sh, decision);
+            else send(sh, p, move(decision));
+        }
+        if (paid) {
+            Order o(++sh.orderSeq * shardCount + sh.index, pc.items);
+            r.ok = true;
+            r.orderId = o.getId();
+            r.amount = o.getAmount();
+        } else if (r.error.empty()) {
+            r.error = pc.allReserved ? "Payment declined" : "Insufficient stock";
+        }
+        ShardCallback done = move(pc.done);
+        sh.pending.erase(it);
+        done(r);
+    }
+
+    // Runs until stop() has seen every queue drained, so every Commit and Abort is applied
+    // and every pending checkout has answered before any shard returns. A message counts as
+    // handled only after the sends it causes are counted.
+    void loop(Shard &sh) {
+        int idle = 0;
+        ShardMessage m;
+        while (!drained.load(memory_order_acquire)) {
+            bool progressed = false;
+            for (auto &q : sh.inbox)
+                while (q->pop(m)) {
+                    handle(sh, m);
+                    sh.handled.bump();
+                    progressed = true;
+                }
+            while (!sh.overflow.empty()) {
+                auto &front = sh.overflow.front();
+                if (!shards[front.first]->inbox[sh.index]->push(move(front.second))) break;
+                sh.overflow.pop_front();
+                progressed = true;
+            }
+            if (progressed) { idle = 0; continue; }
+            if (++idle < 64) continue;
+            if (idle < 256) this_thread::yield();
+            else this_thread::sleep_for(chrono::microseconds(50));
+        }
+        for (auto &p : sh.pending) { // unreachable once drained; never leave a caller waiting
+            ShardReply r;
+            r.error = "Shop stopped";
+            p.second.done(r);
+        }
+        sh.pending.clear();
+    }
+
+    void submit(int client, int shard, ShardMessage &&m) {
+        SpscQueue<ShardMessage> &q = *shards[shard]->inbox[shardCount + client];
+        submitted[client].bump();
+        while (!q.push(move(m))) this_thread::yield();
+    }
+
+public:
+    // `clients` is the number of external threads that will submit requests; each gets its own queues.
+    ShardedShop(int shardCount_, int clients)
+        : shardCount(shardCount_), clientCount(clients), submitted(new Counter[static_cast<size_t>(clients)]) {
+        for (int i = 0; i < shardCount; ++i) {
+            auto sh = make_unique<Shard>();
+            sh->index = i;
+            for (int p = 0; p < shardCount + clientCount; ++p) sh->inbox.push_back(make_unique<SpscQueue<ShardMessage>>(4096));
+            shards.push_back(move(sh));
+        }
+    }
+    ShardedShop(const ShardedShop&) = delete;
+    ShardedShop& operator=(const ShardedShop&) = delete;
+    ~ShardedShop() { stop(); }
+
+    int shardsCount() const { return shardCount; }
+
+    // Setup; only valid before start().
+    void setPayments(PaymentFactory f) { payments = move(f); }
+    void addProduct(const Product &p) { shards[ownerOf(p.getId())]->products.insert_or_assign(p.getId(), p); }
+
+    void start() {
+        drained = false;
+        unsigned cores = max(1u, thread::hardware_concurrency());
+        for (auto &sh : shards) {
+            Shard *s = sh.get();
+            s->worker = thread([this, s] { loop(*s); });
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(static_cast<unsigned>(s->index) % cores, &set);
+            pthread_setaffinity_np(s->worker.native_handle(), sizeof set, &set);
+        }
+    }
+
+    // Call once clients have stopped submitting; returns after every queue has drained.
+    // Quiescent once everything sent has been handled with the same totals on two passes
+    // in a row (handled is read before sent, so a message in transit cannot hide).
+    void stop() {
+        bool live = false;
+        for (auto &sh : shards) live = live || sh->worker.joinable();
+        if (!live) return;
+        uint64_t last = ~0ULL;
+        for (;;) {
+            uint64_t handled = 0, sent = 0;
+            for (auto &sh : shards) handled += sh->handled.get();
+            for (auto &sh : shards) sent += sh->sent.get();
+            for (int c = 0; c < clientCount; ++c) sent += submitted[c].get();
+            if (handled == sent && handled == last) break;
+            last = handled == sent ? handled : ~0ULL;
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+        drained.store(true, memory_order_release);
+        for (auto &sh : shards) if (sh->worker.joinable()) sh->worker.join();
+    }
+
+    // Merged catalog view; only meaningful once stopped.
+    vector<Product> listAll() const {
+        vector<Product> out;
+        for (auto &sh : shards) for (auto &p : sh->products) out.push_back(p.second);
+        sort(out.begin(), out.end(), [](const Product &a, const Product &b){ return a.getId() < b.getId(); });
+        return out;
+    }
+
+    // Client API: asynchronous; `done` runs on a shard thread.
+    void getProduct(int client, int productId, ShardCallback done) {
+        ShardMessage m;
+        m.kind = ShardMessage::Kind::GetProduct;
+        m.productId = productId;
+        m.done = move(done);
+        submit(client, ownerOf(productId), move(m));
+    }
+
+    void addToCart(int client, int cartId, int productId, int qty, ShardCallback done) {
+        ShardMessage m;
+        m.kind = ShardMessage::Kind::AddToCart;
+        m.cartId = cartId;
+        m.productId = productId;
+        m.qty = qty;
+        m.done = move(done);
+        submit(client, ownerOf(productId), move(m));
+    }
+
+    void checkout(int client, int cartId, const string &method, ShardCallback done) {
+        ShardMessage m;
+        m.kind = ShardMessage::Kind::Checkout;
+        m.cartId = cartId;
+        m.method = method;
+        m.done = move(done);
+        submit(client, ownerOf(cartId), move(m));
+    }
+};
+
+// Closed-loop clients each fill a two-product cart (usually spanning shards) and check
+// it out against a small, hot catalog, then stock conservation is checked:
+// units sold == units missing from the shelves, and no stock went negative.
+void runShardBench(int shardCount, int clients, long ordersPerClient, int products);
+
+// -------------------- Work-stealing thread pool --------------------
+// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// The owning worker pushes and takes at the bottom; any other thread steals from the top.
+// Buffers only grow; retired ones are kept until destruction so a racing thief never
+// reads freed memory. The paper's standalone seq_cst fences are folded into seq_cst
+// accesses to top and bottom, which ThreadSanitizer can model.
+template<class T>
+class ChaseLevDeque {
+private:
+    struct Buffer {
+        int64_t capacity;
+        unique_ptr<atomic<T*>[]> slots;
+        explicit Buffer(int64_t cap) : capacity(cap), slots(new atomic<T*>[static_cast<size_t>(cap)]) {}
+        T* get(int64_t i) const { return slots[static_cast<size_t>(i & (capacity - 1))].load(memory_order_relaxed); }
+        void put(int64_t i, T *v) { slots[static_cast<size_t>(i & (capacity - 1))].store(v, memory_order_relaxed); }
+    };
+
+    alignas(64) atomic<int64_t> top{0};
+    alignas(64) atomic<int64_t> bottom{0};
+    atomic<Buffer*> buffer;
+    vector<unique_ptr<Buffer>> buffers; // current + retired, owner-only
+
+public:
+    explicit ChaseLevDeque(int64_t capacity = 256) {
+        buffers.push_back(make_unique<Buffer>(capacity));
+        buffer.store(buffers.back().get(), memory_order_relaxed);
+    }
+
+    // Owner only.
+    void push(T *v) {
+        int64_t b = bottom.load(memory_order_relaxed);
+        int64_t t = top.load(memory_order_acquire);
+        Buffer *a = buffer.load(memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            auto grown = make_unique<Buffer>(a->capacity * 2);
+            for (int64_t i = t; i < b; ++i) grown->put(i, a->get(i));
+            a = grown.get();
+            buffers.push_back(move(grown));
+            buffer.store(a, memory_order_release);
+        }
+        a->put(b, v);
+        bottom.store(b + 1, memory_order_release);
+    }
+
+    // Owner only; LIFO end.
+    T* take() {
+        int64_t b = bottom.load(memory_order_relaxed) - 1;
+        Buffer *a = buffer.load(memory_order_relaxed);
+        bottom.store(b, memory_order_seq_cst);
+        int64_t t = top.load(memory_order_seq_cst);
+        if (t > b) { bottom.store(b + 1, memory_order_relaxed); return nullptr; }
+        T *v = a->get(b);
+        if (t == b) {
+            if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) v = nullptr;
+            bottom.store(b + 1, memory_order_relaxed);
+        }
+        return v;
+    }
+
+    // Any thread; FIFO end. nullptr when empty or when another thief won the race.
+    T* steal() {
+        int64_t t = top.load(memory_order_seq_cst);
+        int64_t b = bottom.load(memory_order_seq_cst);
+        if (t >= b) return nullptr;
+        T *v = buffer.load(memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) return nullptr;
+        return v;
+    }
+};
+
+// Tasks submitted from a worker go onto that worker's own deque; tasks from outside are
+// spread round-robin over small per-worker inboxes, so there is no single shared queue.
+// Idle workers steal from random victims, and park on a condition variable when the
+// whole pool is dry.
+class WorkStealingPool {
+private:
+    using Task = function<void()>;
+
+    struct Worker {
+        ChaseLevDeque<Task> deque;
+        mutex inboxMutex;
+        vector<Task*> inbox;
+        atomic<bool> inboxNonEmpty{false};
+        thread th;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    atomic<size_t> nextInbox{0};
+    atomic<bool> stopping{false};
+    atomic<int> sleepers{0};
+    atomic<long> pendingTasks{0};
+    atomic<long> steals{0};
+    mutex parkMutex;
+    condition_variable parkCv;
+    uint64_t wakeEpoch = 0;
+    condition_variable idleCv;
+
+    static thread_local WorkStealingPool *currentPool;
+    static thread_local size_t currentWorker;
+
+    // The read is an RMW so it is ordered against a parking worker's increment: either it
+    // sees the sleeper, or that worker's acquire sees the task we just published.
+    void wakeOne() {
+        if (sleepers.fetch_add(0, memory_order_acq_rel) == 0) return;
+        { lock_guard<mutex> lk(parkMutex); ++wakeEpoch; }
+        parkCv.notify_one();
+    }
+
+    Task* drainInbox(Worker &w) {
+        if (!w.inboxNonEmpty.load(memory_order_acquire)) return nullptr;
+        vector<Task*> batch;
+        {
+            lock_guard<mutex> lk(w.inboxMutex);
+            batch.swap(w.inbox);
+            w.inboxNonEmpty.store(false, memory_order_relaxed);
+        }
+        if (batch.empty()) return nullptr;
+        for (size_t i = 1; i < batch.size(); ++i) w.deque.push(batch[i]);
+        return batch[0];
+    }
+
+    Task* findTask(size_t self, mt19937 &rng) {
+        Worker &me = *workers[self];
+        if (Task *t = me.deque.take()) return t;
+        if (Task *t = drainInbox(me)) return t;
+        size_t n = workers.size();
+        for (size_t attempt = 0; attempt < 2 * n; ++attempt) {
+            size_t victim = rng() % n;
+            if (victim == self) continue;
+            if (Task *t = workers[victim]->deque.steal()) { steals.fetch_add(1, memory_order_relaxed); return t; }
+        }
+        for (size_t i = 1; i < n; ++i) {
+            Worker &other = *workers[(self + i) % n];
+            if (Task *t = other.deque.steal()) { steals.fetch_add(1, memory_order_relaxed); return t; }
+            if (other.inboxNonEmpty.load(memory_order_acquire)) {
+                lock_guard<mutex> lk(other.inboxMutex);
+                if (!other.inbox.empty()) {
+                    Task *t = other.inbox.back();
+                    other.inbox.pop_back();
+                    other.inboxNonEmpty.store(!other.inbox.empty(), memory_order_relaxed);
+                    return t;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void run(Task *t) {
+        unique_ptr<Task> owned(t);
+        try { (*owned)(); } catch (...) { /* a failing task must not take the worker down */ }
+        if (pendingTasks.fetch_sub(1, memory_order_acq_rel) == 1) {
+            lock_guard<mutex> lk(parkMutex);
+            idleCv.notify_all();
+        }
+    }
+
+    void workerLoop(size_t self) {
+        currentPool = this;
+        currentWorker = self;
+        mt19937 rng(static_cast<unsigned>(self * 7919 + 1));
+        while (true) {
+            Task *t = nullptr;
+            for (int spin = 0; spin < 64 && !t; ++spin) t = findTask(self, rng);
+            if (t) { run(t); continue; }
+            // Announce we are about to sleep, then look once more: a submitter either sees us
+            // in `sleepers` and bumps the epoch, or we see its task in this final scan.
+            sleepers.fetch_add(1, memory_order_seq_cst);
+            uint64_t epoch;
+            { lock_guard<mutex> lk(parkMutex); epoch = wakeEpoch; }
+            t = findTask(self, rng);
+            if (!t && !stopping.load()) {
+                unique_lock<mutex> lk(parkMutex);
+                parkCv.wait(lk, [&] { return wakeEpoch != epoch || stopping.load(); });
+            }
+            sleepers.fetch_sub(1, memory_order_relaxed);
+            if (t) run(t);
+            else if (stopping.load() && pendingTasks.load() == 0) return;
+        }
+    }
+
+public:
+    explicit WorkStealingPool(unsigned threads = max(1u, thread::hardware_concurrency())) {
+        for (unsigned i = 0; i < threads; ++i) workers.push_back(make_unique<Worker>());
+        for (size_t i = 0; i < workers.size(); ++i) workers[i]->th = thread([this, i] { workerLoop(i); });
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Finishes every queued task, then joins the workers.
+    ~WorkStealingPool() {
+        waitIdle();
+        stopping = true;
+        { lock_guard<mutex> lk(parkMutex); ++wakeEpoch; }
+        parkCv.notify_all();
+        for (auto &w : workers) w->th.join();
+    }
+
+    size_t size() const { return workers.size(); }
+    long stealCount() const { return steals.load(); }
+
+    void post(Task task) {
+        pendingTasks.fetch_add(1, memory_order_relaxed);
+        Task *t = new Task(move(task));
+        if (currentPool == this) workers[currentWorker]->deque.push(t);
+        else {
+            Worker &w = *workers[nextInbox.fetch_add(1, memory_order_relaxed) % workers.size()];
+            lock_guard<mutex> lk(w.inboxMutex);
+            w.inbox.push_back(t);
+            w.inboxNonEmpty.store(true, memory_order_release);
+        }
+        wakeOne();
+    }
+
+    template<class F> auto submit(F f) -> future<decltype(f())> {
+        auto task = make_shared<packaged_task<decltype(f())()>>(move(f));
+        future<decltype(f())> result = task->get_future();
+        post([task] { (*task)(); });
+        return result;
+    }
+
+    // Blocks until every task posted so far (and everything they spawned) has run.
+    void waitIdle() {
+        unique_lock<mutex> lk(parkMutex);
+        idleCv.wait(lk, [&] { return pendingTasks.load() == 0; });
+    }
+};
+
+// Bursty mixed workload on the shared ShopService: every shopper task fans out
+// add-to-cart subtasks and then a checkout, while periodic reporting tasks value the
+// whole catalog.
+void runPoolBench(unsigned threads, int shoppers, int products);
+
+#endif // SHOP_RUNTIME_HPP
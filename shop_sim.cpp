@@ -0,0 +1,294 @@
+// shop_sim.cpp
+// Deterministic simulation of concurrent shopping sessions against the real ShopService.
+// Customers and a restocker run as threads, but only one runs at a time: a seeded scheduler
+// picks who continues at every simYield() point in the checkout path, at payment and at
+// think time. Time is virtual; the payment gateway (latency, declines) and the order disk
+// (fsync latency, write faults) are simulated from the same seed. A seed therefore fixes
+// the whole interleaving, and a failing seed replays exactly.
+// Usage: shop_sim [--seeds=200] [--first-seed=1] [--seed=<n>] [--customers=4] [--sessions=6]
+//                 [--products=3] [--stock=8] [--decline=0.1] [--disk-faults=0]
+
+#include "shop_core.hpp"
+
+// -------------------- Scheduler --------------------
+class SimScheduler {
+public:
+    using Body = function<void(mt19937_64&)>;
+private:
+    struct Task {
+        string name;
+        Body body;
+        mt19937_64 rng;
+        uint64_t wake = 0;
+        bool done = false;
+        thread th;
+    };
+    mutex m;
+    condition_variable cv;
+    int running = -1;          // task holding the baton, -1 while the scheduler decides
+    uint64_t clock = 0;        // virtual microseconds
+    mt19937_64 rng;
+    vector<unique_ptr<Task>> tasks;
+    vector<string> events;
+    static inline thread_local int current = -1;
+    static inline SimScheduler *active = nullptr;
+
+    void park() {
+        unique_lock<mutex> lk(m);
+        int me = current;
+        running = -1;
+        cv.notify_all();
+        cv.wait(lk, [&]{ return running == me; });
+    }
+public:
+    explicit SimScheduler(uint64_t seed) : rng(seed) {}
+
+    void spawn(string name, Body body) {
+        auto t = make_unique<Task>();
+        t->name = move(name);
+        t->body = move(body);
+        t->rng.seed(rng());
+        tasks.push_back(move(t));
+    }
+
+    // Only called by the running task, so plain members are safe.
+    uint64_t now() const { return clock; }
+    void log(const string &what) { events.push_back("t=" + to_string(clock) + ' ' + tasks[static_cast<size_t>(current)]->name + ": " + what); }
+    void yield(const char *where) { log(where); park(); }
+    void sleep(uint64_t us) { tasks[static_cast<size_t>(current)]->wake = clock + us; park(); }
+    // Moves time on without giving up the baton; for work done while a lock is held.
+    void advance(uint64_t us) { clock += us; }
+
+    const vector<string>& trace() const { return events; }
+    uint64_t traceHash() const {
+        uint64_t h = 1469598103934665603ULL; // FNV-1a
+        for (auto &e : events) for (char ch : e) { h ^= static_cast<unsigned char>(ch); h *= 1099511628211ULL; }
+        return h;
+    }
+
+    void run() {
+        active = this;
+        SimHooks::yield = [](const char *where) { active->yield(where); };
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            tasks[i]->th = thread([this, i] {
+                current = static_cast<int>(i);
+                {
+                    unique_lock<mutex> lk(m);
+                    cv.wait(lk, [&]{ return running == current; });
+                }
+                tasks[i]->body(tasks[i]->rng);
+                lock_guard<mutex> lk(m);
+                tasks[i]->done = true;
+                running = -1;
+                cv.notify_all();
+            });
+        }
+        unique_lock<mutex> lk(m);
+        for (;;) {
+            uint64_t earliest = UINT64_MAX;
+            for (auto &t : tasks) if (!t->done) earliest = min(earliest, t->wake);
+            if (earliest == UINT64_MAX) break;
+            clock = max(clock, earliest);
+            vector<int> ready;
+            for (size_t i = 0; i < tasks.size(); ++i)
+                if (!tasks[i]->done && tasks[i]->wake <= clock) ready.push_back(static_cast<int>(i));
+            running = ready[rng() % ready.size()];
+            cv.notify_all();
+            cv.wait(lk, [&]{ return running == -1; });
+        }
+        lk.unlock();
+        for (auto &t : tasks) t->th.join();
+        SimHooks::yield = nullptr;
+        active = nullptr;
+    }
+};
+
+// -------------------- Simulated payment gateway --------------------
+class SimPaymentGateway : public Payment {
+private:
+    SimScheduler &sched;
+    mt19937_64 rng;
+    double declineRate;
+public:
+    long long approvedCents = 0;
+
+    SimPaymentGateway(SimScheduler &s, uint64_t seed, double decline) : sched(s), rng(seed), declineRate(decline) {}
+
+    bool pay(double amount) override {
+        sched.sleep(200 + rng() % 5000);
+        bool ok = uniform_real_distribution<double>(0, 1)(rng) >= declineRate;
+        sched.log(ok ? "payment approved" : "payment declined");
+        if (ok) approvedCents += llround(amount * 100);
+        return ok;
+    }
+
+    bool refund(double amount) override {
+        sched.sleep(200 + rng() % 2000);
+        sched.log("payment refunded");
+        approvedCents -= llround(amount * 100);
+        return true;
+    }
+};
+
+// -------------------- Simulated disk --------------------
+// commit() runs under ShopService's journal mutex, so it only advances time and never yields.
+class SimDisk : public OrderJournal {
+private:
+    SimScheduler &sched;
+    mt19937_64 rng;
+    double faultRate;
+public:
+    vector<int> durable; // order ids that reached "stable storage"
+
+    SimDisk(SimScheduler &s, uint64_t seed, double faults) : sched(s), rng(seed), faultRate(faults) {}
+
+    void commit(const Order &o) override {
+        sched.advance(50 + rng() % 2000);
+        if (uniform_real_distribution<double>(0, 1)(rng) < faultRate) {
+            sched.log("disk write failed");
+            throw ShopException("Journal write failed");
+        }
+        durable.push_back(o.getId());
+        sched.log("order durable");
+    }
+};
+
+// -------------------- Simulation --------------------
+struct SimConfig {
+    int customers = 4;
+    int sessions = 6;
+    int products = 3;
+    int stock = 8;
+    double decline = 0.1;
+    double diskFaults = 0;
+};
+
+struct SimOutcome {
+    vector<string> violations;
+    vector<string> trace;
+    uint64_t hash = 0;
+};
+
+SimOutcome simulate(const SimConfig &cfg, uint64_t seed) {
+    SimScheduler sched(seed);
+    mt19937_64 seeder(seed ^ 0x9e3779b97f4a7c15ULL);
+    SimPaymentGateway gateway(sched, seeder(), cfg.decline);
+    SimDisk disk(sched, seeder(), cfg.diskFaults);
+
+    Inventory &inv = Inventory::instance();
+    for (int id = 1; id <= cfg.products; ++id) inv.addProduct(Product(id, "Sim " + to_string(id), 5.0 * id, cfg.stock));
+    ShopService shop(inv);
+    shop.setJournal(&disk);
+
+    vector<long> restocked(static_cast<size_t>(cfg.products) + 1), sold(static_cast<size_t>(cfg.products) + 1);
+    vector<int> returned;   // ids of orders handed back to customers
+    long long orderCents = 0;
+    vector<string> violations;
+
+    for (int c = 0; c < cfg.customers; ++c) {
+        sched.spawn("customer " + to_string(c), [&, c](mt19937_64 &rng) {
+            int cartId = 1000 + c;
+            size_t lines = 0;
+            for (int s = 0; s < cfg.sessions; ++s) {
+                sched.sleep(static_cast<uint64_t>(exponential_distribution<double>(1.0 / 1000)(rng)));
+                int n = 1 + static_cast<int>(rng() % 3);
+                for (int i = 0; i < n; ++i) {
+                    int pid = 1 + static_cast<int>(rng() % static_cast<unsigned>(cfg.products));
+                    int qty = 1 + static_cast<int>(rng() % 3);
+                    shop.addToCart(cartId, pid, qty);
+                    ++lines;
+                }
+                sched.log("checkout of " + to_string(lines) + " lines");
+                try {
+                    Order o = shop.checkout(cartId, gateway);
+                    for (auto &ci : o.getItems()) sold[static_cast<size_t>(ci.product.getId())] += ci.quantity;
+                    returned.push_back(o.getId());
+                    orderCents += llround(o.getAmount() * 100);
+                    lines = 0;
+                    sched.log("checkout ok");
+                } catch (const ShopException &e) {
+                    sched.log(string("checkout failed: ") + e.what());
+                    size_t kept = shop.cart(cartId).getItems().size();
+                    if (kept != lines)
+                        violations.push_back("customer " + to_string(c) + " lost its cart on '" + e.what() + "' (" +
+                                             to_string(kept) + " of " + to_string(lines) + " lines kept)");
+                    lines = kept;
+                    if (rng() % 2) { shop.clearCart(cartId); lines = 0; }
+                }
+            }
+        });
+    }
+    sched.spawn("restocker", [&](mt19937_64 &rng) {
+        for (int r = 0; r < cfg.sessions; ++r) {
+            sched.sleep(500 + rng() % 3000);
+            int pid = 1 + static_cast<int>(rng() % static_cast<unsigned>(cfg.products));
+            int qty = 1 + static_cast<int>(rng() % 4);
+            inv.restock(pid, qty);
+            restocked[static_cast<size_t>(pid)] += qty;
+            sched.log("restock " + to_string(pid) + " +" + to_string(qty));
+        }
+    });
+    sched.run();
+
+    for (int id = 1; id <= cfg.products; ++id) {
+        long expected = cfg.stock + restocked[static_cast<size_t>(id)] - sold[static_cast<size_t>(id)];
+        int actual = inv.getProduct(id).getStock();
+        if (actual != expected || actual < 0)
+            violations.push_back("product " + to_string(id) + " has stock " + to_string(actual) + ", expected " + to_string(expected));
+    }
+    if (gateway.approvedCents != orderCents)
+        violations.push_back("gateway charged " + to_string(gateway.approvedCents) + " cents but orders total " + to_string(orderCents));
+    vector<int> durable = disk.durable;
+    sort(durable.begin(), durable.end());
+    sort(returned.begin(), returned.end());
+    if (durable != returned)
+        violations.push_back(to_string(returned.size()) + " orders returned but " + to_string(durable.size()) + " journaled");
+    for (int c = 0; c < cfg.customers; ++c) shop.clearCart(1000 + c);
+    return {violations, sched.trace(), sched.traceHash()};
+}
+
+int main(int argc, char **argv) {
+    map<string, string> options;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        size_t eq = a.find('=');
+        if (a.rfind("--", 0) != 0) { cerr << "Unexpected argument " << a << endl; return 1; }
+        options[a.substr(2, eq == string::npos ? string::npos : eq - 2)] = eq == string::npos ? "" : a.substr(eq + 1);
+    }
+    auto option = [&](const string &name, const string &def) { auto it = options.find(name); return it != options.end() ? it->second : def; };
+    SimConfig cfg;
+    cfg.customers = stoi(option("customers", to_string(cfg.customers)));
+    cfg.sessions = stoi(option("sessions", to_string(cfg.sessions)));
+    cfg.products = stoi(option("products", to_string(cfg.products)));
+    cfg.stock = stoi(option("stock", to_string(cfg.stock)));
+    cfg.decline = stod(option("decline", to_string(cfg.decline)));
+    cfg.diskFaults = stod(option("disk-faults", to_string(cfg.diskFaults)));
+    ShopMetrics::enabled = false;
+
+    auto printTrace = [](const SimOutcome &o) { for (auto &e : o.trace) cout << "  " << e << '\n'; };
+    if (options.count("seed")) {
+        uint64_t seed = stoull(options["seed"]);
+        SimOutcome o = simulate(cfg, seed);
+        printTrace(o);
+        for (auto &v : o.violations) cout << "VIOLATION: " << v << '\n';
+        cout << "seed " << seed << ": " << o.trace.size() << " events, trace hash " << hex << o.hash << dec << '\n';
+        return o.violations.empty() ? 0 : 1;
+    }
+
+    uint64_t first = stoull(option("first-seed", "1"));
+    int seeds = stoi(option("seeds", "200"));
+    size_t events = 0;
+    for (uint64_t seed = first; seed < first + static_cast<uint64_t>(seeds); ++seed) {
+        SimOutcome o = simulate(cfg, seed);
+        events += o.trace.size();
+        if (o.violations.empty()) continue;
+        SimOutcome again = simulate(cfg, seed);
+        printTrace(o);
+        for (auto &v : o.violations) cout << "VIOLATION: " << v << '\n';
+        cout << "seed " << seed << " failed; replay " << (again.hash == o.hash ? "reproduced the identical trace" : "DIVERGED")
+             << ". Rerun with --seed=" << seed << " and the same options.\n";
+        return 1;
+    }
+    cout << seeds << " seeds, " << events << " scheduling events: all invariants held\n";
+    return 0;
+}
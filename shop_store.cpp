@@ -0,0 +1,423 @@
+// shop_store.cpp
+
+#include "shop_store.hpp"
+
+void runStoreBench(const string &dir, long keys, int valueBytes) {
+    LsmOptions opts;
+    opts.memtableBytes = 1 << 20; // small memtables so the run goes through flushes and compactions
+    LsmStore store(dir, opts);
+    auto key = [](long i) { char k[24]; snprintf(k, sizeof k, "k/%012ld", i); return string(k); };
+    vector<long> order(static_cast<size_t>(keys));
+    iota(order.begin(), order.end(), 0L);
+    mt19937_64 rng(42);
+    shuffle(order.begin(), order.end(), rng);
+    string value(static_cast<size_t>(valueBytes), 'v');
+
+    auto start = chrono::steady_clock::now();
+    for (long i : order) store.put(key(i), value);
+    store.flush();
+    double writeSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    store.settle();
+
+    long probes = min(keys, 200000L), found = 0;
+    start = chrono::steady_clock::now();
+    for (long i = 0; i < probes; ++i) found += store.get(key(static_cast<long>(rng() % static_cast<uint64_t>(keys)))).has_value();
+    double hitSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    for (long i = 0; i < probes; ++i) found += store.get(key(keys + i)).has_value();
+    double missSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    long scanned = 0;
+    start = chrono::steady_clock::now();
+    store.scan("k/", [&](const string&, const string&) { ++scanned; });
+    double scanSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << fixed << setprecision(0)
+         << keys << " puts of " << valueBytes << " B: " << keys / writeSecs << " puts/s (incl. final flush)\n"
+         << probes << " random hits: " << probes / hitSecs << " gets/s; " << probes << " misses: " << probes / missSecs << " gets/s\n"
+         << "full scan of " << scanned << " keys: " << scanned / scanSecs << " keys/s\n"
+         << (found == probes ? "all hits found, no misses returned" : "MISMATCH: " + to_string(found) + " of " + to_string(probes) + " found") << "\n"
+         << store.statsJson() << endl;
+}
+
+int runVerify(const string &path) {
+    IntegrityReport r;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) throw ShopException("Cannot stat " + path);
+    if (S_ISDIR(st.st_mode)) {
+        r = LsmStore::verify(path);
+    } else {
+        ifstream in(path, ios::binary);
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        r = data.rfind("#shop-journal", 0) == 0 ? checkJournal(data) : checkSnapshot(data);
+    }
+    cout << path << ": " << r.kind << ", " << r.records << " records in " << r.blocks << " intact blocks"
+         << (r.ok() ? ", all checksums match" : "") << endl;
+    for (auto &p : r.problems) cout << "  " << p << endl;
+    return r.ok() ? 0 : 2;
+}
+
+void runCheckpointBench(const string &file, int products, int writers) {
+    Inventory &inv = Inventory::instance();
+    for (int id = 1; id <= products; ++id) inv.addProduct(Product(id, "Product " + to_string(id), 1.0 + id % 100, 1000));
+
+    // Writers record their worst single-operation latency; the main thread resets it per phase.
+    atomic<bool> stop{false};
+    atomic<long> worstNs{0}, ops{0};
+    vector<thread> pool;
+    for (int w = 0; w < writers; ++w)
+        pool.emplace_back([&, w] {
+            mt19937 rng(static_cast<unsigned>(w + 1));
+            while (!stop) {
+                int id = static_cast<int>(rng() % static_cast<unsigned>(products)) + 1;
+                auto t0 = chrono::steady_clock::now();
+                if (inv.reduceStock(id, 1)) inv.restock(id, 1);
+                long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+                for (long cur = worstNs; ns > cur && !worstNs.compare_exchange_weak(cur, ns);) {}
+                ++ops;
+            }
+        });
+    auto phase = [&](const char *name, const function<void()> &body) {
+        this_thread::sleep_for(chrono::milliseconds(200));
+        worstNs = 0;
+        long before = ops;
+        auto start = chrono::steady_clock::now();
+        body();
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << fixed << setprecision(1) << name << ": " << secs * 1e3 << " ms, writers did " << ops - before
+             << " ops, worst writer stall " << worstNs / 1e3 << " us" << endl;
+    };
+
+    cout << products << " products, " << writers << " writers" << endl;
+    phase("idle (200 ms)", [] { this_thread::sleep_for(chrono::milliseconds(200)); });
+    phase("saveToFile", [&] { inv.saveToFile(file); });
+    phase("checkpoint (until child exits)", [&] {
+        double pauseUs;
+        pid_t pid = inv.checkpoint(file, &pauseUs);
+        cout << fixed << setprecision(1) << "  fork pause " << pauseUs << " us" << endl;
+        if (!Inventory::waitCheckpoint(pid)) cout << "  checkpoint child FAILED" << endl;
+    });
+    stop = true;
+    for (auto &t : pool) t.join();
+}
+
+// -------------------- Product cache --------------------
+// Fixed-size read-through cache of products, split into shards that each run their own
+// CLOCK hand. Entries come in cold and a hit only sets a reference bit (under the shard's
+// read lock). When a shard is full its hand evicts unreferenced cold entries, promotes
+// referenced ones to hot, and leaves hot entries alone until the hot set outgrows three
+// quarters of the shard. A scan touches each product once, so it only churns the cold
+// entries and the hot set survives it (CLOCK-Pro's hot/cold split, without its history of
+// recently evicted keys). Lookups that find nothing are not cached.
+class ProductCache {
+public:
+    using Loader = function<optional<Product>(int id)>;
+
+    struct Stats {
+        uint64_t hits = 0, misses = 0, evictions = 0, invalidations = 0;
+        size_t entries = 0, hot = 0, capacity = 0;
+        double hitRate() const { return hits + misses ? static_cast<double>(hits) / static_cast<double>(hits + misses) : 0.0; }
+    };
+
+private:
+    struct Slot {
+        int id = 0;
+        bool used = false, hot = false;
+        atomic<bool> ref{false};
+        Product product;
+    };
+    struct alignas(64) Shard {
+        mutable shared_mutex mtx;
+        vector<Slot> slots;
+        unordered_map<int, uint32_t> index;
+        vector<uint32_t> freeSlots;
+        size_t hand = 0, hotCount = 0;
+        uint64_t generation = 0; // bumped by every invalidation
+        int64_t nameBytes = 0;
+        atomic<uint64_t> hits{0}, misses{0}, evictions{0}, invalidations{0};
+    };
+
+    Loader load;
+    vector<unique_ptr<Shard>> shards;
+    int64_t fixedBytes = 0;
+
+    Shard& shardOf(int id) const { return *shards[(static_cast<uint32_t>(id) * 2654435761u >> 8) % shards.size()]; }
+
+    void chargeName(Shard &s, const Product &p, int sign) {
+        int64_t n = sign * static_cast<int64_t>(p.nameHeapBytes());
+        s.nameBytes += n;
+        MemoryAccounting::instance().charge(MemTag::Caches, n);
+    }
+
+    // Caller holds s.mtx exclusively and the shard is full.
+    uint32_t evict(Shard &s) {
+        size_t n = s.slots.size(), hotLimit = n * 3 / 4;
+        for (;;) {
+            uint32_t i = static_cast<uint32_t>(s.hand);
+            s.hand = (s.hand + 1) % n;
+            Slot &sl = s.slots[i];
+            if (!sl.used) continue;
+            bool ref = sl.ref.exchange(false, memory_order_relaxed);
+            if (sl.hot) {
+                if (!ref && s.hotCount > hotLimit) { sl.hot = false; --s.hotCount; }
+                continue;
+            }
+            if (ref) { sl.hot = true; ++s.hotCount; continue; }
+            s.index.erase(sl.id);
+            chargeName(s, sl.product, -1);
+            sl.used = false;
+            s.evictions.fetch_add(1, memory_order_relaxed);
+            return i;
+        }
+    }
+
+    void insert(Shard &s, const Product &p) { // caller holds s.mtx exclusively
+        uint32_t i;
+        if (!s.freeSlots.empty()) { i = s.freeSlots.back(); s.freeSlots.pop_back(); }
+        else i = evict(s);
+        Slot &sl = s.slots[i];
+        sl.id = p.getId();
+        sl.used = true;
+        sl.hot = false;
+        sl.ref.store(false, memory_order_relaxed);
+        sl.product = p;
+        chargeName(s, sl.product, 1);
+        s.index.emplace(sl.id, i);
+    }
+
+public:
+    // capacity is split evenly across the shards (at least one entry each).
+    ProductCache(size_t capacity, Loader loader, size_t shardCount = 16) : load(move(loader)) {
+        shardCount = max<size_t>(1, shardCount);
+        size_t perShard = max<size_t>(1, (capacity + shardCount - 1) / shardCount);
+        for (size_t i = 0; i < shardCount; ++i) {
+            auto s = make_unique<Shard>();
+            s->slots = vector<Slot>(perShard);
+            s->index.reserve(perShard);
+            s->freeSlots.resize(perShard);
+            for (size_t j = 0; j < perShard; ++j) s->freeSlots[j] = static_cast<uint32_t>(perShard - 1 - j);
+            shards.push_back(move(s));
+        }
+        fixedBytes = static_cast<int64_t>(shardCount * (sizeof(Shard) + perShard * (sizeof(Slot) + sizeof(uint32_t) +
+                                                         sizeof(pair<const int, uint32_t>) + 3 * sizeof(void*))));
+        MemoryAccounting::instance().charge(MemTag::Caches, fixedBytes);
+    }
+    ProductCache(const ProductCache&) = delete;
+    ProductCache& operator=(const ProductCache&) = delete;
+    ~ProductCache() {
+        int64_t names = 0;
+        for (auto &s : shards) names += s->nameBytes;
+        MemoryAccounting::instance().charge(MemTag::Caches, -fixedBytes - names);
+    }
+
+    optional<Product> get(int id) {
+        Shard &s = shardOf(id);
+        uint64_t generation;
+        {
+            shared_lock<shared_mutex> lk(s.mtx);
+            auto it = s.index.find(id);
+            if (it != s.index.end()) {
+                Slot &sl = s.slots[it->second];
+                if (!sl.ref.load(memory_order_relaxed)) sl.ref.store(true, memory_order_relaxed);
+                s.hits.fetch_add(1, memory_order_relaxed);
+                return sl.product;
+            }
+            generation = s.generation;
+        }
+        s.misses.fetch_add(1, memory_order_relaxed);
+        optional<Product> p = load(id);
+        if (!p) return p;
+        unique_lock<shared_mutex> lk(s.mtx);
+        // An invalidation since the load may have raced with it; skip caching what was read.
+        if (s.generation == generation && s.index.find(id) == s.index.end()) insert(s, *p);
+        return p;
+    }
+
+    // Drops id's entry; the next get reloads it. Call after the backing record has changed.
+    void invalidate(int id) {
+        Shard &s = shardOf(id);
+        unique_lock<shared_mutex> lk(s.mtx);
+        ++s.generation;
+        s.invalidations.fetch_add(1, memory_order_relaxed);
+        auto it = s.index.find(id);
+        if (it == s.index.end()) return;
+        Slot &sl = s.slots[it->second];
+        if (sl.hot) --s.hotCount;
+        chargeName(s, sl.product, -1);
+        sl.used = false;
+        s.freeSlots.push_back(it->second);
+        s.index.erase(it);
+    }
+
+    Stats stats() const {
+        Stats st;
+        for (auto &s : shards) {
+            shared_lock<shared_mutex> lk(s->mtx);
+            st.hits += s->hits.load(memory_order_relaxed);
+            st.misses += s->misses.load(memory_order_relaxed);
+            st.evictions += s->evictions.load(memory_order_relaxed);
+            st.invalidations += s->invalidations.load(memory_order_relaxed);
+            st.entries += s->index.size();
+            st.hot += s->hotCount;
+            st.capacity += s->slots.size();
+        }
+        return st;
+    }
+
+    string statsJson() const {
+        Stats st = stats();
+        char buf[256];
+        snprintf(buf, sizeof buf, "{\"capacity\":%zu,\"entries\":%zu,\"hot\":%zu,\"hits\":%llu,\"misses\":%llu,\"hit_rate\":%.4f,"
+                 "\"evictions\":%llu,\"invalidations\":%llu}", st.capacity, st.entries, st.hot,
+                 static_cast<unsigned long long>(st.hits), static_cast<unsigned long long>(st.misses), st.hitRate(),
+                 static_cast<unsigned long long>(st.evictions), static_cast<unsigned long long>(st.invalidations));
+        return buf;
+    }
+};
+
+// -------------------- Store-backed catalog --------------------
+// The cache benchmark's model of a catalog that does not fit in memory: kept only in a
+// KvStore, in the p/<id> records Inventory::attachStore uses. Reads go through a
+// ProductCache; writes go to the store and then invalidate the cached copy. Writers of one product serialize on a striped
+// lock so read-modify-write updates (stock) are not lost.
+class StoreCatalog {
+private:
+    KvStore &store;
+    array<mutex, 64> stripes;
+    ProductCache cache;
+
+    Expected<void> update(int id, const function<Expected<void>(Product&)> &change) {
+        lock_guard<mutex> lk(stripes[static_cast<uint32_t>(id) % stripes.size()]);
+        optional<Product> p = readStore(id);
+        if (!p) return ShopError::NotFound;
+        Expected<void> r = change(*p);
+        if (!r) return r;
+        store.put(Inventory::productKey(id), Inventory::encodeProduct(*p));
+        cache.invalidate(id);
+        return r;
+    }
+
+public:
+    StoreCatalog(KvStore &s, size_t cacheEntries, size_t shards = 16)
+        : store(s), cache(cacheEntries, [this](int id) { return readStore(id); }, shards) {}
+
+    // Reads the record straight from the store, bypassing (and not filling) the cache.
+    optional<Product> readStore(int id) {
+        string key = Inventory::productKey(id);
+        optional<string> v = store.get(key);
+        if (!v) return nullopt;
+        optional<Product> p = Inventory::decodeProduct(key, *v);
+        if (!p) throw ShopException("Corrupt product record " + key);
+        return p;
+    }
+
+    void addProduct(const Product &p) {
+        lock_guard<mutex> lk(stripes[static_cast<uint32_t>(p.getId()) % stripes.size()]);
+        store.put(Inventory::productKey(p.getId()), Inventory::encodeProduct(p));
+        cache.invalidate(p.getId());
+    }
+
+    Expected<Product> tryGetProduct(int id) {
+        OpTimer timer(Metric::GetProduct);
+        optional<Product> p = cache.get(id);
+        if (!p) { timer.fail(); return ShopError::NotFound; }
+        return *p;
+    }
+    Product getProduct(int id) { return tryGetProduct(id).value(); }
+
+    Expected<void> trySetPrice(int id, double price) { return update(id, [&](Product &p) { return p.trySetPrice(price); }); }
+    Expected<void> trySetStock(int id, int stock) { return update(id, [&](Product &p) { return p.trySetStock(stock); }); }
+    void setPrice(int id, double price) { trySetPrice(id, price).value(); }
+    void setStock(int id, int stock) { trySetStock(id, stock).value(); }
+
+    bool reduceStock(int id, int qty) {
+        OpTimer timer(Metric::ReduceStock);
+        bool ok = static_cast<bool>(update(id, [&](Product &p) -> Expected<void> {
+            if (!p.reduceStock(qty)) return ShopError::InvalidQuantity;
+            return {};
+        }));
+        if (!ok) timer.fail();
+        return ok;
+    }
+
+    const ProductCache& productCache() const { return cache; }
+};
+
+void runCacheBench(const string &dir, int products, size_t cacheEntries, long lookups) {
+    LsmStore store(dir);
+    StoreCatalog catalog(store, cacheEntries);
+    for (int id = 1; id <= products; ++id) catalog.addProduct(Product(id, "Product " + to_string(id), 1.0 + id % 100, 1000));
+    store.flush();
+    store.settle();
+
+    // Roughly Zipf(1): ids spread evenly in log space, so product k is about 1/k as popular as product 1.
+    mt19937_64 rng(7);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    double logN = log(static_cast<double>(products) + 1.0);
+    auto skewed = [&] { return min(products, max(1, static_cast<int>(exp(unit(rng) * logN)))); };
+    auto timed = [](const function<void()> &body) {
+        auto start = chrono::steady_clock::now();
+        body();
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    // Hit rate of the lookups body makes, from the cache's own counters.
+    auto hitRate = [&](const function<void()> &body) {
+        ProductCache::Stats before = catalog.productCache().stats();
+        body();
+        ProductCache::Stats after = catalog.productCache().stats();
+        double hits = static_cast<double>(after.hits - before.hits), all = hits + static_cast<double>(after.misses - before.misses);
+        return all > 0 ? hits / all : 0.0;
+    };
+
+    long found = 0;
+    double directSecs = timed([&] {
+        for (long i = 0; i < lookups; ++i) found += catalog.readStore(skewed()).has_value();
+    });
+    double warm = 0, cachedSecs = timed([&] {
+        warm = hitRate([&] { for (long i = 0; i < lookups; ++i) found += catalog.tryGetProduct(skewed()).has_value(); });
+    });
+    long window = min(lookups, 100000L);
+    double steady = hitRate([&] { for (long i = 0; i < window; ++i) catalog.tryGetProduct(skewed()); });
+    double scanSecs = timed([&] { for (int id = 1; id <= products; ++id) catalog.tryGetProduct(id); });
+    double afterScan = hitRate([&] { for (long i = 0; i < window; ++i) catalog.tryGetProduct(skewed()); });
+
+    cout << fixed << setprecision(0) << products << " products, cache of " << catalog.productCache().stats().capacity << " entries" << endl
+         << lookups << " skewed lookups: store " << lookups / directSecs << "/s, cached " << lookups / cachedSecs << "/s ("
+         << setprecision(1) << 100 * warm << "% hits from cold)" << endl
+         << "hit rate " << 100 * steady << "% before a full scan (" << setprecision(0) << products / scanSecs << " ids/s), "
+         << setprecision(1) << 100 * afterScan << "% right after it" << endl;
+
+    // Readers must never see a price go backwards or miss the final one; concurrent sellers
+    // must sell exactly the stock of product 1.
+    const int readers = 3, hotIds = 16, rounds = 2000;
+    atomic<bool> stop{false}, stale{false};
+    atomic<long> sold{0};
+    catalog.setStock(1, 5000);
+    vector<thread> pool;
+    for (int r = 0; r < readers; ++r)
+        pool.emplace_back([&] {
+            vector<double> seen(hotIds + 1, 0.0);
+            while (!stop)
+                for (int id = 1; id <= hotIds; ++id) {
+                    double price = catalog.getProduct(id).getPrice();
+                    if (price < seen[static_cast<size_t>(id)]) stale = true;
+                    seen[static_cast<size_t>(id)] = price;
+                }
+        });
+    for (int s = 0; s < 2; ++s)
+        pool.emplace_back([&] { while (catalog.reduceStock(1, 1)) ++sold; });
+    vector<double> last(hotIds + 1, 0.0);
+    for (int round = 1; round <= rounds; ++round) {
+        int id = round % hotIds + 1;
+        catalog.setPrice(id, last[static_cast<size_t>(id)] = 1000.0 + round);
+    }
+    stop = true;
+    for (auto &t : pool) t.join();
+    for (int id = 1; id <= hotIds; ++id)
+        if (catalog.getProduct(id).getPrice() != last[static_cast<size_t>(id)]) stale = true;
+    bool stockOk = sold == 5000 && catalog.getProduct(1).getStock() == 0;
+    cout << (stale ? "STALE READ after setPrice" : "no stale reads across setPrice") << "; "
+         << (stockOk ? "concurrent sellers sold exactly the stock" : "STOCK MISMATCH: sold " + to_string(sold.load())) << endl
+         << catalog.productCache().statsJson() << endl
+         << "caches: " << MemoryAccounting::instance().bytes(MemTag::Caches) << " bytes charged" << endl;
+}
@@ -0,0 +1,833 @@
+// shop_store.hpp
+// Embedded log-structured key-value store: a write-ahead log and in-memory memtable in
+// front of sorted, immutable segment files with sparse indexes and bloom filters. A
+// background thread flushes full memtables and compacts segments, so every disk write
+// is sequential. Inventory (attachStore) and LsmJournal sit on top of it. The checkpoint
+// benchmark lives here too, next to the other persistence paths.
+
+#ifndef SHOP_STORE_HPP
+#define SHOP_STORE_HPP
+
+#include "shop_core.hpp"
+#include <dirent.h>
+#include <sys/stat.h>
+
+// -------------------- Encoding --------------------
+using LsmValue = optional<string>; // nullopt = tombstone
+
+// Entries are {u32 keyLen, u32 valueLen (~0u for a tombstone), key, value}, native endian,
+// in both the write-ahead log and segment data blocks. Log records prefix an entry with the
+// CRC32C of its bytes.
+enum class LsmRecord { Ok, Torn, Corrupt };
+
+struct LsmCodec {
+    static constexpr uint32_t tombstone = ~0u;
+
+    template<class T> static void put(string &out, T v) { out.append(reinterpret_cast<const char*>(&v), sizeof v); }
+    template<class T> static T get(const char *p) { T v; memcpy(&v, p, sizeof v); return v; }
+
+    static void putEntry(string &out, const string &key, const LsmValue &v) {
+        put(out, static_cast<uint32_t>(key.size()));
+        put(out, v ? static_cast<uint32_t>(v->size()) : tombstone);
+        out += key;
+        if (v) out += *v;
+    }
+
+    // Parses one entry at data[pos]; false if the bytes left do not hold a whole entry.
+    static bool getEntry(const string &data, size_t &pos, string &key, LsmValue &v) {
+        if (data.size() - pos < 2 * sizeof(uint32_t)) return false;
+        uint32_t klen = get<uint32_t>(data.data() + pos), vlen = get<uint32_t>(data.data() + pos + 4);
+        size_t need = 8 + klen + (vlen == tombstone ? 0 : vlen);
+        if (data.size() - pos < need) return false;
+        key.assign(data, pos + 8, klen);
+        if (vlen == tombstone) v.reset(); else v.emplace(data, pos + 8 + klen, vlen);
+        pos += need;
+        return true;
+    }
+
+    static void putRecord(string &out, const string &key, const LsmValue &v) {
+        size_t start = out.size();
+        put(out, uint32_t{0});
+        putEntry(out, key, v);
+        uint32_t crc = Crc32c::of(out.data() + start + 4, out.size() - start - 4);
+        memcpy(&out[start], &crc, sizeof crc);
+    }
+
+    // Torn: the bytes left are not a whole record (a write cut short by a crash).
+    static LsmRecord getRecord(const string &data, size_t &pos, string &key, LsmValue &v) {
+        size_t p = pos + 4;
+        if (data.size() - pos < 4 || !getEntry(data, p, key, v)) return LsmRecord::Torn;
+        if (get<uint32_t>(data.data() + pos) != Crc32c::of(data.data() + pos + 4, p - pos - 4)) return LsmRecord::Corrupt;
+        pos = p;
+        return LsmRecord::Ok;
+    }
+
+    static void writeAll(int fd, const string &data, const string &what) {
+        for (size_t done = 0; done < data.size();) {
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw ShopException("Write to " + what + " failed");
+            done += static_cast<size_t>(n);
+        }
+    }
+
+    static string readAt(int fd, uint64_t offset, size_t len, const string &what) {
+        string buf(len, '\0');
+        for (size_t done = 0; done < len;) {
+            ssize_t n = pread(fd, &buf[done], len - done, static_cast<off_t>(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw ShopException("Read from " + what + " failed");
+            done += static_cast<size_t>(n);
+        }
+        return buf;
+    }
+};
+
+// -------------------- Bloom filter --------------------
+// ~10 bits per key, k = 7 probes by double hashing: about 1% false positives.
+class BloomFilter {
+private:
+    vector<uint64_t> words;
+    uint32_t probes = 0;
+
+    static uint64_t hash(const string &key) {
+        uint64_t h = 1469598103934665603ULL; // FNV-1a, then a murmur-style finalizer
+        for (char ch : key) { h ^= static_cast<unsigned char>(ch); h *= 1099511628211ULL; }
+        h ^= h >> 33; h *= 0xff51afd7ed558ccdULL; h ^= h >> 33;
+        return h;
+    }
+public:
+    BloomFilter() {}
+    explicit BloomFilter(size_t keys, size_t bitsPerKey = 10)
+        : words(max<size_t>(1, (keys * bitsPerKey + 63) / 64)), probes(7) {}
+
+    void add(const string &key) {
+        uint64_t h = hash(key), delta = (h >> 32) | 1, bits = words.size() * 64;
+        for (uint32_t i = 0; i < probes; ++i, h += delta) words[(h % bits) / 64] |= 1ULL << (h % 64);
+    }
+
+    bool mayContain(const string &key) const {
+        if (words.empty()) return true;
+        uint64_t h = hash(key), delta = (h >> 32) | 1, bits = words.size() * 64;
+        for (uint32_t i = 0; i < probes; ++i, h += delta)
+            if (!(words[(h % bits) / 64] & (1ULL << (h % 64)))) return false;
+        return true;
+    }
+
+    size_t bytes() const { return words.size() * sizeof(uint64_t); }
+
+    void serialize(string &out) const {
+        LsmCodec::put(out, probes);
+        LsmCodec::put(out, static_cast<uint64_t>(words.size()));
+        out.append(reinterpret_cast<const char*>(words.data()), bytes());
+    }
+
+    bool parse(const string &in) {
+        if (in.size() < 12) return false;
+        uint64_t n = LsmCodec::get<uint64_t>(in.data() + 4);
+        if (in.size() != 12 + n * sizeof(uint64_t)) return false;
+        probes = LsmCodec::get<uint32_t>(in.data());
+        words.resize(n);
+        memcpy(words.data(), in.data() + 12, n * sizeof(uint64_t));
+        return true;
+    }
+};
+
+// -------------------- Segment files --------------------
+// seg-<n>.sst: ~4 KB data blocks of sorted entries, each followed by its u32 CRC32C, then
+// the sparse index {u32 count, per block: u32 keyLen, key, u64 offset}, the bloom filter,
+// and a footer {u64 indexOffset, u64 bloomOffset, u64 entries, u32 CRC32C of index and
+// bloom filter, u32 CRC32C of the footer so far, u64 magic}.
+static constexpr uint64_t lsmMagic = 0x32304d534c504853ULL; // "SHPLSM02"
+static constexpr size_t lsmBlockBytes = 4096;
+static constexpr size_t lsmFooterBytes = 40;
+static const string lsmWalMagic = "SHPWAL02"; // first bytes of every wal-<n>.log
+
+// Streams sorted entries into path.tmp and renames it into place once it is durable.
+class LsmSegmentWriter {
+private:
+    string path, tmp;
+    int fd;
+    string block;
+    uint64_t offset = 0, entries = 0;
+    vector<pair<string, uint64_t>> index;
+    BloomFilter bloom;
+
+    void flushBlock() {
+        LsmCodec::put(block, Crc32c::of(block));
+        LsmCodec::writeAll(fd, block, tmp);
+        offset += block.size();
+        block.clear();
+    }
+public:
+    LsmSegmentWriter(string p, size_t expectedKeys) : path(move(p)), tmp(path + ".tmp"), bloom(expectedKeys) {
+        fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw ShopException("Cannot create " + tmp);
+    }
+    LsmSegmentWriter(const LsmSegmentWriter&) = delete;
+    LsmSegmentWriter& operator=(const LsmSegmentWriter&) = delete;
+    ~LsmSegmentWriter() { if (fd >= 0) { close(fd); unlink(tmp.c_str()); } }
+
+    void add(const string &key, const LsmValue &v) {
+        if (block.empty()) index.emplace_back(key, offset);
+        LsmCodec::putEntry(block, key, v);
+        bloom.add(key);
+        ++entries;
+        if (block.size() >= lsmBlockBytes) flushBlock();
+    }
+
+    uint64_t count() const { return entries; }
+
+    void finish() {
+        if (!block.empty()) flushBlock();
+        string tail;
+        uint64_t indexOffset = offset;
+        LsmCodec::put(tail, static_cast<uint32_t>(index.size()));
+        for (auto &e : index) {
+            LsmCodec::put(tail, static_cast<uint32_t>(e.first.size()));
+            tail += e.first;
+            LsmCodec::put(tail, e.second);
+        }
+        uint64_t bloomOffset = indexOffset + tail.size();
+        bloom.serialize(tail);
+        uint32_t metaCrc = Crc32c::of(tail);
+        size_t footer = tail.size();
+        LsmCodec::put(tail, indexOffset);
+        LsmCodec::put(tail, bloomOffset);
+        LsmCodec::put(tail, entries);
+        LsmCodec::put(tail, metaCrc);
+        LsmCodec::put(tail, Crc32c::of(tail.data() + footer, tail.size() - footer));
+        LsmCodec::put(tail, lsmMagic);
+        LsmCodec::writeAll(fd, tail, tmp);
+        if (fdatasync(fd) != 0) throw ShopException("Cannot sync " + tmp);
+        close(fd);
+        fd = -1;
+        if (rename(tmp.c_str(), path.c_str()) != 0) throw ShopException("Cannot rename " + tmp);
+    }
+};
+
+// An open, immutable segment. The index and bloom filter stay in memory; blocks are read
+// with pread, so any number of threads can search one concurrently.
+class LsmSegment {
+private:
+    int fd;
+    uint64_t dataEnd = 0;
+    vector<pair<string, uint64_t>> index; // first key of each block, block offset
+    BloomFilter bloom;
+    int64_t charged = 0;
+public:
+    const uint64_t number;
+    const string path;
+    uint64_t entries = 0;
+    uint64_t bytes = 0; // file size
+
+    LsmSegment(uint64_t n, string p) : number(n), path(move(p)) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw ShopException("Cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(lsmFooterBytes)) { close(fd); throw ShopException("Truncated segment " + path); }
+        uint64_t size = static_cast<uint64_t>(st.st_size), metaEnd = size - lsmFooterBytes;
+        bytes = size;
+        string footer = LsmCodec::readAt(fd, metaEnd, lsmFooterBytes, path);
+        uint64_t indexOffset = LsmCodec::get<uint64_t>(footer.data()), bloomOffset = LsmCodec::get<uint64_t>(footer.data() + 8);
+        entries = LsmCodec::get<uint64_t>(footer.data() + 16);
+        const char *why = nullptr;
+        if (LsmCodec::get<uint64_t>(footer.data() + 32) != lsmMagic) why = "unknown format version";
+        else if (LsmCodec::get<uint32_t>(footer.data() + 28) != Crc32c::of(footer.data(), 28)) why = "footer fails its checksum";
+        else if (indexOffset > bloomOffset || bloomOffset > metaEnd) why = "footer offsets out of range";
+        string meta = why ? string() : LsmCodec::readAt(fd, indexOffset, metaEnd - indexOffset, path);
+        if (!why && LsmCodec::get<uint32_t>(footer.data() + 24) != Crc32c::of(meta)) why = "index or bloom filter fails its checksum";
+        if (why) {
+            close(fd);
+            throw ShopException("Corrupt segment " + path + ": " + why);
+        }
+        dataEnd = indexOffset;
+        string idx = meta.substr(0, bloomOffset - indexOffset);
+        size_t pos = 4;
+        uint32_t blocks = idx.size() >= 4 ? LsmCodec::get<uint32_t>(idx.data()) : 0;
+        for (uint32_t i = 0; i < blocks && pos + 4 <= idx.size(); ++i) {
+            uint32_t klen = LsmCodec::get<uint32_t>(idx.data() + pos);
+            if (pos + 4 + klen + 8 > idx.size()) break;
+            index.emplace_back(idx.substr(pos + 4, klen), LsmCodec::get<uint64_t>(idx.data() + pos + 4 + klen));
+            pos += 4 + klen + 8;
+        }
+        if (index.size() != blocks || !bloom.parse(meta.substr(bloomOffset - indexOffset))) {
+            close(fd);
+            throw ShopException("Corrupt segment " + path);
+        }
+        charged = static_cast<int64_t>(bloom.bytes());
+        for (auto &e : index) charged += static_cast<int64_t>(e.first.capacity() + sizeof e);
+        MemoryAccounting::instance().charge(MemTag::Indexes, charged);
+    }
+    LsmSegment(const LsmSegment&) = delete;
+    LsmSegment& operator=(const LsmSegment&) = delete;
+    ~LsmSegment() {
+        close(fd);
+        MemoryAccounting::instance().charge(MemTag::Indexes, -charged);
+    }
+
+    bool mayContain(const string &key) const { return bloom.mayContain(key); }
+    size_t blockCount() const { return index.size(); }
+
+    // Block that would hold key (0 if key sorts before every block).
+    size_t blockFor(const string &key) const {
+        auto it = upper_bound(index.begin(), index.end(), key, [](const string &k, const pair<string, uint64_t> &e) { return k < e.first; });
+        return it == index.begin() ? 0 : static_cast<size_t>(it - index.begin() - 1);
+    }
+
+    // Throws if the block fails its checksum, naming the block and its offset.
+    string readBlock(size_t i) const {
+        uint64_t end = i + 1 < index.size() ? index[i + 1].second : dataEnd;
+        string block = end - index[i].second >= 4 ? LsmCodec::readAt(fd, index[i].second, end - index[i].second, path) : string();
+        if (block.size() < 4 || LsmCodec::get<uint32_t>(block.data() + block.size() - 4) != Crc32c::of(block.data(), block.size() - 4))
+            throw ShopException("Corrupt segment " + path + ": block " + to_string(i) + " at offset " + to_string(index[i].second) + " fails its checksum");
+        block.resize(block.size() - 4);
+        return block;
+    }
+
+    // nullopt: the segment has nothing for key; otherwise the value or tombstone it holds.
+    optional<LsmValue> find(const string &key) const {
+        if (index.empty() || key < index.front().first) return nullopt;
+        string block = readBlock(blockFor(key));
+        string k;
+        LsmValue v;
+        for (size_t pos = 0; LsmCodec::getEntry(block, pos, k, v);) {
+            if (k == key) return v;
+            if (k > key) break;
+        }
+        return nullopt;
+    }
+};
+
+// -------------------- Cursors --------------------
+class LsmCursor {
+public:
+    virtual ~LsmCursor() = default;
+    virtual bool valid() const = 0;
+    virtual const string& key() const = 0;
+    virtual const LsmValue& value() const = 0;
+    virtual void next() = 0;
+};
+
+using LsmMap = map<string, LsmValue, less<>>;
+
+class MapCursor : public LsmCursor {
+private:
+    LsmMap::const_iterator it, end;
+public:
+    MapCursor(const LsmMap &m, const string &from) : it(m.lower_bound(from)), end(m.end()) {}
+    bool valid() const override { return it != end; }
+    const string& key() const override { return it->first; }
+    const LsmValue& value() const override { return it->second; }
+    void next() override { ++it; }
+};
+
+class SegmentCursor : public LsmCursor {
+private:
+    shared_ptr<const LsmSegment> seg;
+    size_t blockIdx;
+    string block;
+    size_t pos = 0;
+    string k;
+    LsmValue v;
+    bool ok = false;
+
+    void advance() {
+        while (!LsmCodec::getEntry(block, pos, k, v)) {
+            if (++blockIdx >= seg->blockCount()) { ok = false; return; }
+            block = seg->readBlock(blockIdx);
+            pos = 0;
+        }
+        ok = true;
+    }
+public:
+    SegmentCursor(shared_ptr<const LsmSegment> s, const string &from) : seg(move(s)), blockIdx(seg->blockFor(from)) {
+        if (blockIdx >= seg->blockCount()) return;
+        block = seg->readBlock(blockIdx);
+        advance();
+        while (ok && k < from) advance();
+    }
+    bool valid() const override { return ok; }
+    const string& key() const override { return k; }
+    const LsmValue& value() const override { return v; }
+    void next() override { advance(); }
+};
+
+// Sorted union of sources given newest first; when several hold a key the newest wins.
+class MergeCursor : public LsmCursor {
+private:
+    vector<unique_ptr<LsmCursor>> sources;
+    int current = -1;
+
+    void pick() {
+        current = -1;
+        for (size_t i = 0; i < sources.size(); ++i)
+            if (sources[i]->valid() && (current < 0 || sources[i]->key() < sources[static_cast<size_t>(current)]->key()))
+                current = static_cast<int>(i);
+    }
+public:
+    explicit MergeCursor(vector<unique_ptr<LsmCursor>> s) : sources(move(s)) { pick(); }
+    bool valid() const override { return current >= 0; }
+    const string& key() const override { return sources[static_cast<size_t>(current)]->key(); }
+    const LsmValue& value() const override { return sources[static_cast<size_t>(current)]->value(); }
+    void next() override {
+        string k = key();
+        for (auto &s : sources) if (s->valid() && s->key() == k) s->next();
+        pick();
+    }
+};
+
+// -------------------- LSM store --------------------
+struct LsmOptions {
+    size_t memtableBytes = 4 << 20; // freeze and flush the memtable past this size
+    size_t compactTrigger = 4;      // merge a tier once it has this many segments
+    double tierSpread = 2.0;        // segments within this size ratio of each other share a tier
+    size_t smallSegmentBytes = 1 << 20; // segments below this size all share the lowest tier
+    size_t maxImmutables = 4;       // writers stall while this many memtables await flushing
+};
+
+// Directory layout: MANIFEST (live segments, newest first), seg-<n>.sst, and wal-<n>.log
+// for the active memtable. Writes go to the WAL and the memtable; a full memtable is frozen
+// and flushed to a new segment by the background thread. Compaction is size-tiered: once
+// compactTrigger adjacent segments are of similar size the thread merges them into one,
+// so each key is rewritten about once per tier rather than on every merge. Tombstones are
+// dropped only when the merge includes the oldest segment, as nothing older can hold a
+// value they still have to hide.
+class LsmStore : public KvStore {
+private:
+    struct Memtable {
+        LsmMap data;
+        size_t bytes = 0;
+        uint64_t walNumber = 0;
+    };
+
+    string dir;
+    LsmOptions opts;
+    mutable mutex mtx;
+    condition_variable cv;
+    shared_ptr<Memtable> active;
+    int walFd = -1;
+    off_t walBytes = 0; // length of the active log's intact records
+    deque<shared_ptr<const Memtable>> immutables;   // newest first
+    vector<shared_ptr<const LsmSegment>> segments;  // newest first
+    uint64_t nextFile = 1;
+    bool stopping = false;
+    bool busy = false; // background thread is flushing or compacting
+    thread worker;
+    atomic<uint64_t> flushes{0}, compactions{0}, bloomSkips{0}, segmentProbes{0};
+
+    static string fileIn(const string &dir, const char *prefix, uint64_t n, const char *ext) {
+        char name[64];
+        snprintf(name, sizeof name, "%s%06llu%s", prefix, static_cast<unsigned long long>(n), ext);
+        return dir + "/" + name;
+    }
+    string file(const char *prefix, uint64_t n, const char *ext) const { return fileIn(dir, prefix, n, ext); }
+
+    // Live segment numbers, newest first; next receives the file counter. The last line,
+    // "crc <crc32c>", covers the lines above it. A missing MANIFEST is an empty store.
+    static vector<uint64_t> readManifest(const string &dir, uint64_t &next) {
+        vector<uint64_t> segs;
+        ifstream in(dir + "/MANIFEST");
+        if (!in) return segs;
+        string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        size_t crcLine = text.rfind("crc ");
+        unsigned crc;
+        if (crcLine == string::npos || sscanf(text.c_str() + crcLine, "crc %x", &crc) != 1 || crc != Crc32c::of(text.data(), crcLine))
+            throw ShopException("Corrupt MANIFEST in " + dir + ": checksum mismatch");
+        istringstream lines(text.substr(0, crcLine));
+        string word;
+        uint64_t n;
+        while (lines >> word >> n) {
+            if (word == "next") next = max(next, n);
+            else if (word == "seg") segs.push_back(n);
+        }
+        return segs;
+    }
+
+    void openWal() { // caller holds mtx (or is the constructor)
+        active = make_shared<Memtable>();
+        active->walNumber = nextFile++;
+        string path = file("wal-", active->walNumber, ".log");
+        walFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (walFd < 0) throw ShopException("Cannot open " + path);
+        LsmCodec::writeAll(walFd, lsmWalMagic, path);
+        walBytes = static_cast<off_t>(lsmWalMagic.size());
+    }
+
+    // Calls fn for each intact record of a log. Stops at a torn tail (a crash mid-write) or
+    // at the first record that fails its checksum, reporting anything dropped.
+    static void walkWal(const string &path, IntegrityReport &report, const function<void(const string&, const LsmValue&)> &fn) {
+        ifstream in(path, ios::binary);
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        string name = path.substr(path.rfind('/') + 1), k;
+        LsmValue v;
+        if (data.compare(0, lsmWalMagic.size(), lsmWalMagic) != 0) {
+            if (!data.empty()) report.problems.push_back(name + ": not a version-2 log, ignored");
+            return;
+        }
+        size_t pos = lsmWalMagic.size(), count = 0;
+        for (LsmRecord r; (r = LsmCodec::getRecord(data, pos, k, v)) != LsmRecord::Torn || pos < data.size(); ++count, ++report.records) {
+            if (r != LsmRecord::Ok) {
+                report.problems.push_back(name + ": record " + to_string(count + 1) + " at offset " + to_string(pos) +
+                                          (r == LsmRecord::Corrupt ? " fails its checksum" : " is incomplete") +
+                                          "; the last " + to_string(data.size() - pos) + " bytes are unreadable");
+                return;
+            }
+            fn(k, v);
+        }
+    }
+
+    // Replays a log into m; anything unreadable is logged and dropped.
+    void replayWal(const string &path, Memtable &m) {
+        IntegrityReport report;
+        walkWal(path, report, [&](const string &k, const LsmValue &v) { insert(m, k, v); });
+        for (auto &p : report.problems) cerr << "LSM recovery: " << p << endl;
+    }
+
+    static void insert(Memtable &m, const string &key, const LsmValue &v) {
+        auto it = m.data.find(key);
+        if (it == m.data.end()) { m.bytes += key.size() + 64; it = m.data.emplace(key, nullopt).first; }
+        m.bytes -= it->second ? it->second->size() : 0;
+        m.bytes += v ? v->size() : 0;
+        it->second = v;
+    }
+
+    void writeManifest() { // caller holds mtx
+        string text = "next " + to_string(nextFile) + "\n";
+        for (auto &s : segments) text += "seg " + to_string(s->number) + "\n";
+        char crc[24];
+        snprintf(crc, sizeof crc, "crc %08x\n", Crc32c::of(text));
+        text += crc;
+        string tmp = dir + "/MANIFEST.tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw ShopException("Cannot write " + tmp);
+        try { LsmCodec::writeAll(fd, text, tmp); } catch (...) { close(fd); throw; }
+        bool synced = fdatasync(fd) == 0;
+        close(fd);
+        if (!synced || rename(tmp.c_str(), (dir + "/MANIFEST").c_str()) != 0) throw ShopException("Cannot install MANIFEST");
+    }
+
+    shared_ptr<const LsmSegment> writeSegment(MergeCursor &&src, size_t expectedKeys, bool dropTombstones) {
+        uint64_t number;
+        {
+            lock_guard<mutex> lk(mtx);
+            number = nextFile++;
+        }
+        LsmSegmentWriter w(file("seg-", number, ".sst"), expectedKeys);
+        for (; src.valid(); src.next())
+            if (src.value() || !dropTombstones) w.add(src.key(), src.value());
+        if (w.count() == 0) return nullptr;
+        w.finish();
+        return make_shared<const LsmSegment>(number, file("seg-", number, ".sst"));
+    }
+
+    void flushOldest() {
+        shared_ptr<const Memtable> m;
+        {
+            lock_guard<mutex> lk(mtx);
+            m = immutables.back();
+        }
+        vector<unique_ptr<LsmCursor>> src;
+        src.push_back(make_unique<MapCursor>(m->data, ""));
+        shared_ptr<const LsmSegment> seg = writeSegment(MergeCursor(move(src)), m->data.size(), false);
+        lock_guard<mutex> lk(mtx);
+        if (seg) segments.insert(segments.begin(), seg);
+        immutables.pop_back();
+        writeManifest();
+        unlink(file("wal-", m->walNumber, ".log").c_str());
+        flushes.fetch_add(1, memory_order_relaxed);
+    }
+
+    bool sameTier(uint64_t a, uint64_t b) const {
+        if (a > b) swap(a, b);
+        return b < opts.smallSegmentBytes || static_cast<double>(b) <= opts.tierSpread * static_cast<double>(a);
+    }
+
+    // The newest run of adjacent segments, [first, last), that share a tier and are at least
+    // compactTrigger long; empty if none is. Only adjacent segments are merged, so the
+    // result can take their place without reordering versions of a key. Caller holds mtx.
+    pair<size_t, size_t> pickRun() const {
+        for (size_t i = 0; i + opts.compactTrigger <= segments.size(); ++i) {
+            uint64_t lo = segments[i]->bytes, hi = lo;
+            size_t j = i + 1;
+            for (; j < segments.size(); ++j) {
+                uint64_t b = segments[j]->bytes;
+                if (!sameTier(min(lo, b), max(hi, b))) break;
+                lo = min(lo, b);
+                hi = max(hi, b);
+            }
+            if (j - i >= opts.compactTrigger) return {i, j};
+        }
+        return {0, 0};
+    }
+    bool compactionDue() const { auto r = pickRun(); return r.first != r.second; }
+
+    void compactRun() {
+        vector<shared_ptr<const LsmSegment>> inputs;
+        bool withOldest;
+        {
+            lock_guard<mutex> lk(mtx);
+            auto run = pickRun();
+            if (run.first == run.second) return;
+            inputs.assign(segments.begin() + static_cast<ptrdiff_t>(run.first), segments.begin() + static_cast<ptrdiff_t>(run.second));
+            withOldest = run.second == segments.size();
+        }
+        vector<unique_ptr<LsmCursor>> src;
+        size_t keys = 0;
+        for (auto &s : inputs) { src.push_back(make_unique<SegmentCursor>(s, "")); keys += s->entries; }
+        shared_ptr<const LsmSegment> merged = writeSegment(MergeCursor(move(src)), keys, withOldest);
+        lock_guard<mutex> lk(mtx);
+        // Flushes may have prepended newer segments meanwhile; the run itself is unchanged.
+        auto at = segments.erase(find(segments.begin(), segments.end(), inputs.front()),
+                                 find(segments.begin(), segments.end(), inputs.back()) + 1);
+        if (merged) segments.insert(at, merged);
+        writeManifest();
+        for (auto &s : inputs) unlink(s->path.c_str()); // open readers keep their descriptors
+        compactions.fetch_add(1, memory_order_relaxed);
+    }
+
+    void backgroundLoop() {
+        unique_lock<mutex> lk(mtx);
+        for (;;) {
+            cv.wait(lk, [&] { return stopping || !immutables.empty() || compactionDue(); });
+            if (immutables.empty() && (stopping || !compactionDue())) break;
+            bool flush = !immutables.empty();
+            busy = true;
+            lk.unlock();
+            try {
+                if (flush) flushOldest(); else compactRun();
+            } catch (const ShopException &e) {
+                cerr << "LSM background " << (flush ? "flush" : "compaction") << " failed: " << e.what() << endl;
+                lk.lock();
+                busy = false;
+                cv.notify_all();
+                cv.wait_for(lk, chrono::seconds(1));
+                continue;
+            }
+            lk.lock();
+            busy = false;
+            cv.notify_all();
+        }
+    }
+
+    void rollWal() { // caller holds mtx
+        close(walFd);
+        immutables.push_front(active);
+        openWal();
+        cv.notify_all();
+    }
+
+    // A failed write or sync is cut back off the log, so a torn record cannot hide the
+    // records after it from recovery and a write reported as failed is not replayed. If
+    // the log cannot be cut back, the record may survive, so it is applied after all: the
+    // memtable is frozen and, for a synced write, flushed to a segment before returning.
+    void apply(const string &key, const LsmValue &v, bool sync) {
+        string rec;
+        LsmCodec::putRecord(rec, key, v);
+        unique_lock<mutex> lk(mtx);
+        cv.wait(lk, [&] { return immutables.size() < opts.maxImmutables; });
+        try {
+            LsmCodec::writeAll(walFd, rec, "write-ahead log");
+            if (sync && fdatasync(walFd) != 0) throw ShopException("Cannot sync write-ahead log");
+        } catch (const ShopException &e) {
+            if (ftruncate(walFd, walBytes) == 0 && (!sync || fdatasync(walFd) == 0)) throw;
+            cerr << "LSM: " << e.what() << " and the log cannot be cut back; keeping the record" << endl;
+            insert(*active, key, v);
+            shared_ptr<const Memtable> frozen = active;
+            rollWal();
+            if (sync) cv.wait(lk, [&] { return find(immutables.begin(), immutables.end(), frozen) == immutables.end(); });
+            return;
+        }
+        walBytes += static_cast<off_t>(rec.size());
+        insert(*active, key, v);
+        if (active->bytes >= opts.memtableBytes) rollWal();
+    }
+
+public:
+    explicit LsmStore(string directory, LsmOptions o = {}) : dir(move(directory)), opts(o) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) throw ShopException("Cannot create " + dir);
+        for (uint64_t n : readManifest(dir, nextFile)) segments.push_back(make_shared<const LsmSegment>(n, file("seg-", n, ".sst")));
+        // Memtables that never reached a segment: replay their logs, oldest first, and flush them.
+        vector<pair<uint64_t, string>> wals;
+        if (DIR *d = opendir(dir.c_str())) {
+            while (dirent *e = readdir(d)) {
+                unsigned long long num;
+                char tail[8];
+                if (sscanf(e->d_name, "wal-%llu.%3s", &num, tail) == 2 && string(tail) == "log") wals.emplace_back(num, dir + "/" + e->d_name);
+                if (sscanf(e->d_name, "seg-%llu.%3s", &num, tail) == 2 || sscanf(e->d_name, "wal-%llu", &num) == 1)
+                    nextFile = max<uint64_t>(nextFile, num + 1);
+            }
+            closedir(d);
+        }
+        sort(wals.begin(), wals.end());
+        if (!wals.empty()) {
+            auto recovered = make_shared<Memtable>();
+            for (auto &w : wals) replayWal(w.second, *recovered);
+            if (!recovered->data.empty()) {
+                immutables.push_front(recovered);
+                flushOldest();
+            }
+            for (auto &w : wals) unlink(w.second.c_str());
+            writeManifest();
+        }
+        openWal();
+        worker = thread([this] { backgroundLoop(); });
+    }
+    LsmStore(const LsmStore&) = delete;
+    LsmStore& operator=(const LsmStore&) = delete;
+
+    // Frozen memtables are flushed before returning; the active one stays in its log.
+    ~LsmStore() override {
+        {
+            lock_guard<mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+        close(walFd);
+    }
+
+    void put(const string &key, const string &value, bool sync = false) override { apply(key, value, sync); }
+    void remove(const string &key, bool sync = false) override { apply(key, nullopt, sync); }
+
+    optional<string> get(const string &key) override {
+        vector<shared_ptr<const LsmSegment>> segs;
+        {
+            lock_guard<mutex> lk(mtx);
+            auto it = active->data.find(key);
+            if (it != active->data.end()) return it->second;
+            for (auto &m : immutables) {
+                auto jt = m->data.find(key);
+                if (jt != m->data.end()) return jt->second;
+            }
+            segs = segments;
+        }
+        for (auto &s : segs) {
+            if (!s->mayContain(key)) { bloomSkips.fetch_add(1, memory_order_relaxed); continue; }
+            segmentProbes.fetch_add(1, memory_order_relaxed);
+            if (optional<LsmValue> v = s->find(key)) return *v;
+        }
+        return nullopt;
+    }
+
+    void scan(const string &prefix, const function<void(const string &key, const string &value)> &fn) override {
+        auto snapshot = make_shared<Memtable>();
+        vector<unique_ptr<LsmCursor>> src;
+        vector<shared_ptr<const Memtable>> frozen;
+        vector<shared_ptr<const LsmSegment>> segs;
+        {
+            lock_guard<mutex> lk(mtx);
+            for (auto it = active->data.lower_bound(prefix); it != active->data.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+                snapshot->data.insert(*it);
+            frozen.assign(immutables.begin(), immutables.end());
+            segs = segments;
+        }
+        src.push_back(make_unique<MapCursor>(snapshot->data, prefix));
+        for (auto &m : frozen) src.push_back(make_unique<MapCursor>(m->data, prefix));
+        for (auto &s : segs) src.push_back(make_unique<SegmentCursor>(s, prefix));
+        for (MergeCursor c(move(src)); c.valid() && c.key().compare(0, prefix.size(), prefix) == 0; c.next())
+            if (c.value()) fn(c.key(), *c.value());
+    }
+
+    // Freezes the active memtable and waits until every memtable is in a segment.
+    void flush() {
+        unique_lock<mutex> lk(mtx);
+        if (!active->data.empty()) rollWal();
+        cv.wait(lk, [&] { return immutables.empty() && !busy; });
+    }
+
+    // Waits for flushes and any compaction the current segments call for.
+    void settle() {
+        unique_lock<mutex> lk(mtx);
+        cv.wait(lk, [&] { return immutables.empty() && !busy && !compactionDue(); });
+    }
+
+    // Checks a store directory without opening it: the MANIFEST, every block of every live
+    // segment and every log record. Run it on a store no process has open.
+    static IntegrityReport verify(const string &directory) {
+        IntegrityReport r;
+        r.kind = "LSM store";
+        uint64_t next = 0;
+        vector<uint64_t> segs;
+        try {
+            segs = readManifest(directory, next);
+        } catch (const ShopException &e) {
+            r.problems.push_back(e.what());
+        }
+        for (uint64_t n : segs) {
+            try {
+                LsmSegment seg(n, fileIn(directory, "seg-", n, ".sst"));
+                for (size_t b = 0; b < seg.blockCount(); ++b) {
+                    try {
+                        seg.readBlock(b);
+                        ++r.blocks;
+                    } catch (const ShopException &e) {
+                        r.problems.push_back(e.what());
+                    }
+                }
+                r.records += seg.entries;
+            } catch (const ShopException &e) {
+                r.problems.push_back(e.what());
+            }
+        }
+        vector<string> wals;
+        if (DIR *d = opendir(directory.c_str())) {
+            while (dirent *e = readdir(d))
+                if (strncmp(e->d_name, "wal-", 4) == 0) wals.push_back(directory + "/" + e->d_name);
+            closedir(d);
+        }
+        sort(wals.begin(), wals.end());
+        for (auto &w : wals) walkWal(w, r, [](const string&, const LsmValue&) {});
+        return r;
+    }
+
+    string statsJson() const {
+        lock_guard<mutex> lk(mtx);
+        uint64_t entries = 0;
+        for (auto &s : segments) entries += s->entries;
+        char buf[320];
+        snprintf(buf, sizeof buf, "{\"memtable_bytes\":%zu,\"immutable_memtables\":%zu,\"segments\":%zu,\"segment_entries\":%llu,"
+                 "\"flushes\":%llu,\"compactions\":%llu,\"bloom_skips\":%llu,\"segment_probes\":%llu}",
+                 active->bytes, immutables.size(), segments.size(), static_cast<unsigned long long>(entries),
+                 static_cast<unsigned long long>(flushes.load()), static_cast<unsigned long long>(compactions.load()),
+                 static_cast<unsigned long long>(bloomSkips.load()), static_cast<unsigned long long>(segmentProbes.load()));
+        return buf;
+    }
+};
+
+// -------------------- Order journal on the store --------------------
+// One synchronously written record per order under o/<id>, same line format as the file journals.
+class LsmJournal : public OrderJournal {
+private:
+    KvStore &store;
+public:
+    explicit LsmJournal(KvStore &s) : store(s) {
+        int last = 0;
+        store.scan("o/", [&](const string &key, const string&) { last = max(last, stoi(key.substr(2))); });
+        Order::continueAfter(last);
+    }
+    void commit(const Order &o) override {
+        char key[24];
+        snprintf(key, sizeof key, "o/%012d", o.getId());
+        store.put(key, record(o), true);
+    }
+};
+
+// Writes keys in random order through several flushes and compactions, then times hits and misses.
+void runStoreBench(const string &dir, long keys, int valueBytes);
+
+// Checks a snapshot, an order journal or (given a directory) an LSM store and prints what
+// is intact and where any damage is. Returns 0 if every checksum matches, else 2.
+int runVerify(const string &path);
+
+// Seeds the shared Inventory, keeps writers running reduceStock/restock, and compares how long
+// they stall behind saveToFile against a forked checkpoint of the same catalog.
+void runCheckpointBench(const string &file, int products, int writers);
+
+// Builds a store-only catalog (StoreCatalog, in shop_store.cpp) of `products` in dir and
+// times skewed lookups through a cache of `cacheEntries` against the bare store, then
+// checks that a full scan leaves the hot set cached and that price and stock changes are
+// never served stale.
+void runCacheBench(const string &dir, int products, size_t cacheEntries, long lookups);
+
+#endif // SHOP_STORE_HPP
@@ -0,0 +1,311 @@
+// shop_stress.cpp
+// Concurrency stress tool for Inventory and ShopService.
+// Every round hammers a few hot products from several threads and then checks:
+//  1. linearizability: the recorded reduceStock/restock/stock-read history of each
+//     product (checked per product, which suffices because linearizability is local)
+//     must be explainable by some sequential order that respects real time;
+//  2. stock conservation under checkout: initial + restocked - taken - sold == final,
+//     and stock never goes negative (no overselling);
+//  3. the work-stealing pool runs every task exactly once while nested fan-outs grow
+//     the owner's deque under thieves, and the stock they move is conserved.
+// Usage: shop_stress [--rounds=50] [--threads=4] [--ops=200] [--products=2] [--stock=40]
+// Build with -DSHOP_SANITIZE=thread to run it under ThreadSanitizer.
+
+#include "shop_runtime.hpp"
+
+// -------------------- History --------------------
+struct HistoryOp {
+    enum class Kind { Reduce, Restock, Read } kind;
+    int product;
+    int qty;           // Reduce/Restock amount
+    int result;        // Reduce: 1 ok / 0 refused; Read: observed stock
+    uint64_t invoke;   // logical timestamps from one global counter
+    uint64_t response;
+};
+
+static atomic<uint64_t> logicalClock{0};
+
+// -------------------- Linearizability checker --------------------
+// Wing & Gong search with Lowe's memoization: walk the call/return list, tentatively
+// linearize any pending call whose effect matches the sequential stock model, backtrack
+// on the first return whose call could not be placed. (linearized set, stock) pairs
+// already explored are cached.
+class StockLinearizabilityChecker {
+private:
+    struct Entry {
+        bool isCall;
+        size_t op;
+        int prev, next;
+        int match; // call <-> return entry
+    };
+
+    static bool apply(const HistoryOp &op, int stock, int &after) {
+        switch (op.kind) {
+            case HistoryOp::Kind::Reduce: {
+                bool ok = op.qty > 0 && op.qty <= stock;
+                if (ok != (op.result == 1)) return false;
+                after = ok ? stock - op.qty : stock;
+                return true;
+            }
+            case HistoryOp::Kind::Restock: after = stock + (op.qty > 0 ? op.qty : 0); return true;
+            case HistoryOp::Kind::Read: after = stock; return op.result == stock;
+        }
+        return false;
+    }
+
+public:
+    static bool check(const vector<HistoryOp> &ops, int initialStock) {
+        size_t n = ops.size();
+        if (n == 0) return true;
+        vector<pair<uint64_t, int>> events; // time, entry index
+        vector<Entry> entries(2 * n + 1);
+        for (size_t i = 0; i < n; ++i) {
+            entries[2 * i + 1] = {true, i, 0, 0, static_cast<int>(2 * i + 2)};
+            entries[2 * i + 2] = {false, i, 0, 0, static_cast<int>(2 * i + 1)};
+            events.emplace_back(ops[i].invoke, static_cast<int>(2 * i + 1));
+            events.emplace_back(ops[i].response, static_cast<int>(2 * i + 2));
+        }
+        sort(events.begin(), events.end());
+        // entries[0] is the list head sentinel
+        int prev = 0;
+        for (auto &e : events) { entries[prev].next = e.second; entries[e.second].prev = prev; prev = e.second; }
+        entries[prev].next = -1;
+
+        auto lift = [&](int call) {
+            int ret = entries[call].match;
+            entries[entries[call].prev].next = entries[call].next;
+            if (entries[call].next >= 0) entries[entries[call].next].prev = entries[call].prev;
+            entries[entries[ret].prev].next = entries[ret].next;
+            if (entries[ret].next >= 0) entries[entries[ret].next].prev = entries[ret].prev;
+        };
+        auto unlift = [&](int call) {
+            int ret = entries[call].match;
+            entries[entries[ret].prev].next = ret;
+            if (entries[ret].next >= 0) entries[entries[ret].next].prev = ret;
+            entries[entries[call].prev].next = call;
+            if (entries[call].next >= 0) entries[entries[call].next].prev = call;
+        };
+
+        vector<uint64_t> linearized((n + 63) / 64, 0);
+        auto key = [&](int stock) {
+            string k(reinterpret_cast<const char*>(linearized.data()), linearized.size() * sizeof(uint64_t));
+            k.append(reinterpret_cast<const char*>(&stock), sizeof stock);
+            return k;
+        };
+        unordered_set<string> seen;
+        vector<pair<int, int>> stack; // (call entry, stock before it)
+        int stock = initialStock;
+        int cur = entries[0].next;
+        while (entries[0].next >= 0) {
+            if (cur < 0) return false;
+            Entry &e = entries[cur];
+            if (e.isCall) {
+                int after;
+                size_t op = e.op;
+                if (apply(ops[op], stock, after)) {
+                    linearized[op / 64] |= 1ULL << (op % 64);
+                    if (seen.insert(key(after)).second) {
+                        stack.emplace_back(cur, stock);
+                        stock = after;
+                        lift(cur);
+                        cur = entries[0].next;
+                        continue;
+                    }
+                    linearized[op / 64] &= ~(1ULL << (op % 64));
+                }
+                cur = e.next;
+            } else {
+                if (stack.empty()) return false;
+                auto top = stack.back();
+                stack.pop_back();
+                stock = top.second;
+                size_t op = entries[top.first].op;
+                linearized[op / 64] &= ~(1ULL << (op % 64));
+                unlift(top.first);
+                cur = entries[top.first].next;
+            }
+        }
+        return true;
+    }
+};
+
+// -------------------- Rounds --------------------
+struct StressConfig {
+    int rounds = 50;
+    int threads = 4;
+    int opsPerThread = 200;
+    int products = 2;
+    int stock = 40;
+};
+
+// Direct Inventory traffic with every call recorded; returns false on a violation.
+bool linearizabilityRound(const StressConfig &cfg, int round, int firstId) {
+    Inventory &inv = Inventory::instance();
+    for (int p = 0; p < cfg.products; ++p) inv.addProduct(Product(firstId + p, "Hot " + to_string(p), 9.99, cfg.stock));
+    vector<vector<HistoryOp>> perThread(static_cast<size_t>(cfg.threads));
+    vector<thread> threads;
+    for (int t = 0; t < cfg.threads; ++t) {
+        threads.emplace_back([&, t] {
+            mt19937 rng(static_cast<unsigned>(round * 131 + t));
+            auto &log = perThread[static_cast<size_t>(t)];
+            for (int i = 0; i < cfg.opsPerThread; ++i) {
+                HistoryOp op{};
+                op.product = firstId + static_cast<int>(rng() % static_cast<unsigned>(cfg.products));
+                unsigned dice = rng() % 10;
+                op.kind = dice < 6 ? HistoryOp::Kind::Reduce : dice < 8 ? HistoryOp::Kind::Restock : HistoryOp::Kind::Read;
+                op.qty = 1 + static_cast<int>(rng() % 3);
+                op.invoke = logicalClock.fetch_add(1);
+                switch (op.kind) {
+                    case HistoryOp::Kind::Reduce: op.result = inv.reduceStock(op.product, op.qty) ? 1 : 0; break;
+                    case HistoryOp::Kind::Restock: inv.restock(op.product, op.qty); break;
+                    case HistoryOp::Kind::Read: op.result = inv.getProduct(op.product).getStock(); break;
+                }
+                op.response = logicalClock.fetch_add(1);
+                log.push_back(op);
+            }
+        });
+    }
+    for (auto &t : threads) t.join();
+
+    for (int p = 0; p < cfg.products; ++p) {
+        vector<HistoryOp> history;
+        for (auto &log : perThread)
+            for (auto &op : log) if (op.product == firstId + p) history.push_back(op);
+        if (StockLinearizabilityChecker::check(history, cfg.stock)) continue;
+        cerr << "Round " << round << ": history of product " << firstId + p << " is not linearizable\n";
+        for (auto &op : history)
+            cerr << "  [" << op.invoke << "," << op.response << "] "
+                 << (op.kind == HistoryOp::Kind::Reduce ? "reduce " : op.kind == HistoryOp::Kind::Restock ? "restock " : "read ")
+                 << op.qty << " -> " << op.result << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Checkouts through ShopService racing with direct reserve/restock traffic.
+bool conservationRound(const StressConfig &cfg, int round, int firstId) {
+    Inventory &inv = Inventory::instance();
+    for (int p = 0; p < cfg.products; ++p) inv.addProduct(Product(firstId + p, "Hot " + to_string(p), 9.99, cfg.stock));
+    ShopService shop(inv);
+    vector<long> taken(static_cast<size_t>(cfg.products)), restocked(static_cast<size_t>(cfg.products)), sold(static_cast<size_t>(cfg.products));
+    mutex tally;
+    vector<thread> threads;
+    for (int t = 0; t < cfg.threads; ++t) {
+        threads.emplace_back([&, t] {
+            mt19937 rng(static_cast<unsigned>(round * 257 + t));
+            vector<long> myTaken(taken.size()), myRestocked(taken.size()), mySold(taken.size());
+            int cartId = round * 1000 + t;
+            InstantPayment payment;
+            for (int i = 0; i < cfg.opsPerThread; ++i) {
+                size_t p = rng() % static_cast<unsigned>(cfg.products);
+                int qty = 1 + static_cast<int>(rng() % 3);
+                unsigned dice = rng() % 10;
+                if (dice < 3) { if (inv.reduceStock(firstId + static_cast<int>(p), qty)) myTaken[p] += qty; }
+                else if (dice < 5) { inv.restock(firstId + static_cast<int>(p), qty); myRestocked[p] += qty; }
+                else {
+                    shop.addToCart(cartId, firstId + static_cast<int>(p), qty);
+                    shop.addToCart(cartId, firstId + static_cast<int>((p + 1) % static_cast<size_t>(cfg.products)), 1);
+                    try {
+                        Order o = shop.checkout(cartId, payment);
+                        for (auto &ci : o.getItems()) mySold[static_cast<size_t>(ci.product.getId() - firstId)] += ci.quantity;
+                    } catch (const ShopException&) {
+                        shop.clearCart(cartId);
+                    }
+                }
+            }
+            lock_guard<mutex> lk(tally);
+            for (size_t p = 0; p < taken.size(); ++p) { taken[p] += myTaken[p]; restocked[p] += myRestocked[p]; sold[p] += mySold[p]; }
+        });
+    }
+    for (auto &t : threads) t.join();
+
+    bool ok = true;
+    for (int p = 0; p < cfg.products; ++p) {
+        int finalStock = inv.getProduct(firstId + p).getStock();
+        long expected = cfg.stock + restocked[static_cast<size_t>(p)] - taken[static_cast<size_t>(p)] - sold[static_cast<size_t>(p)];
+        if (finalStock == expected && finalStock >= 0) continue;
+        cerr << "Round " << round << ": product " << firstId + p << " has stock " << finalStock << ", expected " << expected
+             << " (initial " << cfg.stock << ", restocked " << restocked[static_cast<size_t>(p)] << ", taken "
+             << taken[static_cast<size_t>(p)] << ", sold " << sold[static_cast<size_t>(p)] << ")\n";
+        ok = false;
+    }
+    return ok;
+}
+
+// Tasks fanned out from inside the pool land on one worker's deque (past its initial
+// capacity, so it grows while others steal); more arrive through the inboxes from outside.
+bool poolRound(const StressConfig &cfg, int round, int firstId) {
+    Inventory &inv = Inventory::instance();
+    for (int p = 0; p < cfg.products; ++p) inv.addProduct(Product(firstId + p, "Hot " + to_string(p), 9.99, cfg.stock));
+    size_t fanOut = static_cast<size_t>(cfg.threads) * static_cast<size_t>(cfg.opsPerThread);
+    unique_ptr<atomic<int>[]> runs(new atomic<int>[2 * fanOut]());
+    unique_ptr<atomic<long>[]> taken(new atomic<long>[static_cast<size_t>(cfg.products)]());
+    unique_ptr<atomic<long>[]> restocked(new atomic<long>[static_cast<size_t>(cfg.products)]());
+    auto work = [&](size_t i) {
+        runs[i].fetch_add(1, memory_order_relaxed);
+        size_t p = (i * 7 + static_cast<size_t>(round)) % static_cast<size_t>(cfg.products);
+        int qty = 1 + static_cast<int>(i % 3);
+        if (i % 4 == 0) { inv.restock(firstId + static_cast<int>(p), qty); restocked[p] += qty; }
+        else if (inv.reduceStock(firstId + static_cast<int>(p), qty)) taken[p] += qty;
+    };
+    {
+        WorkStealingPool pool(static_cast<unsigned>(cfg.threads));
+        pool.post([&] { for (size_t i = 0; i < fanOut; ++i) pool.post([&work, i] { work(i); }); });
+        vector<future<size_t>> results;
+        for (size_t i = fanOut; i < 2 * fanOut; ++i) results.push_back(pool.submit([&work, i] { work(i); return i; }));
+        pool.waitIdle();
+        for (size_t i = fanOut; i < 2 * fanOut; ++i) {
+            if (results[i - fanOut].get() == i) continue;
+            cerr << "Round " << round << ": pool task " << i << " returned the wrong result\n";
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < 2 * fanOut; ++i) {
+        if (runs[i].load() == 1) continue;
+        cerr << "Round " << round << ": pool task " << i << " ran " << runs[i].load() << " times\n";
+        return false;
+    }
+    bool ok = true;
+    for (int p = 0; p < cfg.products; ++p) {
+        int finalStock = inv.getProduct(firstId + p).getStock();
+        long expected = cfg.stock + restocked[static_cast<size_t>(p)] - taken[static_cast<size_t>(p)];
+        if (finalStock == expected && finalStock >= 0) continue;
+        cerr << "Round " << round << ": product " << firstId + p << " has stock " << finalStock << " after the pool round, expected "
+             << expected << "\n";
+        ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    map<string, string> options;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        size_t eq = a.find('=');
+        if (a.rfind("--", 0) != 0) { cerr << "Unexpected argument " << a << endl; return 1; }
+        options[a.substr(2, eq == string::npos ? string::npos : eq - 2)] = eq == string::npos ? "" : a.substr(eq + 1);
+    }
+    auto option = [&](const string &name, int def) { auto it = options.find(name); return it != options.end() ? stoi(it->second) : def; };
+    StressConfig cfg;
+    cfg.rounds = option("rounds", cfg.rounds);
+    cfg.threads = option("threads", cfg.threads);
+    cfg.opsPerThread = option("ops", cfg.opsPerThread);
+    cfg.products = option("products", cfg.products);
+    cfg.stock = option("stock", cfg.stock);
+
+    auto start = chrono::steady_clock::now();
+    int nextId = 1;
+    for (int r = 0; r < cfg.rounds; ++r) {
+        if (!linearizabilityRound(cfg, r, nextId)) return 1;
+        nextId += cfg.products;
+        if (!conservationRound(cfg, r, nextId)) return 1;
+        nextId += cfg.products;
+        if (!poolRound(cfg, r, nextId)) return 1;
+        nextId += cfg.products;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << cfg.rounds << " rounds x " << cfg.threads << " threads x " << cfg.opsPerThread << " ops on " << cfg.products
+         << " hot products: linearizable, stock conserved, pool tasks ran once (" << fixed << setprecision(2) << secs << "s)\n";
+    return 0;
+}